@@ -0,0 +1,134 @@
+// Compares the durability modes on one disk. Each mode writes the same
+// files through the write pipeline the way concurrent downloads do (one
+// thread per file, curl-sized appends, pausing when the pool is exhausted)
+// and is timed until every file is committed.
+//
+//   durability_bench [directory] [MiB per file] [files]
+
+#include "downloader/file_writer.h"
+#include "downloader/write_pipeline.h"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace downloader;
+
+constexpr std::size_t kAppendSize = 16 * 1024;
+
+struct ModeResult {
+    double seconds{0.0};
+    PipelineStats stats;
+    std::string error;
+};
+
+// Writes one file as a single download would: appends from the transfer
+// thread, a pause whenever the pool is exhausted, and a commit at the end.
+std::string write_file(WritePipeline& pipeline,
+                       const std::string& path,
+                       std::uint64_t size,
+                       Durability durability,
+                       const std::vector<char>& chunk) {
+    try {
+        FileWriter file(path, FileWriter::Mode::Truncate, durability);
+        WriteStream stream(pipeline, file, 0);
+        // A failed write stops the appends; finish() then returns its error.
+        bool failed = false;
+        for (std::uint64_t written = 0; written < size && !failed;) {
+            const auto piece = static_cast<std::size_t>(std::min<std::uint64_t>(kAppendSize, size - written));
+            switch (stream.append(chunk.data(), piece)) {
+                case WriteStream::Status::Accepted:
+                    written += piece;
+                    break;
+                case WriteStream::Status::PoolExhausted:
+                    while (!pipeline.has_free_buffer()) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    }
+                    break;
+                case WriteStream::Status::WriteFailed:
+                    failed = true;
+                    break;
+            }
+        }
+        std::string error;
+        if (!stream.finish(error)) {
+            return error;
+        }
+        file.commit();
+        return {};
+    } catch (const std::exception& ex) {
+        return ex.what();
+    }
+}
+
+ModeResult run_mode(const std::filesystem::path& directory,
+                    Durability durability,
+                    std::uint64_t file_size,
+                    std::size_t files,
+                    const std::vector<char>& chunk) {
+    WritePipeline pipeline;
+    std::vector<std::string> errors(files);
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> writers;
+        for (std::size_t i = 0; i < files; ++i) {
+            writers.emplace_back([&, i]() {
+                const auto path = directory / ("durability_bench." + std::to_string(i));
+                errors[i] = write_file(pipeline, path.string(), file_size, durability, chunk);
+            });
+        }
+    }
+    ModeResult result;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.stats = pipeline.stats();
+    for (std::size_t i = 0; i < files; ++i) {
+        std::filesystem::remove(directory / ("durability_bench." + std::to_string(i)));
+        if (result.error.empty()) {
+            result.error = errors[i];
+        }
+    }
+    return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const std::filesystem::path directory = argc > 1 ? argv[1] : ".";
+    const std::uint64_t mib_per_file = argc > 2 ? std::stoull(argv[2]) : 256;
+    const std::size_t files = argc > 3 ? std::stoul(argv[3]) : 4;
+    const std::uint64_t file_size = mib_per_file << 20;
+
+    std::vector<char> chunk(kAppendSize);
+    for (std::size_t i = 0; i < chunk.size(); ++i) {
+        chunk[i] = static_cast<char>(i * 131 + 7);
+    }
+
+    std::cout << "Writing " << files << " x " << mib_per_file << " MiB to " << directory.string() << '\n';
+    const std::pair<const char*, Durability> modes[] = {
+        {"none", Durability::None},
+        {"sync", Durability::SyncOnComplete},
+        {"stream", Durability::Streaming},
+    };
+    int exit_code = 0;
+    for (const auto& [name, durability] : modes) {
+        const ModeResult result = run_mode(directory, durability, file_size, files, chunk);
+        if (!result.error.empty()) {
+            std::cerr << name << ": " << result.error << '\n';
+            exit_code = 1;
+            continue;
+        }
+        const double mib = static_cast<double>(file_size * files) / (1024.0 * 1024.0);
+        std::cout << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(9) << result.seconds << " s" << std::setw(10) << mib / result.seconds << " MiB/s"
+                  << "  peak " << result.stats.peak_buffers_in_use << '/' << result.stats.buffer_count
+                  << " buffers, " << result.stats.pauses << " pauses\n";
+    }
+    return exit_code;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+namespace downloader {
+
+struct CallbackAllocationStats {
+    std::uint64_t callbacks{0};
+    std::uint64_t allocations{0};
+};
+
+// Heap allocation accounting for the transfer hot path. When the library is
+// configured with -DDOWNLOADER_COUNT_ALLOCATIONS=ON it replaces the global
+// operator new with one that counts allocations per thread, and transports
+// wrap their header, write and progress callbacks in an
+// AllocationCounter::CallbackScope. Without the option nothing is replaced
+// and every scope compiles away.
+class AllocationCounter {
+public:
+#if defined(DOWNLOADER_COUNT_ALLOCATIONS)
+    static constexpr bool kEnabled = true;
+#else
+    static constexpr bool kEnabled = false;
+#endif
+
+    // Allocations made by the calling thread so far.
+    static std::uint64_t thread_allocations();
+    // Totals over every callback scope, from all threads.
+    static CallbackAllocationStats callback_stats();
+
+    class CallbackScope {
+    public:
+#if defined(DOWNLOADER_COUNT_ALLOCATIONS)
+        CallbackScope();
+        ~CallbackScope();
+
+    private:
+        std::uint64_t start_;
+        bool outermost_;
+#else
+        // User-provided so that an otherwise unused scope does not warn.
+        CallbackScope() {}
+#endif
+        CallbackScope(const CallbackScope&) = delete;
+        CallbackScope& operator=(const CallbackScope&) = delete;
+    };
+};
+
+}  // namespace downloader
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "downloader/download_manager.h"
+#include "downloader/thread_pool.h"
+#include "downloader/transport.h"
+#include "downloader/types.h"
+#include "downloader/write_pipeline.h"
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+namespace downloader {
+
+class AsyncClient;
+
+// Awaitable returned by AsyncClient::download(). The download starts when the
+// awaitable is co_awaited. The awaiting coroutine holds no thread while
+// suspended, and it is resumed on the client's executor, after the client is
+// done with the download, so it may destroy the client it awaited.
+class DownloadOperation {
+public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> continuation);
+    DownloadResult await_resume() { return std::move(*result_); }
+
+private:
+    friend class AsyncClient;
+
+    DownloadOperation(AsyncClient& client, DownloadRequest request)
+        : client_(&client), request_(std::move(request)) {}
+
+    AsyncClient* client_;
+    DownloadRequest request_;
+    std::optional<DownloadResult> result_;
+};
+
+// Embeddable front end for downloads that are started at any time, from any
+// thread, while others are still running; results arrive via a completion
+// callback or by co_awaiting the returned operation.
+//
+// A running download holds no thread. Its probe and fetches are started on
+// the transport, which for libcurl drives all of them from one curl_multi
+// event loop, and the download moves on from their completions. The steps
+// that block (opening the output, hashing a file in sync mode, flushing and
+// committing it) run on the executor, as do completion handlers and coroutine
+// resumptions. Requests with hedging, piece hashes or a delta block map are
+// handed to DownloadManager instead, whose scheduling still holds a worker,
+// and a thread per range, for the whole download.
+class AsyncClient {
+public:
+    using CompletionHandler = DownloadManager::CompletionHandler;
+
+    // Without a transport, downloads go over libcurl. Without an executor, the
+    // client owns one of `worker_count` threads, two at least. `worker_count`
+    // also sizes the pool for the requests handed to DownloadManager.
+    explicit AsyncClient(std::size_t worker_count,
+                         PipelineConfig pipeline = {},
+                         std::shared_ptr<Transport> transport = nullptr,
+                         std::shared_ptr<ThreadPool> executor = nullptr);
+    // Waits for every download that has been started to finish.
+    ~AsyncClient();
+
+    AsyncClient(const AsyncClient&) = delete;
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    [[nodiscard]] DownloadOperation download(DownloadRequest request);
+    // The handler runs on the executor. It must not destroy the client.
+    DownloadStatePtr download(DownloadRequest request, CompletionHandler on_complete);
+
+    std::size_t in_flight() const;
+    PipelineStats pipeline_stats() const { return manager_.pipeline_stats(); }
+
+private:
+    friend class DownloadOperation;
+    class Download;
+
+    // Runs the download and hands its result to `deliver` on the executor.
+    // `deliver` must call finished().
+    DownloadStatePtr start(DownloadRequest request, CompletionHandler deliver);
+    void post(std::function<void()> job);
+    void finished();
+
+    mutable std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    std::size_t in_flight_{0};
+    DownloadManager manager_;
+    std::shared_ptr<ThreadPool> executor_;
+};
+
+}  // namespace downloader
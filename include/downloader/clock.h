@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+namespace downloader {
+
+// Time source for the scheduler. The system clock is steady_clock; a
+// simulated clock only moves forward once every thread that could still act
+// at the current instant is waiting on it, so scheduling decisions made in
+// virtual time are the same on every run.
+class Clock {
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    virtual ~Clock() = default;
+
+    virtual time_point now() const = 0;
+
+    // Blocks until `ready()` holds or `deadline` passes; time_point::max()
+    // waits for `ready()` alone. `ready` is re-checked whenever notify() is
+    // called.
+    virtual void wait_until(time_point deadline, const std::function<bool()>& ready) = 0;
+    virtual void notify() = 0;
+
+    // Activity accounting for simulated clocks. begin_activity() is called on
+    // behalf of a thread that is about to run work (before it is woken or
+    // started), end_activity() by that thread once it has nothing left to do.
+    virtual void begin_activity() {}
+    virtual void end_activity() {}
+};
+
+class SystemClock final : public Clock {
+public:
+    time_point now() const override { return std::chrono::steady_clock::now(); }
+
+    void wait_until(time_point deadline, const std::function<bool()>& ready) override {
+        std::unique_lock lock(mutex_);
+        if (deadline == time_point::max()) {
+            cv_.wait(lock, ready);
+        } else {
+            cv_.wait_until(lock, deadline, ready);
+        }
+    }
+
+    void notify() override {
+        { std::scoped_lock lock(mutex_); }
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+}  // namespace downloader
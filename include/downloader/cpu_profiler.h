@@ -0,0 +1,147 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace downloader {
+
+enum class CpuPhase : std::uint8_t {
+    Probe,
+    Transfer,
+    DiskWrite,
+    Hashing
+};
+
+inline constexpr std::size_t kCpuPhaseCount = 4;
+
+inline const char* to_string(CpuPhase phase) {
+    switch (phase) {
+        case CpuPhase::Probe: return "probe";
+        case CpuPhase::Transfer: return "transfer";
+        case CpuPhase::DiskWrite: return "disk write";
+        case CpuPhase::Hashing: return "hashing";
+    }
+    return "unknown";
+}
+
+// Counts accumulated over some stretch of work. Counters the host does not
+// provide stay zero; see CpuCounterSupport.
+struct CpuCounts {
+    std::uint64_t cycles{0};
+    std::uint64_t instructions{0};
+    std::uint64_t context_switches{0};
+    std::uint64_t syscalls{0};
+    // Thread CPU time, user plus system.
+    std::uint64_t cpu_ns{0};
+
+    CpuCounts& operator+=(const CpuCounts& other) {
+        cycles += other.cycles;
+        instructions += other.instructions;
+        context_switches += other.context_switches;
+        syscalls += other.syscalls;
+        cpu_ns += other.cpu_ns;
+        return *this;
+    }
+};
+
+// Which perf_event counters could be opened. Context switches fall back to
+// getrusage when the perf software counter is not available.
+struct CpuCounterSupport {
+    bool cycles{false};
+    bool instructions{false};
+    bool context_switches{false};
+    bool syscalls{false};
+    // False when the kernel only allows counting user-mode cycles and
+    // instructions (perf_event_paranoid >= 2).
+    bool kernel_mode{false};
+};
+
+// Per-phase totals, added to from any thread.
+class CpuAccount {
+public:
+    void add(CpuPhase phase, const CpuCounts& counts);
+    CpuCounts phase(CpuPhase phase) const;
+    CpuCounts total() const;
+
+private:
+    struct Totals {
+        std::atomic<std::uint64_t> cycles{0};
+        std::atomic<std::uint64_t> instructions{0};
+        std::atomic<std::uint64_t> context_switches{0};
+        std::atomic<std::uint64_t> syscalls{0};
+        std::atomic<std::uint64_t> cpu_ns{0};
+    };
+
+    std::array<Totals, kCpuPhaseCount> phases_;
+};
+
+// Optional per-phase CPU accounting. Each thread opens its own perf_event
+// counters (cycles, instructions, context switches, syscall entries) and
+// reads them together with its CPU clock whenever it enters or leaves a
+// Scope. A nested scope pauses the enclosing one, so every interval
+// is charged to exactly one phase: to the run, to the download the scope
+// names, and to the calling thread's label. Counters the host refuses are
+// left out; outside Linux the profiler cannot be enabled at all.
+// While disabled, each scope costs one branch on CpuProfiler::enabled().
+//
+// Scopes are placed around whole probes, transfers, buffer writes and hash
+// passes rather than around individual transport callbacks, so work done
+// inside a callback (in-stream piece hashing, direct range writes) counts
+// as transfer.
+class CpuProfiler {
+public:
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+    // Probes which counters this host allows and starts profiling. Returns
+    // false when per-thread accounting is not available on this platform.
+    // Without perf_counters no perf_event counter is opened, as on a host
+    // that refuses them all: only CPU time and getrusage context switches
+    // are recorded.
+    static bool enable(bool perf_counters = true);
+    static CpuCounterSupport support();
+
+    // Names the calling thread in thread_totals(). Threads that share a
+    // label share one account; unnamed threads are reported as "other".
+    static void set_thread_label(std::string label);
+
+    // Totals of the whole run, and per thread label sorted by label.
+    static const CpuAccount& totals();
+    static std::vector<std::pair<std::string, CpuCounts>> thread_totals();
+
+    class Scope {
+    public:
+        explicit Scope(CpuPhase phase, CpuAccount* download = nullptr) : phase_(phase), download_(download) {
+            if (enabled()) {
+                begin();
+            }
+        }
+        ~Scope() {
+            if (active_) {
+                end();
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        friend class CpuProfiler;
+
+        void begin();
+        void end();
+
+        CpuPhase phase_;
+        CpuAccount* download_;
+        Scope* outer_{nullptr};
+        bool active_{false};
+    };
+
+private:
+    static inline std::atomic<bool> enabled_{false};
+};
+
+}  // namespace downloader
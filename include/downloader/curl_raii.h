@@ -2,7 +2,9 @@
 
 #include <curl/curl.h>
 
+#include <array>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 
 namespace downloader {
@@ -40,4 +42,58 @@ inline CurlHandle make_curl_handle() {
     return handle;
 }
 
+struct CurlMultiDeleter {
+    void operator()(CURLM* handle) const {
+        if (handle != nullptr) {
+            curl_multi_cleanup(handle);
+        }
+    }
+};
+
+using CurlMultiHandle = std::unique_ptr<CURLM, CurlMultiDeleter>;
+
+inline CurlMultiHandle make_curl_multi() {
+    CurlMultiHandle handle{curl_multi_init()};
+    if (!handle) {
+        throw std::runtime_error("curl_multi_init failed");
+    }
+    return handle;
+}
+
+// Share handle for the connection cache, DNS cache and TLS sessions, so
+// transfers on different easy handles and threads reuse warm connections.
+class CurlShare {
+public:
+    CurlShare() : handle_(curl_share_init()) {
+        if (handle_ == nullptr) {
+            throw std::runtime_error("curl_share_init failed");
+        }
+        curl_share_setopt(handle_, CURLSHOPT_LOCKFUNC, &CurlShare::lock);
+        curl_share_setopt(handle_, CURLSHOPT_UNLOCKFUNC, &CurlShare::unlock);
+        curl_share_setopt(handle_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    ~CurlShare() { curl_share_cleanup(handle_); }
+
+    CurlShare(const CurlShare&) = delete;
+    CurlShare& operator=(const CurlShare&) = delete;
+
+    CURLSH* get() const { return handle_; }
+
+private:
+    static void lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        static_cast<CurlShare*>(userptr)->mutexes_[static_cast<std::size_t>(data)].lock();
+    }
+
+    static void unlock(CURL*, curl_lock_data data, void* userptr) {
+        static_cast<CurlShare*>(userptr)->mutexes_[static_cast<std::size_t>(data)].unlock();
+    }
+
+    CURLSH* handle_;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> mutexes_;
+};
+
 }  // namespace downloader
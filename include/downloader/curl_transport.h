@@ -0,0 +1,87 @@
+#pragma once
+
+#include "downloader/clock.h"
+#include "downloader/curl_raii.h"
+#include "downloader/transport.h"
+
+#include <curl/curl.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+
+namespace downloader {
+
+// Transport over libcurl. Every blocking transfer is driven through its own
+// multi handle so it can be paused for backpressure and resumed once the sink
+// has room again; requests started with start_probe() or start_fetch() all
+// share one multi handle, driven by a single event loop thread. Connections,
+// DNS and TLS sessions are shared between all of them.
+class CurlTransport final : public Transport {
+public:
+    CurlTransport();
+    // Requests still running on the event loop fail with an error.
+    ~CurlTransport() override;
+
+    ProbeResult probe(const std::string& url, std::uint32_t trace_track) override;
+    TransferOutcome fetch(const std::string& url,
+                          std::optional<ByteRange> range,
+                          TransferSink& sink,
+                          std::uint32_t trace_track,
+                          Connection connection) override;
+    TransferOutcome fetch_ranges(const std::string& url,
+                                 std::span<const ByteRange> ranges,
+                                 RangeSetSink& sink,
+                                 std::uint32_t trace_track) override;
+    void start_probe(const std::string& url, std::uint32_t trace_track, ProbeCallback done) override;
+    void start_fetch(const std::string& url,
+                     std::optional<ByteRange> range,
+                     TransferSink& sink,
+                     std::uint32_t trace_track,
+                     Connection connection,
+                     FetchCallback done) override;
+    Clock& clock() override { return clock_; }
+
+private:
+    struct Transfer {
+        TransferSink* sink{nullptr};
+        CURL* handle{nullptr};
+        bool paused{false};
+        // The sink sees the status once, with the first body bytes.
+        bool status_checked{false};
+    };
+
+    class EventLoop;
+
+    static std::size_t write_callback(char* ptr, std::size_t size, std::size_t nmemb, void* userdata);
+    static int progress_callback(void* clientp,
+                                 curl_off_t dltotal,
+                                 curl_off_t dlnow,
+                                 curl_off_t ultotal,
+                                 curl_off_t ulnow);
+
+    // Drives one transfer to completion like curl_easy_perform, but resumes
+    // it once the sink can take data again after a pause.
+    CURLcode perform(CURL* handle, Transfer& transfer) const;
+    void configure_common(CURL* handle, const std::string& url) const;
+    // Sets up `handle` to fetch `range` of `url` into `transfer`. Neither the
+    // transfer nor the error buffer may move until the fetch is over.
+    void configure_fetch(CURL* handle,
+                         const std::string& url,
+                         std::optional<ByteRange> range,
+                         Connection connection,
+                         Transfer& transfer,
+                         char* error_buffer) const;
+    EventLoop& event_loop();
+
+    CurlShare share_;
+    SystemClock clock_;
+    // Started by the first start_probe() or start_fetch().
+    std::once_flag loop_started_;
+    std::unique_ptr<EventLoop> loop_;
+};
+
+}  // namespace downloader
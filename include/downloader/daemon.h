@@ -0,0 +1,99 @@
+#pragma once
+
+#include "downloader/daemon_protocol.h"
+#include "downloader/download_manager.h"
+#include "downloader/types.h"
+#include "downloader/write_pipeline.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace downloader {
+
+// Long-running downloader that accepts jobs over a Unix domain socket. One
+// DownloadManager (worker pool, write pipeline, shared connection cache)
+// serves every client, so DNS, TCP and TLS state stay warm between jobs.
+class DaemonServer {
+public:
+    DaemonServer(std::string socket_path, std::size_t worker_count, PipelineConfig pipeline = {});
+    ~DaemonServer();
+
+    DaemonServer(const DaemonServer&) = delete;
+    DaemonServer& operator=(const DaemonServer&) = delete;
+
+    // Serves clients until a stop is requested, then cancels whatever is
+    // still running and disconnects everyone.
+    void run(std::stop_token stop_token);
+
+private:
+    struct Session {
+        explicit Session(int socket_fd) : fd(socket_fd) {}
+
+        // Queues a frame and writes as much of the queue as the socket takes
+        // without blocking. Never waits for the client.
+        void send(protocol::FrameType type, const std::string& payload);
+        // Writes more of the queue once the socket has room again.
+        void flush();
+        // Same, with write_mutex already held.
+        void flush_locked();
+        bool has_output();
+        // Wakes the reader by shutting the socket down; close() releases it.
+        void interrupt();
+        void close();
+
+        int fd;
+        std::mutex write_mutex;
+        bool closed{false};
+        // Encoded frames not yet taken by the socket, guarded by write_mutex.
+        std::string outbox;
+
+        std::mutex jobs_mutex;
+        std::unordered_map<std::uint64_t, DownloadStatePtr> jobs;
+
+        std::atomic<bool> done{false};
+        std::jthread reader;
+    };
+
+    void serve(const std::shared_ptr<Session>& session);
+    void flush_sessions(const std::vector<pollfd>& polled);
+    void submit(const std::shared_ptr<Session>& session, protocol::SubmitMessage message);
+    void publish_progress();
+    void reap_sessions();
+
+    std::string socket_path_;
+    int listen_fd_{-1};
+    DownloadManager manager_;
+    std::mutex sessions_mutex_;
+    std::vector<std::shared_ptr<Session>> sessions_;
+};
+
+// Client side of the daemon protocol, used by `modern_downloader --client`.
+class DaemonClient {
+public:
+    explicit DaemonClient(const std::string& socket_path);
+    ~DaemonClient();
+
+    DaemonClient(const DaemonClient&) = delete;
+    DaemonClient& operator=(const DaemonClient&) = delete;
+
+    void submit(std::uint64_t job_id, const DownloadRequest& request);
+    void cancel(std::uint64_t job_id);
+    // Blocks for the next Progress or Result frame; std::nullopt once the
+    // daemon has closed the connection.
+    std::optional<protocol::Frame> next_frame();
+
+private:
+    int fd_{-1};
+    std::mutex write_mutex_;
+};
+
+}  // namespace downloader
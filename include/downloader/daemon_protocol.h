@@ -0,0 +1,71 @@
+#pragma once
+
+#include "downloader/types.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace downloader::protocol {
+
+// Every frame on the daemon socket is a little-endian u32 payload length, a
+// u8 frame type and the payload. Integers in payloads are little-endian and
+// strings are a u32 length followed by the bytes.
+enum class FrameType : std::uint8_t {
+    Submit = 1,    // client -> daemon: job id, request
+    Cancel = 2,    // client -> daemon: job id
+    Progress = 3,  // daemon -> client: job id, status, downloaded, total
+    Result = 4     // daemon -> client: job id, status, http status, bytes, elapsed ms, message
+};
+
+inline constexpr std::uint32_t kMaxFrameSize = 1 << 20;
+
+struct Frame {
+    FrameType type{FrameType::Submit};
+    std::string payload;
+};
+
+struct SubmitMessage {
+    std::uint64_t job_id{0};
+    DownloadRequest request;
+};
+
+struct ProgressMessage {
+    std::uint64_t job_id{0};
+    DownloadStatus status{DownloadStatus::Pending};
+    std::uint64_t downloaded_bytes{0};
+    std::uint64_t total_bytes{0};
+};
+
+struct ResultMessage {
+    std::uint64_t job_id{0};
+    DownloadStatus status{DownloadStatus::Failed};
+    long http_status{0};
+    std::uint64_t bytes{0};
+    std::uint64_t elapsed_ms{0};
+    std::string error_message;
+    bool up_to_date{false};
+    std::uint64_t bytes_reused{0};
+};
+
+std::string encode(const SubmitMessage& message);
+std::string encode_cancel(std::uint64_t job_id);
+std::string encode(const ProgressMessage& message);
+std::string encode(const ResultMessage& message);
+
+// The decoders throw std::runtime_error on a truncated or malformed payload.
+SubmitMessage decode_submit(std::string_view payload);
+std::uint64_t decode_cancel(std::string_view payload);
+ProgressMessage decode_progress(std::string_view payload);
+ResultMessage decode_result(std::string_view payload);
+
+// The bytes of one frame, for callers that queue output themselves.
+std::string encode_frame(FrameType type, std::string_view payload);
+
+// Blocking frame I/O on a stream socket. read_frame returns std::nullopt on a
+// clean EOF and throws on errors; write_frame throws if the peer is gone.
+std::optional<Frame> read_frame(int fd);
+void write_frame(int fd, FrameType type, std::string_view payload);
+
+}  // namespace downloader::protocol
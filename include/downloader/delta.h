@@ -0,0 +1,85 @@
+#pragma once
+
+#include "downloader/sha256.h"
+#include "downloader/transport.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace downloader {
+
+// Block checksums of a published file, in the spirit of zsync: for every
+// full block a weak rolling checksum and a truncated SHA-256, plus the
+// SHA-256 of the whole file. The file is published as "<url>.blockmap":
+//
+//   blockmap 1
+//   block-size <bytes>
+//   length <bytes>
+//   sha256 <hex>
+//   <empty line>
+//   per full block: 4-byte big-endian weak checksum, 16 bytes of SHA-256
+//
+// A trailing partial block has no checksums and is always fetched.
+struct BlockMap {
+    static constexpr std::size_t kStrongSize = 16;
+
+    std::int64_t block_size{0};
+    std::int64_t length{0};
+    Sha256::Digest sha256{};
+    std::vector<std::uint32_t> weak;
+    std::vector<std::array<std::uint8_t, kStrongSize>> strong;
+};
+
+// rsync's rolling checksum of `size` bytes: the byte sum in the low 16 bits
+// and the position-weighted sum in the high 16 bits.
+std::uint32_t weak_checksum(const std::uint8_t* data, std::size_t size);
+
+// Throws std::runtime_error on a malformed block map.
+BlockMap parse_block_map(std::string_view text);
+// Builds the block map of the file at `path`. Throws on I/O errors.
+std::string make_block_map(const std::string& path, std::int64_t block_size);
+
+// Read-only mapping of the local copy a delta download starts from.
+class SeedFile {
+public:
+    // Throws std::runtime_error if the file cannot be opened or mapped.
+    explicit SeedFile(const std::string& path);
+    ~SeedFile();
+
+    SeedFile(const SeedFile&) = delete;
+    SeedFile& operator=(const SeedFile&) = delete;
+
+    const std::uint8_t* data() const { return data_; }
+    std::int64_t size() const { return size_; }
+
+private:
+    int fd_{-1};
+    const std::uint8_t* data_{nullptr};
+    std::int64_t size_{0};
+};
+
+// How to build the new file: runs of blocks found in the seed are copied,
+// everything else is fetched. Both lists are coalesced and sorted by target
+// offset.
+struct DeltaPlan {
+    struct Copy {
+        std::int64_t source{0};
+        std::int64_t target{0};
+        std::int64_t length{0};
+    };
+
+    std::vector<Copy> copies;
+    std::vector<ByteRange> fetches;
+    std::int64_t copy_bytes{0};
+    std::int64_t fetch_bytes{0};
+};
+
+// Rolls a block-sized window over the seed and looks every position up in
+// the map, skipping a block ahead after each match.
+DeltaPlan plan_delta(const BlockMap& map, const SeedFile& seed);
+
+}  // namespace downloader
@@ -1,10 +1,14 @@
 #pragma once
 
 #include "downloader/http_client.h"
+#include "downloader/memory_arena.h"
 #include "downloader/progress.h"
 #include "downloader/thread_pool.h"
+#include "downloader/transport.h"
 #include "downloader/types.h"
+#include "downloader/write_pipeline.h"
 
+#include <functional>
 #include <future>
 #include <memory>
 #include <vector>
@@ -13,17 +17,41 @@ namespace downloader {
 
 class DownloadManager {
 public:
-    explicit DownloadManager(std::size_t worker_count);
+    using CompletionHandler = std::function<void(DownloadResult)>;
+
+    // Without a transport, downloads go over libcurl.
+    explicit DownloadManager(std::size_t worker_count,
+                             PipelineConfig pipeline = {},
+                             std::shared_ptr<Transport> transport = nullptr);
 
     DownloadStatePtr add(DownloadRequest request);
     std::vector<DownloadResult> run_all();
 
+    // Starts a download right away, independently of add()/run_all(). Safe to
+    // call from any thread, including from a completion handler. The handler
+    // runs on the worker thread that finished the download.
+    DownloadStatePtr submit(DownloadRequest request, CompletionHandler on_complete);
+    PipelineStats pipeline_stats() const { return pipeline_.stats(); }
+    // For front ends that run transfers of their own alongside the manager's.
+    Transport& transport() { return *transport_; }
+    WritePipeline& pipeline() { return pipeline_; }
+    MemoryArena& arena() { return arena_; }
+    // Turns off the periodic progress lines printed during run_all().
+    void set_progress_enabled(bool enabled) { progress_enabled_ = enabled; }
+
 private:
+    DownloadResult execute(const DownloadStatePtr& state);
     DownloadResult run_one(const DownloadStatePtr& state, ProbeResult probe);
+    // Sync mode: true when the file on disk already matches the probe.
+    bool local_copy_current(const DownloadStatePtr& state, const ProbeResult& probe);
 
+    std::shared_ptr<Transport> transport_;
+    WritePipeline pipeline_;
+    MemoryArena arena_;
     ThreadPool pool_;
     HttpClient http_client_;
     ProgressReporter progress_;
+    bool progress_enabled_{true};
     std::vector<DownloadStatePtr> states_;
 };
 
@@ -1,9 +1,15 @@
 #pragma once
 
+#include "downloader/types.h"
+
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 
 namespace downloader {
 
@@ -11,10 +17,14 @@ class FileWriter {
 public:
     enum class Mode {
         Truncate,
-        ReadWriteTruncate
+        ReadWriteTruncate,
+        // Like ReadWriteTruncate, but always built in "<path>.part" and
+        // renamed over `path` on commit, so an existing file stays readable
+        // until then. Durability only decides whether it is synced first.
+        ReadWriteReplace
     };
 
-    FileWriter(const std::string& path, Mode mode);
+    FileWriter(const std::string& path, Mode mode, Durability durability = Durability::None);
     ~FileWriter();
 
     FileWriter(const FileWriter&) = delete;
@@ -28,8 +38,26 @@ public:
     std::size_t write_all(const void* data, std::size_t size) const;
     std::size_t pwrite_all(const void* data, std::size_t size, std::int64_t offset) const;
 
+    // Makes the file durable and visible under its final path. Without a
+    // commit, a writer removes its temporary file on destruction.
+    void commit();
+
 private:
+    struct Writeback {
+        std::mutex mutex;
+        std::unordered_map<std::int64_t, std::int64_t> window_bytes;
+        std::deque<std::int64_t> in_flight;
+    };
+
+    void note_written(std::int64_t offset, std::size_t size) const;
+    void close_and_discard() noexcept;
+
     int fd_{-1};
+    Durability durability_{Durability::None};
+    std::string path_;
+    std::string temp_path_;
+    bool committed_{false};
+    std::unique_ptr<Writeback> writeback_;
 };
 
 }  // namespace downloader
@@ -1,18 +1,31 @@
 #pragma once
 
+#include "downloader/clock.h"
+#include "downloader/memory_arena.h"
+#include "downloader/pieces.h"
+#include "downloader/transport.h"
 #include "downloader/types.h"
+#include "downloader/write_pipeline.h"
 
-#include <curl/curl.h>
-
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <future>
+#include <mutex>
+#include <optional>
 #include <stop_token>
 #include <string>
 
 namespace downloader {
 
+class FileWriter;
+
 class HttpClient {
 public:
+    HttpClient(WritePipeline& pipeline, MemoryArena& arena, Transport& transport);
+
     ProbeResult probe(const std::string& url) const;
 
     DownloadResult download_whole_file(const DownloadStatePtr& state,
@@ -22,33 +35,123 @@ public:
                                        std::size_t chunk_count,
                                        std::stop_token stop_token) const;
 
+    // Builds the new file from the old one at the output path plus the
+    // blocks that changed. Returns nothing, before touching the output, when
+    // there is no usable block map or old file.
+    std::optional<DownloadResult> download_delta(const DownloadStatePtr& state,
+                                                 std::stop_token stop_token) const;
+
 private:
-    struct CallbackBase {
+    struct CallbackBase : TransferSink {
         const DownloadStatePtr* state{nullptr};
         std::stop_token stop_token{};
+        const std::atomic<bool>* abandoned{nullptr};
+        const WritePipeline* pipeline{nullptr};
+        WriteStream* stream{nullptr};
+        MemoryBody* memory{nullptr};
+        std::uint32_t trace_track{0};
+        // Hashes accepted bytes when the request carries piece hashes.
+        std::optional<PieceHasher> pieces{};
+        // When set, a response with any other status is refused before its
+        // body is written.
+        long required_status{0};
+
+        bool can_resume() const override;
+        bool cancelled() const override;
+        bool accept_status(long http_status) override;
+        // Stages bytes for the file or memory body; a discarded body takes them all.
+        Write stage(const char* data, std::size_t size);
+    };
+
+    // Where the ranges of a split download land: a file, a memory body, or
+    // nowhere for a discarded body.
+    struct RangeSink {
+        const FileWriter* file{nullptr};
+        MemoryBody* memory{nullptr};
+        PieceLedger* pieces{nullptr};
     };
 
     struct StreamContext : CallbackBase {
-        int fd{-1};
+        Write write(const char* data, std::size_t size) override;
+        void expect_length(std::int64_t length) override;
+    };
+
+    // One byte range of a split download. The primary attempt starts at
+    // `begin`; a hedged attempt re-requests whatever the primary had not yet
+    // written when the hedge was issued. Both write identical bytes to the
+    // same offsets, so the range is done as soon as either attempt finishes.
+    struct RangeSlot {
+        static constexpr int kPrimary = 0;
+        static constexpr int kHedge = 1;
+
+        std::size_t index{0};
+        std::int64_t begin{0};
+        std::int64_t end{0};
+        const Clock* clock{nullptr};
+        Clock::time_point started_at{};
+        Clock::time_point settled_at{};
+
+        std::mutex mutex;
+        std::array<std::int64_t, 2> attempt_begin{0, -1};
+        std::array<std::int64_t, 2> attempt_next{0, -1};
+        std::int64_t covered{0};
+        std::atomic<Clock::time_point::rep> last_progress{0};
+
+        std::array<std::atomic<bool>, 2> abandoned{};
+        // Set by an attempt just before it returns, so the monitor can wait
+        // on the clock rather than on the futures.
+        std::array<std::atomic<bool>, 2> done{};
+        std::atomic<std::size_t>* completions{nullptr};
+        std::array<std::future<DownloadResult>, 2> attempts{};
+        std::array<bool, 2> finished{false, false};
+        bool settled{false};
+
+        // Records that `attempt` has written up to `next_offset` and returns
+        // how many bytes of the range that newly covers.
+        std::int64_t advance(int attempt, std::int64_t next_offset);
+        std::int64_t covered_bytes();
+        std::int64_t resume_offset();
     };
 
     struct RangeContext : CallbackBase {
-        int fd{-1};
         std::int64_t next_offset{0};
+        RangeSlot* slot{nullptr};
+        int attempt{RangeSlot::kPrimary};
+
+        Write write(const char* data, std::size_t size) override;
     };
 
-    static std::size_t stream_write_callback(char* ptr, std::size_t size, std::size_t nmemb, void* userdata);
-    static std::size_t range_write_callback(char* ptr, std::size_t size, std::size_t nmemb, void* userdata);
-    static int progress_callback(void* clientp,
-                                 curl_off_t dltotal,
-                                 curl_off_t dlnow,
-                                 curl_off_t ultotal,
-                                 curl_off_t ulnow);
+    DownloadResult fetch_range(const DownloadStatePtr& state,
+                               RangeSlot& slot,
+                               int attempt,
+                               RangeSink sink,
+                               std::stop_token stop_token) const;
+    void launch_attempt(const DownloadStatePtr& state,
+                        RangeSlot& slot,
+                        int attempt,
+                        RangeSink sink,
+                        std::stop_token stop_token) const;
+    // Reads back pieces no transfer could judge, then fetches failing pieces
+    // again until every piece verifies. Returns false with `error` set if
+    // that does not happen within a few rounds.
+    bool settle_pieces(const DownloadStatePtr& state,
+                       PieceLedger& ledger,
+                       const FileWriter& file,
+                       std::stop_token stop_token,
+                       std::uint32_t& repaired,
+                       std::string& error) const;
+    static bool should_hedge(RangeSlot& slot,
+                             const HedgePolicy& policy,
+                             double median_rate,
+                             Clock::time_point now);
 
-    static void configure_common(CURL* handle, const std::string& url);
     static DownloadResult cancelled_result(const DownloadStatePtr& state);
     static DownloadResult failed_result(const DownloadStatePtr& state, long http_status, std::string message);
-    static DownloadResult success_result(const DownloadStatePtr& state, long http_status);
+    DownloadResult success_result(const DownloadStatePtr& state, long http_status) const;
+
+    WritePipeline& pipeline_;
+    MemoryArena& arena_;
+    Transport& transport_;
 };
 
 }  // namespace downloader
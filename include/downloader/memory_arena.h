@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace downloader {
+
+class MemoryArena;
+
+// Body of a download that targeted memory. The bytes live in a block drawn
+// from a MemoryArena and go back to it when the last reference is dropped.
+class MemoryBody {
+public:
+    ~MemoryBody();
+
+    MemoryBody(const MemoryBody&) = delete;
+    MemoryBody& operator=(const MemoryBody&) = delete;
+
+    std::span<const std::byte> bytes() const { return {block_.data.get(), size_}; }
+    std::string_view text() const {
+        return {reinterpret_cast<const char*>(block_.data.get()), size_};
+    }
+    std::size_t size() const { return size_; }
+    std::size_t capacity() const { return block_.capacity; }
+
+    // Sequential body of unknown length: appends, growing geometrically.
+    bool append(const char* data, std::size_t size);
+    // Fixed-length body: writes within [0, size()) at the given offset, so
+    // ranged chunks can land directly where they belong.
+    bool write_at(std::int64_t offset, const char* data, std::size_t size);
+
+private:
+    friend class MemoryArena;
+
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t capacity{0};
+    };
+
+    struct Pool {
+        Block take(std::size_t min_capacity);
+        void give(Block block);
+
+        std::mutex mutex;
+        std::unordered_map<std::size_t, std::vector<Block>> free_blocks;
+        std::size_t cached_bytes{0};
+        std::size_t max_cached_bytes{0};
+    };
+
+    MemoryBody(std::weak_ptr<Pool> pool, Block block, std::size_t size)
+        : pool_(std::move(pool)), block_(std::move(block)), size_(size) {}
+
+    std::weak_ptr<Pool> pool_;
+    Block block_;
+    std::size_t size_;
+};
+
+// Reusable source of body buffers. Blocks are kept in power-of-two size
+// classes and recycled across downloads, up to `max_cached_bytes` of idle
+// memory. Bodies may outlive the arena; their blocks are then simply freed.
+class MemoryArena {
+public:
+    explicit MemoryArena(std::size_t max_cached_bytes = 64 << 20);
+
+    // A body with room for `capacity` bytes that grows by append().
+    std::shared_ptr<MemoryBody> allocate(std::size_t capacity);
+    // A body of exactly `size` bytes, to be filled by write_at().
+    std::shared_ptr<MemoryBody> allocate_fixed(std::size_t size);
+
+private:
+    std::shared_ptr<MemoryBody::Pool> pool_;
+};
+
+}  // namespace downloader
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "downloader/sha256.h"
+#include "downloader/transport.h"
+#include "downloader/types.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace downloader {
+
+// Reads a piece hash list. Two formats are accepted:
+//   - a Metalink document, from which the first <pieces type="sha-256"
+//     length="..."> element and its <hash> children are used;
+//   - a sidecar text file: a "piece-size <bytes>" line followed by one hex
+//     SHA-256 per piece. Text after the hash (as `sha256sum` prints it) and
+//     lines starting with '#' are ignored.
+// Throws std::runtime_error if the file cannot be read or parsed.
+PieceHashes load_piece_hashes(const std::string& path);
+
+// Verification state of the pieces of one download, shared by every
+// transfer that writes to it.
+class PieceLedger {
+public:
+    enum class State : std::uint8_t {
+        Unverified,
+        Good,
+        Bad
+    };
+
+    // Throws std::runtime_error when the list does not cover `length` bytes.
+    PieceLedger(const PieceHashes& hashes, std::int64_t length);
+
+    std::size_t count() const { return states_.size(); }
+    std::int64_t piece_size() const { return hashes_.piece_size; }
+    ByteRange bounds(std::size_t piece) const;
+
+    // Records the digest of the whole of `piece`. A mismatch marks the piece
+    // bad even if another transfer found it good, since both wrote to it.
+    void record(std::size_t piece, const Sha256::Digest& digest);
+    State state(std::size_t piece) const { return states_[piece].load(std::memory_order_acquire); }
+    // Forgets the verdict on `piece` before it is fetched again.
+    void reset(std::size_t piece) { states_[piece].store(State::Unverified, std::memory_order_release); }
+    std::vector<std::size_t> pieces_in(State state) const;
+
+private:
+    const PieceHashes& hashes_;
+    std::int64_t length_;
+    std::vector<std::atomic<State>> states_;
+};
+
+// Hashes the byte stream of one transfer as it arrives. A piece is judged
+// once the stream has carried all of it; pieces the stream joins part-way
+// through (a hedge resuming mid-piece) are left for someone else.
+class PieceHasher {
+public:
+    PieceHasher(PieceLedger& ledger, std::int64_t offset);
+
+    void update(const char* data, std::size_t size);
+
+private:
+    PieceLedger& ledger_;
+    std::int64_t offset_;
+    std::size_t piece_;
+    bool from_start_;
+    Sha256 hash_;
+};
+
+// Reads `piece` back from `fd` and records its digest. Returns false on a
+// read error, leaving the piece unverified.
+bool verify_piece_on_disk(int fd, PieceLedger& ledger, std::size_t piece);
+
+}  // namespace downloader
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "downloader/types.h"
+#include "downloader/write_pipeline.h"
 
 #include <thread>
 #include <memory>
@@ -16,6 +17,7 @@ public:
     ~ProgressReporter();
 
     void watch(const DownloadStatePtr& state);
+    void watch_pipeline(const WritePipeline* pipeline);
     void start();
     void stop();
 
@@ -24,6 +26,7 @@ private:
 
     std::mutex mutex_;
     std::vector<DownloadStatePtr> states_;
+    const WritePipeline* pipeline_{nullptr};
     std::unique_ptr<std::jthread> printer_;
 };
 
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace downloader {
+
+// Incremental SHA-256 (FIPS 180-4).
+class Sha256 {
+public:
+    using Digest = std::array<std::uint8_t, 32>;
+
+    Sha256();
+
+    void update(const void* data, std::size_t size);
+    // Finishes the hash; the object must not be updated afterwards.
+    Digest finish();
+
+    static std::string to_hex(const Digest& digest);
+
+private:
+    void compress(const std::uint8_t* block);
+
+    std::array<std::uint32_t, 8> state_;
+    std::array<std::uint8_t, 64> buffer_{};
+    std::size_t buffered_{0};
+    std::uint64_t length_{0};
+};
+
+// Hex SHA-256 of the file at `path`. Throws std::runtime_error on I/O errors.
+std::string sha256_file(const std::string& path);
+// SHA-256 of everything in the open file `fd`, read from offset 0 with
+// pread. Throws std::runtime_error on I/O errors.
+Sha256::Digest sha256_fd(int fd);
+
+}  // namespace downloader
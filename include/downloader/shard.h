@@ -0,0 +1,175 @@
+#pragma once
+
+#include "downloader/download_manager.h"
+#include "downloader/types.h"
+#include "downloader/write_pipeline.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace downloader {
+
+struct ManifestEntry {
+    std::string url;
+    std::string output_path;
+};
+
+// Reads a job list with one "<url> <output>" pair per line. Blank lines and
+// lines starting with '#' are skipped. Throws std::runtime_error if the file
+// cannot be read or a line is malformed.
+std::vector<ManifestEntry> load_manifest(const std::string& path);
+
+// "<hostname>:<pid>", unique among the workers sharing a claim log.
+std::string default_worker_id();
+
+// Identifies a job list in its claim log: the hex SHA-256 of its
+// "<url> <output>" lines.
+std::string manifest_digest(const std::vector<DownloadRequest>& jobs);
+
+// A manifest job as the claim log records it.
+struct ShardJob {
+    enum class State {
+        Open,
+        Claimed,
+        Done
+    };
+
+    State state{State::Open};
+    // The worker holding the claim, or the one that finished the job.
+    std::string worker;
+    // The remaining fields are set once the job is done.
+    DownloadStatus status{DownloadStatus::Pending};
+    std::uint64_t bytes{0};
+    std::int64_t elapsed_ms{0};
+    long http_status{0};
+    bool up_to_date{false};
+    std::string error_message;
+};
+
+// Append-only log through which processes sharing a manifest claim its jobs,
+// on one host or on several over a shared filesystem. Every change is one
+// text line appended while holding an fcntl write lock on the log, and every
+// reader replays the lines in file order, so all workers agree on who holds
+// what. The first line names the manifest the log belongs to.
+//
+// A claim is a lease. Each worker appends a "join" record once, which gives
+// it a fixed slot in "<log>.beats", and heartbeats by rewriting the counter
+// in its slot in place, so the log grows with the work done and not with
+// time. A claim whose holder has not been seen to change its counter or
+// append anything for a whole lease, as measured by the observer's own
+// steady clock, may be taken over. Clocks of different hosts are never
+// compared.
+class ClaimLog {
+public:
+    // Throws std::runtime_error if the log at `path` was written for a
+    // different manifest.
+    ClaimLog(const std::string& path,
+             std::string worker,
+             const std::string& manifest,
+             std::size_t job_count,
+             std::chrono::milliseconds lease);
+    ~ClaimLog();
+
+    ClaimLog(const ClaimLog&) = delete;
+    ClaimLog& operator=(const ClaimLog&) = delete;
+
+    const std::string& worker() const { return worker_; }
+    std::chrono::milliseconds lease() const { return lease_; }
+
+    // Claims the first job that is neither done nor held under a live lease.
+    std::optional<std::size_t> claim();
+    // Renews this worker's leases. Returns the jobs it was running that
+    // another worker has taken over since, which it must abandon.
+    std::vector<std::size_t> heartbeat();
+    // Records the outcome of `job`. A cancelled job is released so that
+    // another worker can claim it right away. Returns false, and records
+    // nothing, when this worker no longer holds the job.
+    bool finish(std::size_t job, const DownloadResult& result);
+
+    // True once every job is done.
+    bool settled();
+    std::vector<ShardJob> jobs();
+
+private:
+    using SteadyTime = std::chrono::steady_clock::time_point;
+
+    // Replays the records appended since the last call. Called with the file
+    // locked.
+    void catch_up();
+    void apply(const std::string& line, SteadyTime now);
+    // Called with the file locked and caught up.
+    void append(const std::string& line);
+    // Bumps this worker's counter in the beats file. Called with the log
+    // locked.
+    void write_beat();
+    // Notes every worker whose counter changed since the last read. Called
+    // with the log locked and caught up.
+    void read_beats(SteadyTime now);
+    bool lease_live(const ShardJob& job, SteadyTime now) const;
+
+    std::string path_;
+    std::string worker_;
+    std::chrono::milliseconds lease_;
+    int fd_{-1};
+    int beats_fd_{-1};
+
+    // fcntl locks belong to the process, so threads take this as well.
+    std::mutex mutex_;
+    std::vector<ShardJob> jobs_;
+    // Jobs this worker has claimed and not finished yet.
+    std::vector<std::size_t> held_;
+    // When each worker was last seen appending or beating, by this
+    // process's clock.
+    std::unordered_map<std::string, SteadyTime> last_seen_;
+    // The manifest line the log starts with.
+    std::string header_;
+    // Beats file slots in join order, with the counter last read from each.
+    std::vector<std::string> slot_workers_;
+    std::vector<std::uint64_t> slot_beats_;
+    std::optional<std::size_t> own_slot_;
+    std::uint64_t beats_{0};
+    std::int64_t read_offset_{0};
+    // A trailing line without its newline, left by a writer that crashed.
+    std::string partial_;
+};
+
+// One worker process of a sharded run. It claims jobs from the log as its
+// download slots free up, runs them on its own DownloadManager, and keeps
+// polling after its last job so that the work of crashed workers is picked
+// up once their leases expire.
+class ShardWorker {
+public:
+    ShardWorker(std::vector<DownloadRequest> jobs,
+                const std::string& log_path,
+                std::string worker,
+                std::chrono::milliseconds lease,
+                std::size_t worker_count,
+                PipelineConfig pipeline = {});
+
+    ShardWorker(const ShardWorker&) = delete;
+    ShardWorker& operator=(const ShardWorker&) = delete;
+
+    // Runs until every job of the manifest is done or a stop is requested,
+    // in which case running jobs are cancelled and released. Returns the
+    // results of the jobs this worker ran, with their manifest index.
+    std::vector<std::pair<std::size_t, DownloadResult>> run(std::stop_token stop_token);
+
+    ClaimLog& log() { return log_; }
+    PipelineStats pipeline_stats() const { return manager_.pipeline_stats(); }
+
+private:
+    std::vector<DownloadRequest> jobs_;
+    ClaimLog log_;
+    std::size_t slots_;
+    DownloadManager manager_;
+};
+
+}  // namespace downloader
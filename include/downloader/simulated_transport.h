@@ -0,0 +1,149 @@
+#pragma once
+
+#include "downloader/clock.h"
+#include "downloader/transport.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace downloader {
+
+struct SimulationConfig {
+    std::chrono::microseconds rtt{std::chrono::milliseconds(40)};
+    // Round trips to open a connection (TCP, then TLS). Connections are kept
+    // alive per host after a clean transfer and reused without them.
+    int connect_round_trips{2};
+    // Bytes per second one connection can carry...
+    double connection_bandwidth{8.0 * 1024 * 1024};
+    // ...and that all connections share, split evenly between active flows.
+    double link_capacity{100.0 * 1024 * 1024};
+    // Chance that a transfer is reset part-way through its body.
+    double failure_rate{0.0};
+    // Chance that a transfer stops receiving for stall_duration part-way through.
+    double stall_rate{0.0};
+    std::chrono::milliseconds stall_duration{30000};
+    // Bytes a flow receives between wakeups of its transfer thread. Smaller
+    // values give finer progress at the cost of more events.
+    std::size_t delivery_size{256 * 1024};
+    std::uint64_t seed{1};
+};
+
+struct SimulationStats {
+    std::uint64_t transfers{0};
+    std::uint64_t connections_opened{0};
+    std::uint64_t failures{0};
+    std::uint64_t stalls{0};
+    std::uint64_t bytes{0};
+};
+
+// In-process network running in virtual time. It is also the clock of the
+// run: time stands still while any thread it knows about (pool workers,
+// range attempts) can act, and jumps to the next network event or timer
+// once all of them wait. Failures and stalls are decided by hashing the
+// request with the seed, and requests made at the same instant are served in
+// a fixed order, so a scenario plays out the same way on every run.
+//
+// Every call must come from a thread the clock knows about, i.e. one that is
+// covered by begin_activity().
+class SimulatedTransport final : public Transport, public Clock {
+public:
+    explicit SimulatedTransport(SimulationConfig config = {});
+
+    // Serves `url` with a body of `size` bytes.
+    void add_resource(const std::string& url, std::int64_t size, bool accept_ranges = true);
+    SimulationStats stats() const;
+
+    ProbeResult probe(const std::string& url, std::uint32_t trace_track) override;
+    TransferOutcome fetch(const std::string& url,
+                          std::optional<ByteRange> range,
+                          TransferSink& sink,
+                          std::uint32_t trace_track,
+                          Connection connection) override;
+    Clock& clock() override { return *this; }
+
+    time_point now() const override;
+    void wait_until(time_point deadline, const std::function<bool()>& ready) override;
+    void notify() override;
+    void begin_activity() override;
+    void end_activity() override;
+
+private:
+    struct Resource {
+        std::int64_t size{0};
+        bool accept_ranges{true};
+    };
+
+    enum class Fate {
+        Clean,
+        Fail,
+        Stall
+    };
+
+    // A request waiting for its connection. Requests made at the same
+    // instant are resolved together, sorted by url and range.
+    struct Connect {
+        const std::string* url{nullptr};
+        std::int64_t begin{-1};
+        std::int64_t end{-1};
+        bool resolved{false};
+        // Neither takes an idle connection nor leaves one behind.
+        bool fresh{false};
+        bool reused{false};
+        Fate fate{Fate::Clean};
+        // Where in the body the fate strikes, as a fraction of its length.
+        double fate_point{0.0};
+    };
+
+    struct Flow {
+        double received{0.0};
+        // The owner is woken once `received` reaches this.
+        std::int64_t target{0};
+        std::int64_t stalled_until{-1};
+    };
+
+    struct Waiter {
+        std::int64_t deadline{0};
+        const std::function<bool()>* ready{nullptr};
+        Flow* flow{nullptr};
+        Connect* connect{nullptr};
+        bool woken{false};
+        std::condition_variable cv;
+    };
+
+    static constexpr std::int64_t kForever = INT64_MAX;
+
+    // Waits for a connection to the host of `url` and the request round trip.
+    void connect(std::unique_lock<std::mutex>& lock, Connect& request, const std::function<bool()>& cancelled);
+    void release_connection(const std::string& url);
+    void block(std::unique_lock<std::mutex>& lock, Waiter& waiter);
+    void wake(Waiter& waiter);
+    // Moves time forward while no thread can act. Called with the lock held.
+    void advance();
+    void resolve_connects();
+    double flow_rate() const;
+    std::int64_t next_event(const Waiter& waiter, double rate) const;
+
+    const SimulationConfig config_;
+    const std::vector<char> zeros_;
+
+    mutable std::mutex mutex_;
+    std::atomic<std::int64_t> now_{0};
+    std::int64_t runnable_{0};
+    std::vector<Waiter*> waiters_;
+    std::vector<Flow*> flows_;
+    std::unordered_map<std::string, Resource> resources_;
+    std::unordered_map<std::string, std::uint32_t> idle_connections_;
+    std::unordered_map<std::uint64_t, std::uint32_t> request_counts_;
+    SimulationStats stats_;
+};
+
+}  // namespace downloader
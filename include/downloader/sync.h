@@ -0,0 +1,29 @@
+#pragma once
+
+#include "downloader/types.h"
+
+#include <cstdint>
+#include <string>
+
+namespace downloader {
+
+enum class SyncCheck {
+    // The local file is missing or differs; download it.
+    Fetch,
+    // Size and modification time match the probe.
+    UpToDate,
+    // Sizes match but the modification time does not; comparing the local
+    // file's SHA-256 with the probed digest decides.
+    CompareDigest
+};
+
+// Compares the file at `path` with what the server reported. Only stat() is
+// used, so this is cheap enough to run for every job before the download.
+SyncCheck check_local_file(const std::string& path, const ProbeResult& probe, SyncMode mode);
+
+// Sets the modification time of `path` to `seconds` since the epoch so a
+// later Metadata check can match it against Last-Modified. Returns false on
+// error; a missed stamp only costs a re-download.
+bool stamp_modification_time(const std::string& path, std::int64_t seconds);
+
+}  // namespace downloader
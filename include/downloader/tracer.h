@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace downloader {
+
+enum class TraceEvent : std::uint8_t {
+    ProbeBegin,
+    ProbeEnd,
+    TransferBegin,
+    Connected,
+    TlsConnected,
+    FirstByte,
+    WriteBatch,
+    Paused,
+    Hedge,
+    TransferEnd
+};
+
+// Optional timeline recorder for probes and transfers. Every probe, chunk and
+// hedge attempt gets its own track; events go into per-thread ring buffers
+// without locks and are dumped as Chrome trace_event JSON (Perfetto,
+// chrome://tracing). While disabled, each call site costs one branch on
+// Tracer::enabled().
+class Tracer {
+public:
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+    static void enable() { enabled_.store(true, std::memory_order_relaxed); }
+
+    static std::uint64_t now_ns();
+
+    // Registers a named track (shown as a thread in the viewer).
+    static std::uint32_t new_track(std::string name);
+    static void record(std::uint32_t track, TraceEvent event, std::int64_t arg0 = 0, std::int64_t arg1 = 0);
+    static void record_at(std::uint64_t timestamp_ns,
+                          std::uint32_t track,
+                          TraceEvent event,
+                          std::int64_t arg0 = 0,
+                          std::int64_t arg1 = 0);
+
+    // Meant to be called once transfers have finished.
+    static void write_chrome_trace(std::ostream& out);
+
+private:
+    static inline std::atomic<bool> enabled_{false};
+};
+
+}  // namespace downloader
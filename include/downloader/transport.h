@@ -0,0 +1,114 @@
+#pragma once
+
+#include "downloader/clock.h"
+#include "downloader/types.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+
+namespace downloader {
+
+// Receives the body of one transfer, on the thread that runs Transport::fetch
+// (or, for start_fetch, on whichever thread the transport drives it from).
+class TransferSink {
+public:
+    enum class Write {
+        Accepted,
+        // Nothing was consumed; the same bytes are offered again once
+        // can_resume() holds.
+        Paused,
+        Rejected
+    };
+
+    virtual ~TransferSink() = default;
+
+    virtual Write write(const char* data, std::size_t size) = 0;
+    virtual bool can_resume() const = 0;
+    // Polled while the transfer runs; returning true aborts it.
+    virtual bool cancelled() const = 0;
+    // Called with the body length once the transport knows it.
+    virtual void expect_length(std::int64_t) {}
+    // Called with the response status before the first body byte. Returning
+    // false fails the transfer without handing over any of the body.
+    virtual bool accept_status(long) { return true; }
+};
+
+// Inclusive byte range, as in an HTTP Range header.
+struct ByteRange {
+    std::int64_t begin{0};
+    std::int64_t end{0};
+};
+
+// Receives a transfer of several ranges, each part at its offset in the
+// resource. Unlike TransferSink it cannot pause: a multipart response mixes
+// part bodies with their framing, so bytes have to be taken as they come.
+class RangeSetSink {
+public:
+    virtual ~RangeSetSink() = default;
+
+    virtual bool write_at(std::int64_t offset, const char* data, std::size_t size) = 0;
+    virtual bool cancelled() const = 0;
+};
+
+// Whether a fetch may go over a pooled connection. Hedges ask for a fresh
+// one: the point of a hedge is to get off the path the stalled request is on.
+enum class Connection : std::uint8_t {
+    Reuse,
+    // Opened for this fetch and closed after it, never taken from or
+    // returned to the pool.
+    Fresh
+};
+
+struct TransferOutcome {
+    bool ok{false};
+    // Stopped because the sink asked for it, not because of an error.
+    bool aborted{false};
+    long http_status{0};
+    std::string error_message;
+};
+
+// Moves bytes for HttpClient. The scheduling above it (probing, splitting,
+// hedging) is transport-independent, so it can run against real servers or a
+// simulated network.
+class Transport {
+public:
+    using ProbeCallback = std::function<void(ProbeResult)>;
+    using FetchCallback = std::function<void(TransferOutcome)>;
+
+    virtual ~Transport() = default;
+
+    virtual ProbeResult probe(const std::string& url, std::uint32_t trace_track) = 0;
+    virtual TransferOutcome fetch(const std::string& url,
+                                  std::optional<ByteRange> range,
+                                  TransferSink& sink,
+                                  std::uint32_t trace_track,
+                                  Connection connection) = 0;
+    // Fetches several ranges of `url`. The default makes one fetch() per
+    // range; a transport that can ask for all of them in one request
+    // (multipart/byteranges) overrides it. If the server answers such a
+    // request with the whole body, the sink sees that body from offset 0.
+    virtual TransferOutcome fetch_ranges(const std::string& url,
+                                         std::span<const ByteRange> ranges,
+                                         RangeSetSink& sink,
+                                         std::uint32_t trace_track);
+    // Start a probe or a fetch and return at once; `done` is handed the result
+    // when the request is over. The sink and `done` run on a thread of the
+    // transport's choosing, and `done` is the last call made for the request,
+    // so the sink may go away once it runs. `done` must not throw or destroy
+    // the transport. The defaults run probe() or fetch() on a thread of their
+    // own; CurlTransport drives every started request from one event loop.
+    virtual void start_probe(const std::string& url, std::uint32_t trace_track, ProbeCallback done);
+    virtual void start_fetch(const std::string& url,
+                             std::optional<ByteRange> range,
+                             TransferSink& sink,
+                             std::uint32_t trace_track,
+                             Connection connection,
+                             FetchCallback done);
+    virtual Clock& clock() = 0;
+};
+
+}  // namespace downloader
@@ -1,14 +1,21 @@
 #pragma once
 
+#include "downloader/cpu_profiler.h"
+
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <stop_token>
 #include <string>
+#include <vector>
 
 namespace downloader {
 
+class MemoryBody;
+
 enum class DownloadStatus {
     Pending,
     Probing,
@@ -18,16 +25,88 @@ enum class DownloadStatus {
     Cancelled
 };
 
+enum class Durability {
+    // Data reaches the page cache only; the kernel writes it back whenever.
+    None,
+    // Writes go to "<path>.part", which is fdatasync'ed and atomically renamed
+    // over the final path on commit.
+    SyncOnComplete,
+    // Like SyncOnComplete, but every fully written window is also pushed to
+    // disk with sync_file_range and dropped from the page cache while the
+    // download runs, so dirty memory stays bounded.
+    Streaming
+};
+
+enum class DownloadTarget {
+    File,
+    // The body is kept in memory and returned in DownloadResult::body;
+    // output_path only labels the download.
+    Memory,
+    // The body is counted and dropped, like `curl -o /dev/null`. Useful for
+    // throughput measurements and simulated runs.
+    Discard
+};
+
+enum class SyncMode {
+    // Always download.
+    Off,
+    // Skip the download when the local file has the probed Content-Length and
+    // its modification time equals Last-Modified. Downloaded files get their
+    // modification time set to Last-Modified so the next run can skip them.
+    Metadata,
+    // Like Metadata, but when only the modification time differs and the
+    // server advertises a SHA-256 digest, hash the local file and skip the
+    // download if it matches.
+    Checksum
+};
+
+// Expected SHA-256 of every fixed-size piece of a file, as listed in a
+// Metalink <pieces> element or a sidecar hash list. The last piece may be
+// shorter than piece_size.
+struct PieceHashes {
+    std::int64_t piece_size{0};
+    std::vector<std::array<std::uint8_t, 32>> sha256;
+};
+
+struct HedgePolicy {
+    bool enabled{false};
+    // A range is hedged when its throughput drops below this fraction (in
+    // (0, 1]) of the median throughput across the file's ranges...
+    double slow_fraction{0.25};
+    // ...or when it has not received a byte for this long.
+    std::chrono::milliseconds stall_timeout{3000};
+};
+
+// Upper bound on preferred_chunks: each range runs on its own thread.
+inline constexpr std::size_t kMaxPreferredChunks = 64;
+
 struct DownloadRequest {
     std::string url;
     std::string output_path;
     std::size_t preferred_chunks{4};
+    HedgePolicy hedge{};
+    Durability durability{Durability::None};
+    DownloadTarget target{DownloadTarget::File};
+    SyncMode sync{SyncMode::Off};
+    // File targets only: each piece is checked as it lands and pieces that
+    // fail are fetched again with range requests.
+    std::shared_ptr<const PieceHashes> pieces{};
+    // File targets only: treat the file already at output_path as an old
+    // version and fetch just the blocks that differ, as described by
+    // "<url>.blockmap". Without a block map or an old file this is an
+    // ordinary download.
+    bool delta{false};
 };
 
 struct ProbeResult {
     bool ok{false};
     std::int64_t content_length{-1};
     bool accept_ranges{false};
+    long http_status{0};
+    // Last-Modified as seconds since the epoch, or -1 when not sent.
+    std::int64_t last_modified{-1};
+    // Hex SHA-256 from a Repr-Digest or Digest header, empty when not sent.
+    std::string sha256;
     std::string error_message;
 };
 
@@ -37,6 +116,15 @@ struct DownloadResult {
     DownloadStatus status{DownloadStatus::Failed};
     long http_status{0};
     std::string error_message;
+    std::uint64_t bytes{0};
+    std::chrono::milliseconds elapsed{0};
+    std::shared_ptr<MemoryBody> body{};
+    // Completed without a transfer because the local file was up to date.
+    bool up_to_date{false};
+    // Pieces that failed verification and were fetched again.
+    std::uint32_t pieces_repaired{0};
+    // Bytes a delta download copied from the old file instead of fetching.
+    std::uint64_t bytes_reused{0};
 };
 
 struct DownloadState {
@@ -47,8 +135,13 @@ struct DownloadState {
     std::atomic<std::uint64_t> downloaded_bytes{0};
     std::atomic<std::uint64_t> total_bytes{0};
     std::atomic<long> http_status{0};
+    std::atomic<std::uint32_t> hedged_ranges{0};
     std::string error_message;
     std::chrono::steady_clock::time_point started_at{};
+    // Filled in while CpuProfiler is enabled.
+    CpuAccount cpu;
+    // Requesting a stop cancels the download, whether queued or running.
+    std::stop_source stop_source;
 };
 
 using DownloadStatePtr = std::shared_ptr<DownloadState>;
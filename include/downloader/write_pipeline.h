@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace downloader {
+
+class CpuAccount;
+class FileWriter;
+
+struct PipelineConfig {
+    std::size_t buffer_size{256 * 1024};
+    std::size_t buffer_count{64};
+    std::size_t writer_threads{2};
+};
+
+struct PipelineStats {
+    std::size_t buffer_size{0};
+    std::size_t buffer_count{0};
+    std::size_t buffers_in_use{0};
+    std::size_t peak_buffers_in_use{0};
+    std::uint64_t pauses{0};
+    std::uint64_t bytes_written{0};
+};
+
+// Decouples the network from the disk. Transfer callbacks copy incoming bytes
+// into buffers drawn from a fixed pool (the global memory budget) and hand
+// full buffers to dedicated writer threads. When the pool is exhausted the
+// caller is expected to pause its transfer until a buffer is released.
+class WritePipeline {
+public:
+    struct Buffer {
+        std::byte* data{nullptr};
+        std::size_t size{0};
+    };
+
+    // Outstanding writes of one transfer, so it can wait for its bytes to
+    // reach the file (and learn about write errors) before reporting success.
+    class Tracker {
+    public:
+        void wait();
+        bool failed() const { return failed_.load(std::memory_order_relaxed); }
+        std::string error() const;
+
+    private:
+        friend class WritePipeline;
+        friend class WriteStream;
+
+        void begin();
+        void end(std::string error);
+
+        mutable std::mutex mutex_;
+        std::condition_variable cv_;
+        // The download that writer threads charge their work to.
+        CpuAccount* account_{nullptr};
+        std::size_t pending_{0};
+        std::string error_;
+        std::atomic<bool> failed_{false};
+    };
+
+    explicit WritePipeline(PipelineConfig config = {});
+    ~WritePipeline();
+
+    WritePipeline(const WritePipeline&) = delete;
+    WritePipeline& operator=(const WritePipeline&) = delete;
+
+    std::size_t buffer_size() const { return buffer_size_; }
+    bool has_free_buffer() const;
+    Buffer* try_acquire();
+    void release(Buffer* buffer);
+
+    // Queues `buffer` to be written at `offset` of `file`; the buffer returns
+    // to the pool once written.
+    void submit(const FileWriter& file, std::int64_t offset, Buffer* buffer, Tracker& tracker);
+    void record_pause() { pauses_.fetch_add(1, std::memory_order_relaxed); }
+
+    PipelineStats stats() const;
+
+private:
+    struct WriteJob {
+        const FileWriter* file{nullptr};
+        std::int64_t offset{0};
+        Buffer* buffer{nullptr};
+        Tracker* tracker{nullptr};
+    };
+
+    void writer_loop(std::stop_token stop_token);
+
+    std::size_t buffer_size_;
+    std::unique_ptr<std::byte[]> slab_;
+    std::vector<Buffer> buffers_;
+
+    mutable std::mutex pool_mutex_;
+    std::vector<Buffer*> free_;
+    std::size_t peak_in_use_{0};
+
+    std::mutex queue_mutex_;
+    std::condition_variable_any queue_cv_;
+    // Ring of queued writes. Every job holds a distinct pool buffer, so it
+    // needs one slot per buffer and never grows on the transfer path.
+    std::vector<WriteJob> jobs_;
+    std::size_t jobs_head_{0};
+    std::size_t jobs_size_{0};
+
+    std::atomic<std::uint64_t> pauses_{0};
+    std::atomic<std::uint64_t> bytes_written_{0};
+    std::vector<std::jthread> writers_;
+};
+
+// Sequential writer for one transfer: stages bytes into pool buffers and
+// submits them in order starting at the initial offset. Destruction waits for
+// every submitted write, so it must not outlive the file.
+class WriteStream {
+public:
+    enum class Status {
+        Accepted,
+        PoolExhausted,
+        WriteFailed
+    };
+
+    // Writes are charged to `account` when CpuProfiler is enabled.
+    WriteStream(WritePipeline& pipeline, const FileWriter& file, std::int64_t offset, CpuAccount* account = nullptr);
+    ~WriteStream();
+
+    WriteStream(const WriteStream&) = delete;
+    WriteStream& operator=(const WriteStream&) = delete;
+
+    // Accepts all of `data` or none of it.
+    Status append(const char* data, std::size_t size);
+    // Submits the staged tail and waits for every write; false on I/O error.
+    bool finish(std::string& error);
+
+private:
+    void submit_current();
+
+    WritePipeline& pipeline_;
+    WritePipeline::Tracker tracker_;
+    WritePipeline::Buffer* current_{nullptr};
+    const FileWriter& file_;
+    std::int64_t current_offset_;
+};
+
+}  // namespace downloader
@@ -0,0 +1,135 @@
+#include "downloader/allocation_counter.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace downloader {
+
+namespace {
+
+#if defined(DOWNLOADER_COUNT_ALLOCATIONS)
+// Plain thread_locals with constant initialisation, so operator new can use
+// them without allocating itself.
+thread_local std::uint64_t t_allocations = 0;
+thread_local unsigned t_scope_depth = 0;
+#endif
+
+std::atomic<std::uint64_t> g_callbacks{0};
+std::atomic<std::uint64_t> g_callback_allocations{0};
+
+}  // namespace
+
+std::uint64_t AllocationCounter::thread_allocations() {
+#if defined(DOWNLOADER_COUNT_ALLOCATIONS)
+    return t_allocations;
+#else
+    return 0;
+#endif
+}
+
+CallbackAllocationStats AllocationCounter::callback_stats() {
+    return CallbackAllocationStats{g_callbacks.load(std::memory_order_relaxed),
+                                   g_callback_allocations.load(std::memory_order_relaxed)};
+}
+
+#if defined(DOWNLOADER_COUNT_ALLOCATIONS)
+
+// Nested scopes (a transport callback calling into a sink that also counts)
+// are charged once, to the outermost scope.
+AllocationCounter::CallbackScope::CallbackScope()
+    : start_(t_allocations), outermost_(t_scope_depth++ == 0) {}
+
+AllocationCounter::CallbackScope::~CallbackScope() {
+    --t_scope_depth;
+    if (outermost_) {
+        g_callbacks.fetch_add(1, std::memory_order_relaxed);
+        g_callback_allocations.fetch_add(t_allocations - start_, std::memory_order_relaxed);
+    }
+}
+
+#endif
+
+}  // namespace downloader
+
+#if defined(DOWNLOADER_COUNT_ALLOCATIONS)
+
+namespace {
+
+void* counted_alloc(std::size_t size, std::size_t alignment) {
+    ++downloader::t_allocations;
+    if (size == 0) {
+        size = 1;
+    }
+    if (alignment <= alignof(std::max_align_t)) {
+        return std::malloc(size);
+    }
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    if (void* ptr = counted_alloc(size, 0)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* ptr = counted_alloc(size, static_cast<std::size_t>(alignment))) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return ::operator new(size, alignment);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+#endif
@@ -0,0 +1,427 @@
+#include "downloader/async_client.h"
+
+#include "downloader/cpu_profiler.h"
+#include "downloader/file_writer.h"
+#include "downloader/memory_arena.h"
+#include "downloader/sha256.h"
+#include "downloader/sync.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace downloader {
+
+namespace {
+
+// Requests whose scheduling only DownloadManager implements.
+bool needs_manager(const DownloadRequest& request) {
+    return request.hedge.enabled || request.pieces != nullptr || request.delta;
+}
+
+}  // namespace
+
+// One download, moved along by transport completions rather than by a thread
+// of its own. Every callback it hands out holds a reference to it.
+class AsyncClient::Download : public std::enable_shared_from_this<Download> {
+public:
+    Download(AsyncClient& client, DownloadStatePtr state, CompletionHandler deliver)
+        : client_(client),
+          transport_(client.manager_.transport()),
+          state_(std::move(state)),
+          deliver_(std::move(deliver)) {}
+
+    void start() {
+        if (state_->stop_source.stop_requested()) {
+            finish(cancelled_result());
+            return;
+        }
+        state_->status = DownloadStatus::Probing;
+        transport_.start_probe(state_->request.url, 0, [self = shared_from_this()](ProbeResult probe) {
+            self->probe_ = std::move(probe);
+            self->client_.post([self]() { self->probed(); });
+        });
+    }
+
+private:
+    // One fetch: the whole body, or one range of it.
+    struct Part final : TransferSink {
+        Download* download{nullptr};
+        std::optional<ByteRange> range;
+        std::optional<WriteStream> stream;
+        std::int64_t next_offset{0};
+        bool unexpected_status{false};
+        TransferOutcome outcome;
+
+        Write write(const char* data, std::size_t size) override;
+        bool can_resume() const override { return download->client_.manager_.pipeline().has_free_buffer(); }
+        bool cancelled() const override;
+        void expect_length(std::int64_t length) override;
+        bool accept_status(long http_status) override;
+    };
+
+    void probed();
+    // Sync mode: true when the file on disk already matches the probe.
+    bool local_copy_current();
+    void begin_transfer();
+    void part_done(Part& part, TransferOutcome outcome);
+    void end_transfer();
+
+    void finish(DownloadResult result) {
+        client_.post([deliver = std::move(deliver_), result = std::move(result)]() mutable {
+            deliver(std::move(result));
+        });
+    }
+    DownloadResult cancelled_result() {
+        state_->status = DownloadStatus::Cancelled;
+        return DownloadResult{state_->request.url, state_->request.output_path, DownloadStatus::Cancelled,
+                              state_->http_status.load(), "cancelled"};
+    }
+    DownloadResult failed_result(long http_status, std::string message) {
+        state_->status = DownloadStatus::Failed;
+        state_->http_status = http_status;
+        state_->error_message = message;
+        return DownloadResult{state_->request.url, state_->request.output_path, DownloadStatus::Failed,
+                              http_status, std::move(message)};
+    }
+
+    AsyncClient& client_;
+    Transport& transport_;
+    DownloadStatePtr state_;
+    CompletionHandler deliver_;
+    ProbeResult probe_;
+    std::optional<FileWriter> writer_;
+    std::shared_ptr<MemoryBody> body_;
+    std::vector<std::unique_ptr<Part>> parts_;
+    std::atomic<std::size_t> parts_left_{0};
+    // The part that failed first; the others are stopped once it is set.
+    std::atomic<Part*> first_failed_{nullptr};
+};
+
+TransferSink::Write AsyncClient::Download::Part::write(const char* data, std::size_t size) {
+    if (cancelled()) {
+        return Write::Rejected;
+    }
+    if (MemoryBody* memory = download->body_.get()) {
+        const bool written = range ? memory->write_at(next_offset, data, size) : memory->append(data, size);
+        if (!written) {
+            return Write::Rejected;
+        }
+    } else if (stream) {
+        switch (stream->append(data, size)) {
+            case WriteStream::Status::Accepted:
+                break;
+            case WriteStream::Status::PoolExhausted:
+                return Write::Paused;
+            case WriteStream::Status::WriteFailed:
+                return Write::Rejected;
+        }
+    }
+    next_offset += static_cast<std::int64_t>(size);
+    download->state_->downloaded_bytes.fetch_add(size);
+    return Write::Accepted;
+}
+
+bool AsyncClient::Download::Part::cancelled() const {
+    return download->state_->stop_source.stop_requested() ||
+           download->first_failed_.load(std::memory_order_relaxed) != nullptr;
+}
+
+void AsyncClient::Download::Part::expect_length(std::int64_t length) {
+    auto& total_bytes = download->state_->total_bytes;
+    if (!range && total_bytes.load() == 0) {
+        total_bytes = static_cast<std::uint64_t>(length);
+    }
+}
+
+bool AsyncClient::Download::Part::accept_status(long http_status) {
+    // A 200 to a range request carries the whole body from offset 0.
+    unexpected_status = range && http_status != 206;
+    return !unexpected_status;
+}
+
+void AsyncClient::Download::probed() {
+    if (!probe_.ok) {
+        state_->status = DownloadStatus::Failed;
+        state_->error_message = probe_.error_message;
+        finish(DownloadResult{state_->request.url, state_->request.output_path, DownloadStatus::Failed, 0,
+                              probe_.error_message});
+        return;
+    }
+    if (probe_.content_length > 0) {
+        state_->total_bytes = static_cast<std::uint64_t>(probe_.content_length);
+    }
+
+    const bool sync = state_->request.sync != SyncMode::Off && state_->request.target == DownloadTarget::File;
+    if (sync && local_copy_current()) {
+        state_->status = DownloadStatus::Completed;
+        DownloadResult result{state_->request.url, state_->request.output_path, DownloadStatus::Completed,
+                              probe_.http_status, {}};
+        result.up_to_date = true;
+        finish(std::move(result));
+        return;
+    }
+    begin_transfer();
+}
+
+bool AsyncClient::Download::local_copy_current() {
+    const std::string& path = state_->request.output_path;
+    switch (check_local_file(path, probe_, state_->request.sync)) {
+        case SyncCheck::Fetch:
+            return false;
+        case SyncCheck::UpToDate:
+            return true;
+        case SyncCheck::CompareDigest:
+            break;
+    }
+
+    std::string digest;
+    try {
+        CpuProfiler::Scope cpu(CpuPhase::Hashing, &state_->cpu);
+        digest = sha256_file(path);
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (digest != probe_.sha256) {
+        return false;
+    }
+    stamp_modification_time(path, probe_.last_modified);
+    return true;
+}
+
+void AsyncClient::Download::begin_transfer() {
+    state_->status = DownloadStatus::Running;
+    state_->started_at = transport_.clock().now();
+    state_->downloaded_bytes = 0;
+
+    const DownloadRequest& request = state_->request;
+    const std::int64_t total_size = probe_.content_length;
+    const bool can_split = probe_.accept_ranges && total_size > (1 << 20) && request.preferred_chunks > 1;
+    const std::int64_t chunks =
+        can_split ? std::min<std::int64_t>(
+                        static_cast<std::int64_t>(std::clamp<std::size_t>(request.preferred_chunks, 1,
+                                                                          kMaxPreferredChunks)),
+                        total_size)
+                  : 1;
+
+    try {
+        if (request.target == DownloadTarget::Memory) {
+            MemoryArena& arena = client_.manager_.arena();
+            body_ = can_split ? arena.allocate_fixed(static_cast<std::size_t>(total_size))
+                              : arena.allocate(static_cast<std::size_t>(state_->total_bytes.load()));
+        } else if (request.target == DownloadTarget::File) {
+            writer_.emplace(request.output_path,
+                            can_split ? FileWriter::Mode::ReadWriteTruncate : FileWriter::Mode::Truncate,
+                            request.durability);
+            if (can_split) {
+                writer_->resize(total_size);
+            }
+        }
+
+        const std::int64_t base_chunk_size = total_size / chunks;
+        std::int64_t offset = 0;
+        for (std::int64_t i = 0; i < chunks; ++i) {
+            auto part = std::make_unique<Part>();
+            part->download = this;
+            part->next_offset = offset;
+            if (can_split) {
+                const std::int64_t end = i == chunks - 1 ? total_size - 1 : offset + base_chunk_size - 1;
+                part->range = ByteRange{offset, end};
+                offset = end + 1;
+            }
+            if (writer_) {
+                part->stream.emplace(client_.manager_.pipeline(), *writer_, part->next_offset, &state_->cpu);
+            }
+            parts_.push_back(std::move(part));
+        }
+    } catch (const std::exception& ex) {
+        parts_.clear();
+        writer_.reset();
+        finish(failed_result(0, ex.what()));
+        return;
+    }
+
+    // Once the last part is done the parts may be gone, so they are not
+    // reached through parts_ while starting.
+    std::vector<Part*> pending;
+    pending.reserve(parts_.size());
+    for (auto& part : parts_) {
+        pending.push_back(part.get());
+    }
+    parts_left_ = pending.size();
+    for (std::size_t i = 0; i < pending.size(); ++i) {
+        Part& part = *pending[i];
+        try {
+            transport_.start_fetch(request.url, part.range, part, 0, Connection::Reuse,
+                                   [self = shared_from_this(), &part](TransferOutcome outcome) {
+                                       self->part_done(part, std::move(outcome));
+                                   });
+        } catch (const std::exception& ex) {
+            // This part and the ones after it never started; they fail here.
+            const std::size_t count = pending.size();
+            for (std::size_t j = i; j < count; ++j) {
+                TransferOutcome outcome;
+                outcome.error_message = ex.what();
+                part_done(*pending[j], std::move(outcome));
+            }
+            return;
+        }
+    }
+}
+
+// Runs wherever the transport completes fetches, so the blocking end of the
+// transfer is left to the executor.
+void AsyncClient::Download::part_done(Part& part, TransferOutcome outcome) {
+    const bool ok = outcome.ok;
+    part.outcome = std::move(outcome);
+    if (!ok) {
+        Part* none = nullptr;
+        first_failed_.compare_exchange_strong(none, &part);
+    }
+    if (parts_left_.fetch_sub(1) == 1) {
+        client_.post([self = shared_from_this()]() { self->end_transfer(); });
+    }
+}
+
+void AsyncClient::Download::end_transfer() {
+    std::string write_error;
+    for (auto& part : parts_) {
+        std::string error;
+        if (part->stream && !part->stream->finish(error) && write_error.empty()) {
+            write_error = std::move(error);
+        }
+    }
+
+    const auto result = [&]() {
+        const TransferOutcome& first = parts_.front()->outcome;
+        state_->http_status = first.http_status;
+        if (state_->stop_source.stop_requested()) {
+            return cancelled_result();
+        }
+        if (!write_error.empty()) {
+            return failed_result(first.http_status, std::move(write_error));
+        }
+        // The others were stopped because of it.
+        if (const Part* failed = first_failed_.load()) {
+            if (failed->unexpected_status) {
+                return failed_result(failed->outcome.http_status, "range request returned unexpected HTTP status");
+            }
+            if (failed->outcome.aborted) {
+                return cancelled_result();
+            }
+            return failed_result(failed->outcome.http_status, failed->outcome.error_message);
+        }
+        try {
+            if (writer_) {
+                writer_->commit();
+            }
+        } catch (const std::exception& ex) {
+            return failed_result(first.http_status, ex.what());
+        }
+        if (state_->request.sync != SyncMode::Off && state_->request.target == DownloadTarget::File) {
+            stamp_modification_time(state_->request.output_path, probe_.last_modified);
+        }
+        state_->status = DownloadStatus::Completed;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(transport_.clock().now() -
+                                                                                   state_->started_at);
+        DownloadResult completed{state_->request.url, state_->request.output_path, DownloadStatus::Completed,
+                                 first.http_status, {}, state_->downloaded_bytes.load(), elapsed};
+        completed.body = std::move(body_);
+        return completed;
+    }();
+
+    // Streams wait for their writes and an uncommitted writer removes its
+    // file; both belong on the executor, not wherever the last reference drops.
+    parts_.clear();
+    writer_.reset();
+    finish(std::move(result));
+}
+
+void DownloadOperation::await_suspend(std::coroutine_handle<> continuation) {
+    client_->start(std::move(request_), [client = client_, this, continuation](DownloadResult outcome) {
+        result_ = std::move(outcome);
+        // The client is done with this download before the coroutine can
+        // run, so nothing below touches it.
+        client->finished();
+        continuation.resume();
+    });
+}
+
+AsyncClient::AsyncClient(std::size_t worker_count,
+                         PipelineConfig pipeline,
+                         std::shared_ptr<Transport> transport,
+                         std::shared_ptr<ThreadPool> executor)
+    : manager_(worker_count, pipeline, std::move(transport)),
+      executor_(executor ? std::move(executor)
+                         : std::make_shared<ThreadPool>(std::max<std::size_t>(worker_count, 2),
+                                                        &manager_.transport().clock(), "async client")) {}
+
+AsyncClient::~AsyncClient() {
+    {
+        std::unique_lock lock(mutex_);
+        idle_cv_.wait(lock, [this]() { return in_flight_ == 0; });
+    }
+    // A coroutine resumed on the executor may be destroying the client that
+    // owns it. The worker it runs on cannot join itself, so the pool is let go
+    // of on a thread of its own.
+    if (executor_->is_worker_thread()) {
+        std::thread([executor = std::move(executor_)]() mutable { executor.reset(); }).detach();
+    }
+}
+
+DownloadOperation AsyncClient::download(DownloadRequest request) {
+    return DownloadOperation(*this, std::move(request));
+}
+
+DownloadStatePtr AsyncClient::download(DownloadRequest request, CompletionHandler on_complete) {
+    return start(std::move(request), [this, on_complete = std::move(on_complete)](DownloadResult result) {
+        if (on_complete) {
+            on_complete(std::move(result));
+        }
+        finished();
+    });
+}
+
+DownloadStatePtr AsyncClient::start(DownloadRequest request, CompletionHandler deliver) {
+    {
+        std::scoped_lock lock(mutex_);
+        ++in_flight_;
+    }
+    try {
+        if (needs_manager(request)) {
+            return manager_.submit(std::move(request), [this, deliver = std::move(deliver)](DownloadResult result) {
+                post([deliver, result = std::move(result)]() mutable { deliver(std::move(result)); });
+            });
+        }
+        auto state = std::make_shared<DownloadState>(std::move(request));
+        std::make_shared<Download>(*this, state, std::move(deliver))->start();
+        return state;
+    } catch (...) {
+        finished();
+        throw;
+    }
+}
+
+void AsyncClient::post(std::function<void()> job) {
+    executor_->submit(std::move(job));
+}
+
+std::size_t AsyncClient::in_flight() const {
+    std::scoped_lock lock(mutex_);
+    return in_flight_;
+}
+
+void AsyncClient::finished() {
+    // Notified under the lock: once in_flight_ reaches zero the destructor
+    // may return, and the condition variable with it.
+    std::scoped_lock lock(mutex_);
+    --in_flight_;
+    idle_cv_.notify_all();
+}
+
+}  // namespace downloader
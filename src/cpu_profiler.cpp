@@ -0,0 +1,343 @@
+#include "downloader/cpu_profiler.h"
+
+#include <cerrno>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace downloader {
+
+namespace {
+
+enum Counter : std::size_t {
+    kCycles,
+    kInstructions,
+    kContextSwitches,
+    kSyscalls,
+    kCounterCount
+};
+
+
+struct Snapshot {
+    std::array<std::uint64_t, kCounterCount> counters{};
+    std::uint64_t cpu_ns{0};
+    // Voluntary plus involuntary, from getrusage.
+    std::uint64_t switches{0};
+};
+
+// Decided once by enable() before profiling starts; read-only afterwards.
+struct Config {
+    CpuCounterSupport support;
+    std::array<bool, kCounterCount> available{};
+#if defined(__linux__)
+    std::array<perf_event_attr, kCounterCount> attrs{};
+#endif
+};
+
+Config g_config;
+
+// The group read and the CPU clock read that end every interval, plus
+// getrusage when context switches come from it, are syscalls of the
+// profiler itself and are not charged to the phase.
+std::uint64_t measurement_syscalls() {
+    return g_config.support.context_switches ? 2 : 3;
+}
+
+struct Registry {
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<CpuAccount>> threads;
+};
+
+Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+CpuAccount& run_totals() {
+    static CpuAccount instance;
+    return instance;
+}
+
+std::uint64_t since(std::uint64_t from, std::uint64_t to) {
+    return to > from ? to - from : 0;
+}
+
+#if defined(__linux__)
+int open_counter(perf_event_attr& attr, int group) {
+    return static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC));
+}
+
+// Tries to open a counter for the calling thread, counting kernel mode too if
+// the host allows it, and keeps the attributes that worked.
+bool probe_counter(Counter counter, std::uint32_t type, std::uint64_t config) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int fd = open_counter(attr, -1);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        fd = open_counter(attr, -1);
+    }
+    if (fd < 0) {
+        return false;
+    }
+    ::close(fd);
+    g_config.attrs[counter] = attr;
+    g_config.available[counter] = true;
+    return true;
+}
+
+// The raw_syscalls:sys_enter tracepoint counts every syscall the thread makes.
+std::uint64_t syscall_tracepoint() {
+    for (const char* path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                             "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+        std::ifstream in(path);
+        std::uint64_t id = 0;
+        if (in >> id) {
+            return id;
+        }
+    }
+    return 0;
+}
+#endif
+
+class ThreadCounters {
+public:
+    ThreadCounters() { fds_.fill(-1); }
+    ~ThreadCounters() {
+#if defined(__linux__)
+        for (const int fd : fds_) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+#endif
+    }
+
+    ThreadCounters(const ThreadCounters&) = delete;
+    ThreadCounters& operator=(const ThreadCounters&) = delete;
+
+    void set_label(std::string label) {
+        label_ = std::move(label);
+        account_ = nullptr;
+    }
+
+    Snapshot read() {
+        Snapshot snapshot;
+#if defined(__linux__)
+        if (!opened_) {
+            open();
+        }
+        if (leader_ >= 0) {
+            std::array<std::uint64_t, 1 + kCounterCount> values{};
+            if (::read(leader_, values.data(), sizeof(values)) > 0) {
+                for (std::size_t counter = 0; counter < kCounterCount; ++counter) {
+                    if (slots_[counter] >= 0 && static_cast<std::uint64_t>(slots_[counter]) < values[0]) {
+                        snapshot.counters[counter] = values[1 + static_cast<std::size_t>(slots_[counter])];
+                    }
+                }
+            }
+        }
+        // getrusage only catches up with the running time slice at the next
+        // tick, which is far too coarse for short scopes; the thread clock is
+        // exact.
+        timespec cpu{};
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+        snapshot.cpu_ns = static_cast<std::uint64_t>(cpu.tv_sec) * 1'000'000'000 +
+                          static_cast<std::uint64_t>(cpu.tv_nsec);
+        if (!g_config.support.context_switches) {
+            rusage usage{};
+            ::getrusage(RUSAGE_THREAD, &usage);
+            snapshot.switches = static_cast<std::uint64_t>(usage.ru_nvcsw + usage.ru_nivcsw);
+        }
+#endif
+        return snapshot;
+    }
+
+    // Charges everything since the last snapshot to `phase`.
+    void charge(CpuPhase phase, CpuAccount* download, const Snapshot& now) {
+        CpuCounts counts;
+        counts.cycles = since(last.counters[kCycles], now.counters[kCycles]);
+        counts.instructions = since(last.counters[kInstructions], now.counters[kInstructions]);
+        counts.context_switches = g_config.support.context_switches
+                                      ? since(last.counters[kContextSwitches], now.counters[kContextSwitches])
+                                      : since(last.switches, now.switches);
+        if (g_config.support.syscalls) {
+            counts.syscalls = since(measurement_syscalls(), since(last.counters[kSyscalls], now.counters[kSyscalls]));
+        }
+        counts.cpu_ns = since(last.cpu_ns, now.cpu_ns);
+
+        run_totals().add(phase, counts);
+        if (download != nullptr) {
+            download->add(phase, counts);
+        }
+        account().add(phase, counts);
+    }
+
+    CpuProfiler::Scope* current{nullptr};
+    Snapshot last{};
+
+private:
+    void open() {
+        opened_ = true;
+#if defined(__linux__)
+        for (std::size_t counter = 0; counter < kCounterCount; ++counter) {
+            if (!g_config.available[counter]) {
+                continue;
+            }
+            perf_event_attr attr = g_config.attrs[counter];
+            const int fd = open_counter(attr, leader_);
+            if (fd < 0) {
+                continue;
+            }
+            fds_[counter] = fd;
+            slots_[counter] = members_++;
+            if (leader_ < 0) {
+                leader_ = fd;
+            }
+        }
+#endif
+    }
+
+    CpuAccount& account() {
+        if (account_ == nullptr) {
+            auto& reg = registry();
+            std::scoped_lock lock(reg.mutex);
+            auto& slot = reg.threads[label_];
+            if (!slot) {
+                slot = std::make_unique<CpuAccount>();
+            }
+            account_ = slot.get();
+        }
+        return *account_;
+    }
+
+    std::string label_{"other"};
+    CpuAccount* account_{nullptr};
+    bool opened_{false};
+    int leader_{-1};
+    std::array<int, kCounterCount> fds_{};
+    // Position of each counter in the group read, or -1.
+    std::array<int, kCounterCount> slots_{-1, -1, -1, -1};
+    int members_{0};
+};
+
+thread_local ThreadCounters t_counters;
+
+}  // namespace
+
+void CpuAccount::add(CpuPhase phase, const CpuCounts& counts) {
+    Totals& totals = phases_[static_cast<std::size_t>(phase)];
+    totals.cycles.fetch_add(counts.cycles, std::memory_order_relaxed);
+    totals.instructions.fetch_add(counts.instructions, std::memory_order_relaxed);
+    totals.context_switches.fetch_add(counts.context_switches, std::memory_order_relaxed);
+    totals.syscalls.fetch_add(counts.syscalls, std::memory_order_relaxed);
+    totals.cpu_ns.fetch_add(counts.cpu_ns, std::memory_order_relaxed);
+}
+
+CpuCounts CpuAccount::phase(CpuPhase phase) const {
+    const Totals& totals = phases_[static_cast<std::size_t>(phase)];
+    CpuCounts counts;
+    counts.cycles = totals.cycles.load(std::memory_order_relaxed);
+    counts.instructions = totals.instructions.load(std::memory_order_relaxed);
+    counts.context_switches = totals.context_switches.load(std::memory_order_relaxed);
+    counts.syscalls = totals.syscalls.load(std::memory_order_relaxed);
+    counts.cpu_ns = totals.cpu_ns.load(std::memory_order_relaxed);
+    return counts;
+}
+
+CpuCounts CpuAccount::total() const {
+    CpuCounts counts;
+    for (std::size_t phase = 0; phase < kCpuPhaseCount; ++phase) {
+        counts += this->phase(static_cast<CpuPhase>(phase));
+    }
+    return counts;
+}
+
+bool CpuProfiler::enable(bool perf_counters) {
+#if defined(__linux__)
+    if (enabled()) {
+        return true;
+    }
+    if (!perf_counters) {
+        enabled_.store(true, std::memory_order_release);
+        return true;
+    }
+    CpuCounterSupport& support = g_config.support;
+    support.cycles = probe_counter(kCycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    support.instructions = probe_counter(kInstructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    support.context_switches = probe_counter(kContextSwitches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+    if (const std::uint64_t tracepoint = syscall_tracepoint(); tracepoint != 0) {
+        support.syscalls = probe_counter(kSyscalls, PERF_TYPE_TRACEPOINT, tracepoint);
+    }
+    support.kernel_mode = (support.cycles && g_config.attrs[kCycles].exclude_kernel == 0) ||
+                          (!support.cycles && support.instructions &&
+                           g_config.attrs[kInstructions].exclude_kernel == 0);
+    enabled_.store(true, std::memory_order_release);
+    return true;
+#else
+    (void)perf_counters;
+    return false;
+#endif
+}
+
+CpuCounterSupport CpuProfiler::support() {
+    return g_config.support;
+}
+
+void CpuProfiler::set_thread_label(std::string label) {
+    t_counters.set_label(std::move(label));
+}
+
+const CpuAccount& CpuProfiler::totals() {
+    return run_totals();
+}
+
+std::vector<std::pair<std::string, CpuCounts>> CpuProfiler::thread_totals() {
+    auto& reg = registry();
+    std::scoped_lock lock(reg.mutex);
+    std::vector<std::pair<std::string, CpuCounts>> totals;
+    totals.reserve(reg.threads.size());
+    for (const auto& [label, account] : reg.threads) {
+        totals.emplace_back(label, account->total());
+    }
+    return totals;
+}
+
+void CpuProfiler::Scope::begin() {
+    // Pairs with the release in enable(), so the counter setup is visible.
+    if (!enabled_.load(std::memory_order_acquire)) {
+        return;
+    }
+    ThreadCounters& thread = t_counters;
+    const Snapshot now = thread.read();
+    if (thread.current != nullptr) {
+        thread.charge(thread.current->phase_, thread.current->download_, now);
+    }
+    outer_ = thread.current;
+    thread.current = this;
+    thread.last = now;
+    active_ = true;
+}
+
+void CpuProfiler::Scope::end() {
+    ThreadCounters& thread = t_counters;
+    const Snapshot now = thread.read();
+    thread.charge(phase_, download_, now);
+    thread.current = outer_;
+    thread.last = now;
+}
+
+}  // namespace downloader
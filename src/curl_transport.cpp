@@ -0,0 +1,772 @@
+#include "downloader/curl_transport.h"
+
+#include "downloader/allocation_counter.h"
+#include "downloader/cpu_profiler.h"
+#include "downloader/sha256.h"
+#include "downloader/tracer.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace downloader {
+
+namespace {
+
+struct HeaderParseContext {
+    bool accept_ranges{false};
+    // 0: no digest seen, 1: from Digest, 2: from Repr-Digest (which wins).
+    int digest_source{0};
+    Sha256::Digest sha256{};
+};
+
+char ascii_lower(char ch) {
+    return ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch - 'A' + 'a') : ch;
+}
+
+// `needle` must be lower case.
+std::size_t find_ignore_case(std::string_view text, std::string_view needle) {
+    if (needle.size() > text.size()) {
+        return std::string_view::npos;
+    }
+    for (std::size_t i = 0; i + needle.size() <= text.size(); ++i) {
+        std::size_t j = 0;
+        while (j < needle.size() && ascii_lower(text[i + j]) == needle[j]) {
+            ++j;
+        }
+        if (j == needle.size()) {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
+bool starts_with_ignore_case(std::string_view text, std::string_view prefix) {
+    return text.size() >= prefix.size() && find_ignore_case(text.substr(0, prefix.size()), prefix) == 0;
+}
+
+int base64_value(char ch) {
+    if (ch >= 'A' && ch <= 'Z') {
+        return ch - 'A';
+    }
+    if (ch >= 'a' && ch <= 'z') {
+        return ch - 'a' + 26;
+    }
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0' + 52;
+    }
+    if (ch == '+') {
+        return 62;
+    }
+    if (ch == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+// Picks the sha-256 member out of a Repr-Digest (`sha-256=:<base64>:`) or
+// legacy Digest (`sha-256=<base64>`) header line and decodes it into `digest`.
+bool parse_sha256_digest(std::string_view header, Sha256::Digest& digest) {
+    const std::size_t key = find_ignore_case(header, "sha-256=");
+    if (key == std::string_view::npos) {
+        return false;
+    }
+    std::string_view value = header.substr(key + 8);
+    if (!value.empty() && value.front() == ':') {
+        value.remove_prefix(1);
+    }
+
+    Sha256::Digest decoded{};
+    std::size_t out = 0;
+    std::uint32_t bits = 0;
+    int bit_count = 0;
+    for (const char ch : value) {
+        const int sextet = base64_value(ch);
+        if (sextet < 0) {
+            break;
+        }
+        bits = (bits << 6) | static_cast<std::uint32_t>(sextet);
+        bit_count += 6;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            if (out == decoded.size()) {
+                return false;
+            }
+            decoded[out++] = static_cast<std::uint8_t>(bits >> bit_count);
+        }
+    }
+    if (out != decoded.size()) {
+        return false;
+    }
+    digest = decoded;
+    return true;
+}
+
+// Runs for every response header line, so it only looks at the line in
+// place and never allocates.
+size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    const AllocationCounter::CallbackScope scope;
+    const std::size_t total = size * nitems;
+    auto* ctx = static_cast<HeaderParseContext*>(userdata);
+    const std::string_view header(buffer, total);
+    if (starts_with_ignore_case(header, "accept-ranges:") &&
+        find_ignore_case(header.substr(14), "bytes") != std::string_view::npos) {
+        ctx->accept_ranges = true;
+    } else if (starts_with_ignore_case(header, "repr-digest:")) {
+        if (parse_sha256_digest(header.substr(12), ctx->sha256)) {
+            ctx->digest_source = 2;
+        }
+    } else if (starts_with_ignore_case(header, "digest:") && ctx->digest_source < 2) {
+        if (parse_sha256_digest(header.substr(7), ctx->sha256)) {
+            ctx->digest_source = 1;
+        }
+    }
+    return total;
+}
+
+// Parses "bytes <begin>-<end>/<length>" from a Content-Range header value.
+bool parse_content_range(std::string_view text, std::int64_t& begin, std::int64_t& end) {
+    const std::size_t unit = find_ignore_case(text, "bytes");
+    if (unit == std::string_view::npos) {
+        return false;
+    }
+    text.remove_prefix(unit + 5);
+    while (!text.empty() && text.front() == ' ') {
+        text.remove_prefix(1);
+    }
+    const char* const last = text.data() + text.size();
+    const auto first = std::from_chars(text.data(), last, begin);
+    if (first.ec != std::errc{} || first.ptr == last || *first.ptr != '-') {
+        return false;
+    }
+    const auto second = std::from_chars(first.ptr + 1, last, end);
+    return second.ec == std::errc{} && end >= begin;
+}
+
+// Turns the body of a multi-range response into offset writes. A server may
+// answer with multipart/byteranges, with one 206 part when it merged the
+// ranges itself, or with the whole body and a 200.
+class RangeSetDecoder final : public TransferSink {
+public:
+    explicit RangeSetDecoder(RangeSetSink& target) : target_(target) {
+        // Part headers are a few short lines; no reallocation once running.
+        part_headers_.reserve(kMaxPartHeaders);
+    }
+
+    void header(std::string_view line) {
+        if (line.starts_with("HTTP/")) {
+            // A new status line (after a redirect or 100 Continue) starts over.
+            const std::size_t space = line.find(' ');
+            status_ = 0;
+            if (space != std::string_view::npos) {
+                std::from_chars(line.data() + space + 1, line.data() + line.size(), status_);
+            }
+            multipart_ = false;
+            offset_ = status_ == 200 ? 0 : -1;
+            single_part_ = {-1, -1};
+        } else if (starts_with_ignore_case(line, "content-type:")) {
+            multipart_ = find_ignore_case(line, "multipart/byteranges") != std::string_view::npos;
+        } else if (starts_with_ignore_case(line, "content-range:")) {
+            std::int64_t end = 0;
+            if (!parse_content_range(line.substr(14), offset_, end)) {
+                offset_ = -1;
+            }
+            single_part_ = {offset_, end};
+        }
+    }
+
+    // The span of a non-multipart 206. Servers may answer a range set with a
+    // single part, either coalescing the ranges or serving only the first.
+    std::optional<ByteRange> single_part() const {
+        if (status_ != 206 || multipart_ || single_part_.begin < 0) {
+            return std::nullopt;
+        }
+        return single_part_;
+    }
+
+    Write write(const char* data, std::size_t size) override {
+        if (!multipart_) {
+            if (offset_ < 0 || !target_.write_at(offset_, data, size)) {
+                return Write::Rejected;
+            }
+            offset_ += static_cast<std::int64_t>(size);
+            return Write::Accepted;
+        }
+
+        while (size > 0) {
+            if (part_left_ > 0) {
+                const auto take = static_cast<std::size_t>(
+                    std::min<std::int64_t>(part_left_, static_cast<std::int64_t>(size)));
+                if (!target_.write_at(offset_, data, take)) {
+                    return Write::Rejected;
+                }
+                offset_ += static_cast<std::int64_t>(take);
+                part_left_ -= static_cast<std::int64_t>(take);
+                data += take;
+                size -= take;
+                continue;
+            }
+
+            // Between parts: boundary line and part headers, up to a blank line.
+            part_headers_.push_back(*data++);
+            --size;
+            if (part_headers_.ends_with("\r\n\r\n")) {
+                const std::string_view headers = part_headers_;
+                const std::size_t range = find_ignore_case(headers, "content-range:");
+                std::int64_t end = 0;
+                if (range == std::string_view::npos ||
+                    !parse_content_range(headers.substr(range + 14), offset_, end)) {
+                    return Write::Rejected;
+                }
+                part_left_ = end + 1 - offset_;
+                part_headers_.clear();
+            } else if (part_headers_.size() == kMaxPartHeaders) {
+                return Write::Rejected;
+            }
+        }
+        return Write::Accepted;
+    }
+
+    bool can_resume() const override { return true; }
+    bool cancelled() const override { return target_.cancelled(); }
+
+private:
+    static constexpr std::size_t kMaxPartHeaders = 4096;
+
+    RangeSetSink& target_;
+    long status_{0};
+    bool multipart_{false};
+    std::int64_t offset_{-1};
+    std::int64_t part_left_{0};
+    ByteRange single_part_{-1, -1};
+    std::string part_headers_;
+};
+
+size_t range_set_header_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    const AllocationCounter::CallbackScope scope;
+    const std::size_t total = size * nitems;
+    static_cast<RangeSetDecoder*>(userdata)->header(std::string_view(buffer, total));
+    return total;
+}
+
+constexpr int kPollTimeoutMs = 1000;
+constexpr int kPausedPollMs = 2;
+
+void configure_probe(CURL* handle, HeaderParseContext& header_ctx) {
+    curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, &header_ctx);
+    curl_easy_setopt(handle, CURLOPT_FILETIME, 1L);
+}
+
+ProbeResult probe_result(CURL* handle, CURLcode rc, const HeaderParseContext& header_ctx) {
+    ProbeResult result;
+    long http_status = 0;
+    curl_off_t content_length = -1;
+    curl_off_t last_modified = -1;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_status);
+    curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+    curl_easy_getinfo(handle, CURLINFO_FILETIME_T, &last_modified);
+    result.http_status = http_status;
+
+    if (rc != CURLE_OK) {
+        result.error_message = curl_easy_strerror(rc);
+        return result;
+    }
+
+    if (http_status >= 400) {
+        result.error_message = "HTTP status " + std::to_string(http_status);
+        return result;
+    }
+
+    result.ok = true;
+    result.content_length = static_cast<std::int64_t>(content_length);
+    result.accept_ranges = header_ctx.accept_ranges;
+    result.last_modified = static_cast<std::int64_t>(last_modified);
+    if (header_ctx.digest_source != 0) {
+        result.sha256 = Sha256::to_hex(header_ctx.sha256);
+    }
+    return result;
+}
+
+TransferOutcome fetch_outcome(CURL* handle, CURLcode rc, const char* error_buffer) {
+    TransferOutcome outcome;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &outcome.http_status);
+    outcome.ok = rc == CURLE_OK;
+    outcome.aborted = rc == CURLE_ABORTED_BY_CALLBACK;
+    if (!outcome.ok) {
+        outcome.error_message = error_buffer[0] != '\0' ? error_buffer : curl_easy_strerror(rc);
+    }
+    return outcome;
+}
+
+// Connect, TLS and first-byte times are only known once the transfer is
+// over, so they are placed on the track relative to its start.
+void trace_connection(CURL* handle, std::uint32_t track, std::uint64_t start_ns) {
+    curl_off_t connect_us = 0;
+    curl_off_t tls_us = 0;
+    curl_off_t first_byte_us = 0;
+    long new_connections = 0;
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us);
+    curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &new_connections);
+
+    Tracer::record_at(start_ns + static_cast<std::uint64_t>(connect_us) * 1000, track, TraceEvent::Connected,
+                      new_connections == 0 ? 1 : 0);
+    if (tls_us > 0) {
+        Tracer::record_at(start_ns + static_cast<std::uint64_t>(tls_us) * 1000, track, TraceEvent::TlsConnected);
+    }
+    if (first_byte_us > 0) {
+        Tracer::record_at(start_ns + static_cast<std::uint64_t>(first_byte_us) * 1000, track,
+                          TraceEvent::FirstByte);
+    }
+}
+
+}  // namespace
+
+// Drives every request started on the transport from one multi handle, on a
+// thread of its own. Paused transfers are resumed here, and completion
+// callbacks run here, once the request has been taken off the multi handle.
+class CurlTransport::EventLoop {
+public:
+    struct Request {
+        CurlHandle handle;
+        // Fetches only; a probe has no sink.
+        Transfer transfer{};
+        // Probes only.
+        HeaderParseContext header{};
+        std::array<char, CURL_ERROR_SIZE> error_buffer{};
+        std::uint32_t trace_track{0};
+        std::uint64_t start_ns{0};
+        ProbeCallback on_probe;
+        FetchCallback on_fetch;
+    };
+
+    EventLoop() : multi_(make_curl_multi()) {
+        thread_ = std::jthread([this](std::stop_token stop_token) { run(stop_token); });
+    }
+
+    ~EventLoop() {
+        thread_.request_stop();
+        curl_multi_wakeup(multi_.get());
+        thread_.join();
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void start(std::unique_ptr<Request> request) {
+        {
+            std::scoped_lock lock(mutex_);
+            incoming_.push_back(std::move(request));
+        }
+        curl_multi_wakeup(multi_.get());
+    }
+
+private:
+    void run(std::stop_token stop_token) {
+        CpuProfiler::set_thread_label("curl event loop");
+        std::vector<std::unique_ptr<Request>> added;
+        std::vector<CURL*> stopped;
+        while (!stop_token.stop_requested()) {
+            {
+                std::scoped_lock lock(mutex_);
+                added.swap(incoming_);
+            }
+            for (auto& request : added) {
+                CURL* const handle = request->handle.get();
+                if (curl_multi_add_handle(multi_.get(), handle) != CURLM_OK) {
+                    finish(std::move(request), CURLE_FAILED_INIT);
+                    continue;
+                }
+                running_.emplace(handle, std::move(request));
+            }
+            added.clear();
+
+            for (auto& [handle, request] : running_) {
+                Transfer& transfer = request->transfer;
+                if (transfer.paused && transfer.sink->can_resume()) {
+                    transfer.paused = false;
+                    curl_easy_pause(handle, CURLPAUSE_CONT);
+                }
+            }
+            int running = 0;
+            curl_multi_perform(multi_.get(), &running);
+            int queued = 0;
+            while (CURLMsg* message = curl_multi_info_read(multi_.get(), &queued)) {
+                if (message->msg == CURLMSG_DONE) {
+                    complete(message->easy_handle, message->data.result);
+                }
+            }
+
+            // A paused transfer gets no progress callbacks, so its sink is
+            // asked here whether it has been cancelled.
+            bool paused = false;
+            for (auto& [handle, request] : running_) {
+                if (request->transfer.paused) {
+                    paused = true;
+                    if (request->transfer.sink->cancelled()) {
+                        stopped.push_back(handle);
+                    }
+                }
+            }
+            for (CURL* handle : stopped) {
+                complete(handle, CURLE_ABORTED_BY_CALLBACK);
+            }
+            stopped.clear();
+
+            curl_multi_poll(multi_.get(), nullptr, 0, paused ? kPausedPollMs : kPollTimeoutMs, nullptr);
+        }
+
+        std::vector<std::unique_ptr<Request>> abandoned;
+        {
+            std::scoped_lock lock(mutex_);
+            abandoned.swap(incoming_);
+        }
+        for (auto& [handle, request] : running_) {
+            curl_multi_remove_handle(multi_.get(), handle);
+            abandoned.push_back(std::move(request));
+        }
+        running_.clear();
+        for (auto& request : abandoned) {
+            std::snprintf(request->error_buffer.data(), request->error_buffer.size(), "transport shut down");
+            finish(std::move(request), CURLE_FAILED_INIT);
+        }
+    }
+
+    void complete(CURL* handle, CURLcode rc) {
+        const auto found = running_.find(handle);
+        if (found == running_.end()) {
+            return;
+        }
+        std::unique_ptr<Request> request = std::move(found->second);
+        running_.erase(found);
+        curl_multi_remove_handle(multi_.get(), handle);
+        finish(std::move(request), rc);
+    }
+
+    // The request is destroyed before its callback runs; the callback is the
+    // last thing that may touch the sink.
+    static void finish(std::unique_ptr<Request> request, CURLcode rc) {
+        CURL* const handle = request->handle.get();
+        if (request->trace_track != 0) {
+            trace_connection(handle, request->trace_track, request->start_ns);
+        }
+        if (request->on_probe) {
+            ProbeResult result = probe_result(handle, rc, request->header);
+            if (rc != CURLE_OK && request->error_buffer[0] != '\0') {
+                result.error_message = request->error_buffer.data();
+            }
+            ProbeCallback done = std::move(request->on_probe);
+            request.reset();
+            done(std::move(result));
+        } else {
+            TransferOutcome outcome = fetch_outcome(handle, rc, request->error_buffer.data());
+            FetchCallback done = std::move(request->on_fetch);
+            request.reset();
+            done(std::move(outcome));
+        }
+    }
+
+    CurlMultiHandle multi_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Request>> incoming_;
+    // Only touched by the loop thread.
+    std::unordered_map<CURL*, std::unique_ptr<Request>> running_;
+    std::jthread thread_;
+};
+
+CurlTransport::CurlTransport() = default;
+
+CurlTransport::~CurlTransport() = default;
+
+ProbeResult CurlTransport::probe(const std::string& url, std::uint32_t trace_track) {
+    try {
+        auto handle = make_curl_handle();
+        HeaderParseContext header_ctx;
+        configure_common(handle.get(), url);
+        configure_probe(handle.get(), header_ctx);
+
+        const std::uint64_t start_ns = trace_track != 0 ? Tracer::now_ns() : 0;
+        const CURLcode rc = curl_easy_perform(handle.get());
+        if (trace_track != 0) {
+            trace_connection(handle.get(), trace_track, start_ns);
+        }
+        return probe_result(handle.get(), rc, header_ctx);
+    } catch (const std::exception& ex) {
+        ProbeResult result;
+        result.error_message = ex.what();
+        return result;
+    }
+}
+
+TransferOutcome CurlTransport::fetch(const std::string& url,
+                                     std::optional<ByteRange> range,
+                                     TransferSink& sink,
+                                     std::uint32_t trace_track,
+                                     Connection connection) {
+    try {
+        auto handle = make_curl_handle();
+        Transfer transfer{&sink, handle.get()};
+        std::array<char, CURL_ERROR_SIZE> error_buffer{};
+        configure_fetch(handle.get(), url, range, connection, transfer, error_buffer.data());
+
+        const std::uint64_t start_ns = trace_track != 0 ? Tracer::now_ns() : 0;
+        const CURLcode rc = perform(handle.get(), transfer);
+        if (trace_track != 0) {
+            trace_connection(handle.get(), trace_track, start_ns);
+        }
+        return fetch_outcome(handle.get(), rc, error_buffer.data());
+    } catch (const std::exception& ex) {
+        TransferOutcome outcome;
+        outcome.error_message = ex.what();
+        return outcome;
+    }
+}
+
+TransferOutcome CurlTransport::fetch_ranges(const std::string& url,
+                                            std::span<const ByteRange> ranges,
+                                            RangeSetSink& sink,
+                                            std::uint32_t trace_track) {
+    TransferOutcome outcome;
+    try {
+        auto handle = make_curl_handle();
+        RangeSetDecoder decoder(sink);
+        Transfer transfer{&decoder, handle.get()};
+        std::array<char, CURL_ERROR_SIZE> error_buffer{};
+
+        std::string range_header;
+        std::array<char, 24> number{};
+        for (const ByteRange& range : ranges) {
+            if (!range_header.empty()) {
+                range_header.push_back(',');
+            }
+            range_header.append(number.data(), std::to_chars(number.data(), number.data() + number.size(),
+                                                             range.begin).ptr);
+            range_header.push_back('-');
+            range_header.append(number.data(), std::to_chars(number.data(), number.data() + number.size(),
+                                                             range.end).ptr);
+        }
+
+        configure_common(handle.get(), url);
+        curl_easy_setopt(handle.get(), CURLOPT_RANGE, range_header.c_str());
+        curl_easy_setopt(handle.get(), CURLOPT_HEADERFUNCTION, range_set_header_callback);
+        curl_easy_setopt(handle.get(), CURLOPT_HEADERDATA, &decoder);
+        curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION, &CurlTransport::write_callback);
+        curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &transfer);
+        curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, &CurlTransport::progress_callback);
+        curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &transfer);
+        curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(handle.get(), CURLOPT_ERRORBUFFER, error_buffer.data());
+
+        const std::uint64_t start_ns = trace_track != 0 ? Tracer::now_ns() : 0;
+        const CURLcode rc = perform(handle.get(), transfer);
+        curl_easy_getinfo(handle.get(), CURLINFO_RESPONSE_CODE, &outcome.http_status);
+        if (trace_track != 0) {
+            trace_connection(handle.get(), trace_track, start_ns);
+        }
+
+        outcome.ok = rc == CURLE_OK;
+        outcome.aborted = rc == CURLE_ABORTED_BY_CALLBACK;
+        if (!outcome.ok) {
+            outcome.error_message = error_buffer[0] != '\0' ? error_buffer.data() : curl_easy_strerror(rc);
+        }
+
+        // Whatever the single part left out is fetched one range at a time.
+        if (const std::optional<ByteRange> served = decoder.single_part(); outcome.ok && served) {
+            std::vector<ByteRange> missing;
+            for (const ByteRange& range : ranges) {
+                if (range.begin < served->begin || range.end > served->end) {
+                    missing.push_back(range);
+                }
+            }
+            if (!missing.empty()) {
+                return Transport::fetch_ranges(url, missing, sink, trace_track);
+            }
+        }
+    } catch (const std::exception& ex) {
+        outcome.ok = false;
+        outcome.error_message = ex.what();
+    }
+    return outcome;
+}
+
+void CurlTransport::start_probe(const std::string& url, std::uint32_t trace_track, ProbeCallback done) {
+    auto request = std::make_unique<EventLoop::Request>();
+    try {
+        request->handle = make_curl_handle();
+    } catch (const std::exception& ex) {
+        ProbeResult result;
+        result.error_message = ex.what();
+        done(std::move(result));
+        return;
+    }
+    configure_common(request->handle.get(), url);
+    configure_probe(request->handle.get(), request->header);
+    curl_easy_setopt(request->handle.get(), CURLOPT_ERRORBUFFER, request->error_buffer.data());
+    request->trace_track = trace_track;
+    request->start_ns = trace_track != 0 ? Tracer::now_ns() : 0;
+    request->on_probe = std::move(done);
+    event_loop().start(std::move(request));
+}
+
+void CurlTransport::start_fetch(const std::string& url,
+                                std::optional<ByteRange> range,
+                                TransferSink& sink,
+                                std::uint32_t trace_track,
+                                Connection connection,
+                                FetchCallback done) {
+    auto request = std::make_unique<EventLoop::Request>();
+    try {
+        request->handle = make_curl_handle();
+    } catch (const std::exception& ex) {
+        TransferOutcome outcome;
+        outcome.error_message = ex.what();
+        done(std::move(outcome));
+        return;
+    }
+    request->transfer = Transfer{&sink, request->handle.get()};
+    configure_fetch(request->handle.get(), url, range, connection, request->transfer,
+                    request->error_buffer.data());
+    request->trace_track = trace_track;
+    request->start_ns = trace_track != 0 ? Tracer::now_ns() : 0;
+    request->on_fetch = std::move(done);
+    event_loop().start(std::move(request));
+}
+
+CurlTransport::EventLoop& CurlTransport::event_loop() {
+    std::call_once(loop_started_, [this]() { loop_ = std::make_unique<EventLoop>(); });
+    return *loop_;
+}
+
+std::size_t CurlTransport::write_callback(char* ptr, std::size_t size, std::size_t nmemb, void* userdata) {
+    const AllocationCounter::CallbackScope scope;
+    auto* transfer = static_cast<Transfer*>(userdata);
+    const std::size_t total = size * nmemb;
+    if (!transfer->status_checked) {
+        transfer->status_checked = true;
+        long http_status = 0;
+        curl_easy_getinfo(transfer->handle, CURLINFO_RESPONSE_CODE, &http_status);
+        if (!transfer->sink->accept_status(http_status)) {
+            return 0;
+        }
+    }
+    switch (transfer->sink->write(ptr, total)) {
+        case TransferSink::Write::Accepted:
+            return total;
+        case TransferSink::Write::Paused:
+            transfer->paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        case TransferSink::Write::Rejected:
+            break;
+    }
+    return 0;
+}
+
+int CurlTransport::progress_callback(void* clientp,
+                                     curl_off_t dltotal,
+                                     curl_off_t,
+                                     curl_off_t,
+                                     curl_off_t) {
+    const AllocationCounter::CallbackScope scope;
+    auto* transfer = static_cast<Transfer*>(clientp);
+    if (transfer->sink->cancelled()) {
+        return 1;
+    }
+    if (dltotal > 0) {
+        transfer->sink->expect_length(static_cast<std::int64_t>(dltotal));
+    }
+    return 0;
+}
+
+CURLcode CurlTransport::perform(CURL* handle, Transfer& transfer) const {
+    auto multi = make_curl_multi();
+    if (curl_multi_add_handle(multi.get(), handle) != CURLM_OK) {
+        return CURLE_FAILED_INIT;
+    }
+    struct Detach {
+        CURLM* multi;
+        CURL* handle;
+        ~Detach() { curl_multi_remove_handle(multi, handle); }
+    } detach{multi.get(), handle};
+
+    int running = 1;
+    while (true) {
+        if (transfer.paused && transfer.sink->can_resume()) {
+            transfer.paused = false;
+            curl_easy_pause(handle, CURLPAUSE_CONT);
+        }
+        if (curl_multi_perform(multi.get(), &running) != CURLM_OK) {
+            return CURLE_FAILED_INIT;
+        }
+        if (running == 0) {
+            break;
+        }
+        if (transfer.paused && transfer.sink->cancelled()) {
+            return CURLE_ABORTED_BY_CALLBACK;
+        }
+        curl_multi_poll(multi.get(), nullptr, 0, transfer.paused ? kPausedPollMs : kPollTimeoutMs, nullptr);
+    }
+
+    CURLcode rc = CURLE_OK;
+    int queued = 0;
+    while (CURLMsg* message = curl_multi_info_read(multi.get(), &queued)) {
+        if (message->msg == CURLMSG_DONE && message->easy_handle == handle) {
+            rc = message->data.result;
+        }
+    }
+    return rc;
+}
+
+void CurlTransport::configure_fetch(CURL* handle,
+                                    const std::string& url,
+                                    std::optional<ByteRange> range,
+                                    Connection connection,
+                                    Transfer& transfer,
+                                    char* error_buffer) const {
+    configure_common(handle, url);
+    if (connection == Connection::Fresh) {
+        // Keeps the transfer off the shared connection cache both ways.
+        curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 1L);
+    }
+    // "<begin>-<end>" fits on the stack; curl copies it.
+    std::array<char, 48> range_header{};
+    if (range) {
+        char* const last = range_header.data() + range_header.size() - 1;
+        char* cursor = std::to_chars(range_header.data(), last, range->begin).ptr;
+        *cursor++ = '-';
+        std::to_chars(cursor, last, range->end);
+        curl_easy_setopt(handle, CURLOPT_RANGE, range_header.data());
+    }
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &CurlTransport::write_callback);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &transfer);
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, &CurlTransport::progress_callback);
+    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, &transfer);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, error_buffer);
+}
+
+void CurlTransport::configure_common(CURL* handle, const std::string& url) const {
+    curl_easy_setopt(handle, CURLOPT_SHARE, share_.get());
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, "ModernDownloader/1.0");
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 0L);
+}
+
+}  // namespace downloader
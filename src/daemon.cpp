@@ -0,0 +1,386 @@
+#include "downloader/daemon.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+
+namespace downloader {
+
+namespace {
+
+constexpr auto kProgressInterval = std::chrono::milliseconds(500);
+constexpr int kAcceptPollMs = 100;
+// A client that lets this much output pile up is not reading; it is
+// disconnected rather than allowed to hold memory or a writer thread.
+constexpr std::size_t kMaxQueuedOutput = 4 << 20;
+
+std::runtime_error make_socket_error(const std::string& prefix) {
+    return std::runtime_error(prefix + ": " + std::strerror(errno));
+}
+
+sockaddr_un make_address(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+// Makes room for the listening socket at `path`. Only a socket nobody is
+// listening on any more is removed; anything else is left alone.
+void claim_socket_path(const std::string& path, const sockaddr_un& address) {
+    struct stat info {};
+    if (::lstat(path.c_str(), &info) != 0) {
+        if (errno == ENOENT) {
+            return;
+        }
+        throw make_socket_error("cannot check " + path);
+    }
+    if (!S_ISSOCK(info.st_mode)) {
+        throw std::runtime_error(path + " exists and is not a socket; refusing to replace it");
+    }
+
+    const int probe_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe_fd < 0) {
+        throw make_socket_error("socket failed");
+    }
+    const int connected = ::connect(probe_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    const int connect_errno = errno;
+    ::close(probe_fd);
+    if (connected == 0) {
+        throw std::runtime_error("a daemon is already listening on " + path);
+    }
+    if (connect_errno != ECONNREFUSED) {
+        errno = connect_errno;
+        throw make_socket_error("cannot check " + path);
+    }
+    // Left behind by a daemon that did not shut down cleanly.
+    if (::unlink(path.c_str()) != 0 && errno != ENOENT) {
+        throw make_socket_error("cannot remove stale socket " + path);
+    }
+}
+
+bool is_active(DownloadStatus status) {
+    return status == DownloadStatus::Pending || status == DownloadStatus::Probing ||
+           status == DownloadStatus::Running;
+}
+
+}  // namespace
+
+void DaemonServer::Session::send(protocol::FrameType type, const std::string& payload) {
+    std::scoped_lock lock(write_mutex);
+    if (closed) {
+        return;
+    }
+    // Progress is resent every interval, so a client that is behind only
+    // gets the next one; results are always queued.
+    if (type == protocol::FrameType::Progress && !outbox.empty()) {
+        return;
+    }
+    outbox += protocol::encode_frame(type, payload);
+    if (outbox.size() > kMaxQueuedOutput) {
+        std::cerr << "daemon: dropping client: not reading its results\n";
+        outbox.clear();
+        ::shutdown(fd, SHUT_RDWR);
+        return;
+    }
+    flush_locked();
+}
+
+void DaemonServer::Session::flush() {
+    std::scoped_lock lock(write_mutex);
+    if (!closed) {
+        flush_locked();
+    }
+}
+
+bool DaemonServer::Session::has_output() {
+    std::scoped_lock lock(write_mutex);
+    return !closed && !outbox.empty();
+}
+
+void DaemonServer::Session::flush_locked() {
+    std::size_t written_total = 0;
+    while (written_total < outbox.size()) {
+        const ssize_t written = ::send(fd, outbox.data() + written_total, outbox.size() - written_total,
+                                       MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // The reader notices the broken connection and cleans up.
+                outbox.clear();
+                ::shutdown(fd, SHUT_RDWR);
+                return;
+            }
+            break;
+        }
+        written_total += static_cast<std::size_t>(written);
+    }
+    outbox.erase(0, written_total);
+}
+
+void DaemonServer::Session::interrupt() {
+    std::scoped_lock lock(write_mutex);
+    if (!closed) {
+        ::shutdown(fd, SHUT_RDWR);
+    }
+}
+
+void DaemonServer::Session::close() {
+    std::scoped_lock lock(write_mutex);
+    if (!closed) {
+        closed = true;
+        ::close(fd);
+    }
+}
+
+DaemonServer::DaemonServer(std::string socket_path, std::size_t worker_count, PipelineConfig pipeline)
+    : socket_path_(std::move(socket_path)), manager_(worker_count, pipeline) {
+    const sockaddr_un address = make_address(socket_path_);
+    claim_socket_path(socket_path_, address);
+    listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        throw make_socket_error("socket failed");
+    }
+    if (::bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listen_fd_, SOMAXCONN) != 0) {
+        const auto error = make_socket_error("bind failed for " + socket_path_);
+        ::close(listen_fd_);
+        throw error;
+    }
+}
+
+DaemonServer::~DaemonServer() {
+    ::close(listen_fd_);
+    ::unlink(socket_path_.c_str());
+}
+
+void DaemonServer::run(std::stop_token stop_token) {
+    auto last_progress = std::chrono::steady_clock::now();
+
+    std::vector<pollfd> polled;
+    while (!stop_token.stop_requested()) {
+        // Sessions with queued output are polled for room to write more.
+        polled.assign(1, pollfd{listen_fd_, POLLIN, 0});
+        {
+            std::scoped_lock lock(sessions_mutex_);
+            for (const auto& session : sessions_) {
+                if (session->has_output()) {
+                    polled.push_back(pollfd{session->fd, POLLOUT, 0});
+                }
+            }
+        }
+        const int ready = ::poll(polled.data(), polled.size(), kAcceptPollMs);
+        if (ready < 0 && errno != EINTR) {
+            throw make_socket_error("poll failed");
+        }
+        if (ready > 0) {
+            flush_sessions(polled);
+        }
+        if (ready > 0 && (polled[0].revents & POLLIN) != 0) {
+            const int client_fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client_fd >= 0) {
+                auto session = std::make_shared<Session>(client_fd);
+                session->reader = std::jthread([this, session]() { serve(session); });
+                std::scoped_lock lock(sessions_mutex_);
+                sessions_.push_back(std::move(session));
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_progress >= kProgressInterval) {
+            publish_progress();
+            last_progress = now;
+        }
+        reap_sessions();
+    }
+
+    std::vector<std::shared_ptr<Session>> sessions;
+    {
+        std::scoped_lock lock(sessions_mutex_);
+        sessions.swap(sessions_);
+    }
+    for (const auto& session : sessions) {
+        session->interrupt();
+    }
+    for (const auto& session : sessions) {
+        if (session->reader.joinable()) {
+            session->reader.join();
+        }
+    }
+}
+
+void DaemonServer::flush_sessions(const std::vector<pollfd>& polled) {
+    std::vector<std::shared_ptr<Session>> writable;
+    {
+        std::scoped_lock lock(sessions_mutex_);
+        for (std::size_t i = 1; i < polled.size(); ++i) {
+            if (polled[i].revents == 0) {
+                continue;
+            }
+            const auto it = std::find_if(sessions_.begin(), sessions_.end(),
+                                         [&](const auto& session) { return session->fd == polled[i].fd; });
+            if (it != sessions_.end()) {
+                writable.push_back(*it);
+            }
+        }
+    }
+    for (const auto& session : writable) {
+        session->flush();
+    }
+}
+
+void DaemonServer::serve(const std::shared_ptr<Session>& session) {
+    try {
+        while (auto frame = protocol::read_frame(session->fd)) {
+            switch (frame->type) {
+                case protocol::FrameType::Submit:
+                    submit(session, protocol::decode_submit(frame->payload));
+                    break;
+                case protocol::FrameType::Cancel: {
+                    const std::uint64_t job_id = protocol::decode_cancel(frame->payload);
+                    std::scoped_lock lock(session->jobs_mutex);
+                    if (auto it = session->jobs.find(job_id); it != session->jobs.end()) {
+                        it->second->stop_source.request_stop();
+                    }
+                    break;
+                }
+                default:
+                    throw std::runtime_error("unexpected frame type from client");
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "daemon: dropping client: " << ex.what() << '\n';
+    }
+
+    // Nobody is left to receive the results, so stop the client's jobs.
+    {
+        std::scoped_lock lock(session->jobs_mutex);
+        for (auto& [job_id, state] : session->jobs) {
+            state->stop_source.request_stop();
+        }
+    }
+    session->close();
+    session->done = true;
+}
+
+void DaemonServer::submit(const std::shared_ptr<Session>& session, protocol::SubmitMessage message) {
+    const std::uint64_t job_id = message.job_id;
+    std::weak_ptr<Session> weak_session = session;
+
+    // Holding jobs_mutex keeps the completion handler from erasing the job
+    // before it has been recorded.
+    std::scoped_lock lock(session->jobs_mutex);
+    // Results are matched to jobs by id, so two running jobs cannot share one.
+    if (session->jobs.contains(job_id)) {
+        throw std::runtime_error("duplicate job id " + std::to_string(job_id) + " from client");
+    }
+    auto state = manager_.submit(std::move(message.request), [weak_session, job_id](DownloadResult result) {
+        auto owner = weak_session.lock();
+        if (!owner) {
+            return;
+        }
+        {
+            std::scoped_lock jobs_lock(owner->jobs_mutex);
+            owner->jobs.erase(job_id);
+        }
+        protocol::ResultMessage reply;
+        reply.job_id = job_id;
+        reply.status = result.status;
+        reply.http_status = result.http_status;
+        reply.bytes = result.bytes;
+        reply.elapsed_ms = static_cast<std::uint64_t>(result.elapsed.count());
+        reply.error_message = std::move(result.error_message);
+        reply.up_to_date = result.up_to_date;
+        reply.bytes_reused = result.bytes_reused;
+        owner->send(protocol::FrameType::Result, protocol::encode(reply));
+    });
+    session->jobs[job_id] = std::move(state);
+}
+
+void DaemonServer::publish_progress() {
+    std::vector<std::shared_ptr<Session>> sessions;
+    {
+        std::scoped_lock lock(sessions_mutex_);
+        sessions = sessions_;
+    }
+
+    for (const auto& session : sessions) {
+        std::vector<std::string> updates;
+        {
+            std::scoped_lock lock(session->jobs_mutex);
+            for (const auto& [job_id, state] : session->jobs) {
+                const DownloadStatus status = state->status.load();
+                if (!is_active(status)) {
+                    continue;
+                }
+                updates.push_back(protocol::encode(protocol::ProgressMessage{
+                    job_id, status, state->downloaded_bytes.load(), state->total_bytes.load()}));
+            }
+        }
+        for (const auto& update : updates) {
+            session->send(protocol::FrameType::Progress, update);
+        }
+    }
+}
+
+void DaemonServer::reap_sessions() {
+    std::vector<std::shared_ptr<Session>> finished;
+    {
+        std::scoped_lock lock(sessions_mutex_);
+        auto it = std::stable_partition(sessions_.begin(), sessions_.end(),
+                                        [](const auto& session) { return !session->done.load(); });
+        finished.assign(std::make_move_iterator(it), std::make_move_iterator(sessions_.end()));
+        sessions_.erase(it, sessions_.end());
+    }
+    for (const auto& session : finished) {
+        session->reader.join();
+    }
+}
+
+DaemonClient::DaemonClient(const std::string& socket_path) {
+    const sockaddr_un address = make_address(socket_path);
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) {
+        throw make_socket_error("socket failed");
+    }
+    if (::connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        const auto error = make_socket_error("connect failed for " + socket_path);
+        ::close(fd_);
+        throw error;
+    }
+}
+
+DaemonClient::~DaemonClient() {
+    ::close(fd_);
+}
+
+void DaemonClient::submit(std::uint64_t job_id, const DownloadRequest& request) {
+    std::scoped_lock lock(write_mutex_);
+    protocol::write_frame(fd_, protocol::FrameType::Submit, protocol::encode(protocol::SubmitMessage{job_id, request}));
+}
+
+void DaemonClient::cancel(std::uint64_t job_id) {
+    std::scoped_lock lock(write_mutex_);
+    protocol::write_frame(fd_, protocol::FrameType::Cancel, protocol::encode_cancel(job_id));
+}
+
+std::optional<protocol::Frame> DaemonClient::next_frame() {
+    return protocol::read_frame(fd_);
+}
+
+}  // namespace downloader
@@ -0,0 +1,280 @@
+#include "downloader/daemon_protocol.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace downloader::protocol {
+
+namespace {
+
+class PayloadWriter {
+public:
+    PayloadWriter& u8(std::uint8_t value) {
+        out_.push_back(static_cast<char>(value));
+        return *this;
+    }
+
+    PayloadWriter& u32(std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            out_.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+        return *this;
+    }
+
+    PayloadWriter& u64(std::uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            out_.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+        return *this;
+    }
+
+    PayloadWriter& str(std::string_view value) {
+        u32(static_cast<std::uint32_t>(value.size()));
+        out_.append(value);
+        return *this;
+    }
+
+    std::string take() { return std::move(out_); }
+
+private:
+    std::string out_;
+};
+
+class PayloadReader {
+public:
+    explicit PayloadReader(std::string_view data) : data_(data) {}
+
+    std::uint8_t u8() { return static_cast<std::uint8_t>(take(1)[0]); }
+
+    std::uint32_t u32() {
+        const auto bytes = take(4);
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            value |= static_cast<std::uint32_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    std::uint64_t u64() {
+        const auto bytes = take(8);
+        std::uint64_t value = 0;
+        for (int i = 0; i < 8; ++i) {
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    std::string str() { return std::string(take(u32())); }
+
+private:
+    std::string_view take(std::size_t size) {
+        if (data_.size() < size) {
+            throw std::runtime_error("truncated frame payload");
+        }
+        const auto bytes = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return bytes;
+    }
+
+    std::string_view data_;
+};
+
+DownloadStatus to_status(std::uint8_t value) {
+    if (value > static_cast<std::uint8_t>(DownloadStatus::Cancelled)) {
+        throw std::runtime_error("invalid download status in frame");
+    }
+    return static_cast<DownloadStatus>(value);
+}
+
+bool read_exact(int fd, char* data, std::size_t size) {
+    std::size_t read_total = 0;
+    while (read_total < size) {
+        const ssize_t got = ::read(fd, data + read_total, size - read_total);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("socket read failed: ") + std::strerror(errno));
+        }
+        if (got == 0) {
+            if (read_total == 0) {
+                return false;
+            }
+            throw std::runtime_error("connection closed mid-frame");
+        }
+        read_total += static_cast<std::size_t>(got);
+    }
+    return true;
+}
+
+void write_exact(int fd, const char* data, std::size_t size) {
+    std::size_t written_total = 0;
+    while (written_total < size) {
+        const ssize_t written = ::send(fd, data + written_total, size - written_total, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("socket write failed: ") + std::strerror(errno));
+        }
+        written_total += static_cast<std::size_t>(written);
+    }
+}
+
+}  // namespace
+
+std::string encode(const SubmitMessage& message) {
+    const auto& request = message.request;
+    if (!(request.hedge.slow_fraction > 0.0 && request.hedge.slow_fraction <= 1.0)) {
+        throw std::invalid_argument("hedge slow fraction must be in (0, 1]");
+    }
+    if (request.hedge.stall_timeout.count() <= 0 ||
+        request.hedge.stall_timeout.count() > std::numeric_limits<std::uint32_t>::max()) {
+        throw std::invalid_argument("hedge stall timeout out of range");
+    }
+    return PayloadWriter{}
+        .u64(message.job_id)
+        .str(request.url)
+        .str(request.output_path)
+        .u32(static_cast<std::uint32_t>(std::clamp<std::size_t>(request.preferred_chunks, 1, kMaxPreferredChunks)))
+        .u8(static_cast<std::uint8_t>(request.durability))
+        .u8(request.hedge.enabled ? 1 : 0)
+        .u32(static_cast<std::uint32_t>(request.hedge.slow_fraction * 1000.0))
+        .u32(static_cast<std::uint32_t>(request.hedge.stall_timeout.count()))
+        .u8(static_cast<std::uint8_t>(request.sync))
+        .u8(request.delta ? 1 : 0)
+        .take();
+}
+
+std::string encode_cancel(std::uint64_t job_id) {
+    return PayloadWriter{}.u64(job_id).take();
+}
+
+std::string encode(const ProgressMessage& message) {
+    return PayloadWriter{}
+        .u64(message.job_id)
+        .u8(static_cast<std::uint8_t>(message.status))
+        .u64(message.downloaded_bytes)
+        .u64(message.total_bytes)
+        .take();
+}
+
+std::string encode(const ResultMessage& message) {
+    return PayloadWriter{}
+        .u64(message.job_id)
+        .u8(static_cast<std::uint8_t>(message.status))
+        .u32(static_cast<std::uint32_t>(message.http_status))
+        .u64(message.bytes)
+        .u64(message.elapsed_ms)
+        .str(message.error_message)
+        .u8(message.up_to_date ? 1 : 0)
+        .u64(message.bytes_reused)
+        .take();
+}
+
+SubmitMessage decode_submit(std::string_view payload) {
+    PayloadReader reader(payload);
+    SubmitMessage message;
+    message.job_id = reader.u64();
+    message.request.url = reader.str();
+    message.request.output_path = reader.str();
+    message.request.preferred_chunks = std::clamp<std::size_t>(reader.u32(), 1, kMaxPreferredChunks);
+    const std::uint8_t durability = reader.u8();
+    if (durability > static_cast<std::uint8_t>(Durability::Streaming)) {
+        throw std::runtime_error("invalid durability in frame");
+    }
+    message.request.durability = static_cast<Durability>(durability);
+    message.request.hedge.enabled = reader.u8() != 0;
+    const std::uint32_t slow_fraction_milli = reader.u32();
+    if (slow_fraction_milli == 0 || slow_fraction_milli > 1000) {
+        throw std::runtime_error("invalid hedge slow fraction in frame");
+    }
+    message.request.hedge.slow_fraction = static_cast<double>(slow_fraction_milli) / 1000.0;
+    const std::uint32_t stall_timeout_ms = reader.u32();
+    if (stall_timeout_ms == 0) {
+        throw std::runtime_error("invalid hedge stall timeout in frame");
+    }
+    message.request.hedge.stall_timeout = std::chrono::milliseconds(stall_timeout_ms);
+    const std::uint8_t sync = reader.u8();
+    if (sync > static_cast<std::uint8_t>(SyncMode::Checksum)) {
+        throw std::runtime_error("invalid sync mode in frame");
+    }
+    message.request.sync = static_cast<SyncMode>(sync);
+    message.request.delta = reader.u8() != 0;
+    return message;
+}
+
+std::uint64_t decode_cancel(std::string_view payload) {
+    return PayloadReader(payload).u64();
+}
+
+ProgressMessage decode_progress(std::string_view payload) {
+    PayloadReader reader(payload);
+    ProgressMessage message;
+    message.job_id = reader.u64();
+    message.status = to_status(reader.u8());
+    message.downloaded_bytes = reader.u64();
+    message.total_bytes = reader.u64();
+    return message;
+}
+
+ResultMessage decode_result(std::string_view payload) {
+    PayloadReader reader(payload);
+    ResultMessage message;
+    message.job_id = reader.u64();
+    message.status = to_status(reader.u8());
+    message.http_status = static_cast<long>(reader.u32());
+    message.bytes = reader.u64();
+    message.elapsed_ms = reader.u64();
+    message.error_message = reader.str();
+    message.up_to_date = reader.u8() != 0;
+    message.bytes_reused = reader.u64();
+    return message;
+}
+
+std::optional<Frame> read_frame(int fd) {
+    std::array<char, 5> header{};
+    if (!read_exact(fd, header.data(), header.size())) {
+        return std::nullopt;
+    }
+    std::uint32_t size = 0;
+    for (int i = 0; i < 4; ++i) {
+        size |= static_cast<std::uint32_t>(static_cast<unsigned char>(header[i])) << (8 * i);
+    }
+    if (size > kMaxFrameSize) {
+        throw std::runtime_error("frame too large");
+    }
+
+    Frame frame;
+    frame.type = static_cast<FrameType>(header[4]);
+    frame.payload.resize(size);
+    if (size > 0 && !read_exact(fd, frame.payload.data(), size)) {
+        throw std::runtime_error("connection closed mid-frame");
+    }
+    return frame;
+}
+
+std::string encode_frame(FrameType type, std::string_view payload) {
+    std::string frame;
+    frame.reserve(5 + payload.size());
+    const auto size = static_cast<std::uint32_t>(payload.size());
+    for (int i = 0; i < 4; ++i) {
+        frame.push_back(static_cast<char>((size >> (8 * i)) & 0xff));
+    }
+    frame.push_back(static_cast<char>(type));
+    frame.append(payload);
+    return frame;
+}
+
+void write_frame(int fd, FrameType type, std::string_view payload) {
+    const std::string frame = encode_frame(type, payload);
+    write_exact(fd, frame.data(), frame.size());
+}
+
+}  // namespace downloader::protocol
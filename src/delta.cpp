@@ -0,0 +1,282 @@
+#include "downloader/delta.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace downloader {
+
+namespace {
+
+constexpr std::string_view kMagic = "blockmap 1";
+constexpr std::size_t kRecordSize = 4 + BlockMap::kStrongSize;
+// Bits in the filter consulted before the sorted weak-checksum index.
+constexpr int kFilterBits = 20;
+
+std::uint32_t filter_slot(std::uint32_t weak) {
+    return (weak * 0x9e3779b1U) >> (32 - kFilterBits);
+}
+
+std::array<std::uint8_t, BlockMap::kStrongSize> strong_checksum(const std::uint8_t* data, std::size_t size) {
+    Sha256 hash;
+    hash.update(data, size);
+    const Sha256::Digest digest = hash.finish();
+    std::array<std::uint8_t, BlockMap::kStrongSize> strong{};
+    std::copy_n(digest.begin(), strong.size(), strong.begin());
+    return strong;
+}
+
+std::int64_t parse_number(std::string_view text) {
+    std::int64_t value = 0;
+    const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != std::errc{} || result.ptr != text.data() + text.size()) {
+        throw std::runtime_error("bad number in block map: " + std::string(text));
+    }
+    return value;
+}
+
+bool parse_hex(std::string_view text, Sha256::Digest& digest) {
+    if (text.size() != digest.size() * 2) {
+        return false;
+    }
+    for (std::size_t i = 0; i < digest.size(); ++i) {
+        unsigned value = 0;
+        const auto result = std::from_chars(text.data() + i * 2, text.data() + i * 2 + 2, value, 16);
+        if (result.ec != std::errc{} || result.ptr != text.data() + i * 2 + 2) {
+            return false;
+        }
+        digest[i] = static_cast<std::uint8_t>(value);
+    }
+    return true;
+}
+
+}  // namespace
+
+std::uint32_t weak_checksum(const std::uint8_t* data, std::size_t size) {
+    // Two plain reductions with no modulo inside the loop, so the compiler
+    // can vectorize them; wrapping 32-bit sums are exact modulo 2^16.
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        a += data[i];
+        b += static_cast<std::uint32_t>(size - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+BlockMap parse_block_map(std::string_view text) {
+    const std::size_t header_end = text.find("\n\n");
+    if (!text.starts_with(kMagic) || header_end == std::string_view::npos) {
+        throw std::runtime_error("not a block map");
+    }
+
+    BlockMap map;
+    bool has_sha256 = false;
+    std::string_view header = text.substr(0, header_end + 1);
+    while (!header.empty()) {
+        const std::size_t newline = header.find('\n');
+        const std::string_view line = header.substr(0, newline);
+        header.remove_prefix(newline + 1);
+        const std::size_t space = line.find(' ');
+        const std::string_view key = line.substr(0, space);
+        const std::string_view value = space == std::string_view::npos ? std::string_view{} : line.substr(space + 1);
+        if (key == "block-size") {
+            map.block_size = parse_number(value);
+        } else if (key == "length") {
+            map.length = parse_number(value);
+        } else if (key == "sha256") {
+            has_sha256 = parse_hex(value, map.sha256);
+        }
+    }
+    if (map.block_size <= 0 || map.length < 0 || !has_sha256) {
+        throw std::runtime_error("block map header is incomplete");
+    }
+
+    const std::string_view records = text.substr(header_end + 2);
+    const auto blocks = static_cast<std::size_t>(map.length / map.block_size);
+    if (records.size() != blocks * kRecordSize) {
+        throw std::runtime_error("block map has the wrong number of blocks");
+    }
+    map.weak.resize(blocks);
+    map.strong.resize(blocks);
+    for (std::size_t i = 0; i < blocks; ++i) {
+        const auto* record = reinterpret_cast<const std::uint8_t*>(records.data() + i * kRecordSize);
+        map.weak[i] = static_cast<std::uint32_t>(record[0]) << 24 | static_cast<std::uint32_t>(record[1]) << 16 |
+                      static_cast<std::uint32_t>(record[2]) << 8 | static_cast<std::uint32_t>(record[3]);
+        std::copy_n(record + 4, BlockMap::kStrongSize, map.strong[i].begin());
+    }
+    return map;
+}
+
+std::string make_block_map(const std::string& path, std::int64_t block_size) {
+    if (block_size <= 0) {
+        throw std::runtime_error("block size must be positive");
+    }
+    const SeedFile file(path);
+    Sha256 whole;
+    if (file.size() > 0) {
+        whole.update(file.data(), static_cast<std::size_t>(file.size()));
+    }
+
+    std::string out(kMagic);
+    out += "\nblock-size " + std::to_string(block_size) + "\nlength " + std::to_string(file.size()) +
+           "\nsha256 " + Sha256::to_hex(whole.finish()) + "\n\n";
+    const std::int64_t blocks = file.size() / block_size;
+    out.reserve(out.size() + static_cast<std::size_t>(blocks) * kRecordSize);
+    for (std::int64_t i = 0; i < blocks; ++i) {
+        const std::uint8_t* block = file.data() + i * block_size;
+        const std::uint32_t weak = weak_checksum(block, static_cast<std::size_t>(block_size));
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<char>((weak >> shift) & 0xff));
+        }
+        const auto strong = strong_checksum(block, static_cast<std::size_t>(block_size));
+        out.append(reinterpret_cast<const char*>(strong.data()), strong.size());
+    }
+    return out;
+}
+
+SeedFile::SeedFile(const std::string& path) {
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        throw std::runtime_error("open failed for " + path + ": " + std::strerror(errno));
+    }
+    struct stat info {};
+    if (::fstat(fd_, &info) != 0) {
+        const int error = errno;
+        ::close(fd_);
+        throw std::runtime_error("stat failed for " + path + ": " + std::strerror(error));
+    }
+    size_ = static_cast<std::int64_t>(info.st_size);
+    if (size_ == 0) {
+        return;
+    }
+    void* mapping = ::mmap(nullptr, static_cast<std::size_t>(size_), PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        const int error = errno;
+        ::close(fd_);
+        throw std::runtime_error("mmap failed for " + path + ": " + std::strerror(error));
+    }
+#if defined(__linux__)
+    ::madvise(mapping, static_cast<std::size_t>(size_), MADV_SEQUENTIAL);
+#endif
+    data_ = static_cast<const std::uint8_t*>(mapping);
+}
+
+SeedFile::~SeedFile() {
+    if (data_ != nullptr) {
+        ::munmap(const_cast<std::uint8_t*>(data_), static_cast<std::size_t>(size_));
+    }
+    ::close(fd_);
+}
+
+DeltaPlan plan_delta(const BlockMap& map, const SeedFile& seed) {
+    const std::int64_t block = map.block_size;
+    const std::size_t blocks = map.weak.size();
+    std::vector<std::int64_t> source(blocks, -1);
+
+    if (blocks > 0 && seed.size() >= block) {
+        // Sorted (weak, block) index behind a bitmap filter: most window
+        // positions miss the filter and cost one bit test.
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> index(blocks);
+        std::vector<std::uint64_t> filter((std::size_t{1} << kFilterBits) / 64);
+        for (std::size_t i = 0; i < blocks; ++i) {
+            index[i] = {map.weak[i], static_cast<std::uint32_t>(i)};
+            const std::uint32_t slot = filter_slot(map.weak[i]);
+            filter[slot / 64] |= std::uint64_t{1} << (slot % 64);
+        }
+        std::sort(index.begin(), index.end());
+
+        const std::uint8_t* const data = seed.data();
+        const std::int64_t last_window = seed.size() - block;
+        const auto width = static_cast<std::uint32_t>(block);
+        std::size_t remaining = blocks;
+        std::int64_t pos = 0;
+        std::uint32_t a = 0;
+        std::uint32_t b = 0;
+        const auto reset_window = [&]() {
+            const std::uint32_t weak = weak_checksum(data + pos, static_cast<std::size_t>(block));
+            a = weak & 0xffff;
+            b = weak >> 16;
+        };
+        reset_window();
+
+        while (remaining > 0) {
+            const std::uint32_t weak = (a & 0xffff) | (b << 16);
+            const std::uint32_t slot = filter_slot(weak);
+            bool matched = false;
+            if ((filter[slot / 64] >> (slot % 64)) & 1) {
+                auto it = std::lower_bound(index.begin(), index.end(), std::make_pair(weak, std::uint32_t{0}));
+                if (it != index.end() && it->first == weak) {
+                    const auto strong = strong_checksum(data + pos, static_cast<std::size_t>(block));
+                    for (; it != index.end() && it->first == weak; ++it) {
+                        if (map.strong[it->second] != strong) {
+                            continue;
+                        }
+                        // Identical blocks (runs of zeros, say) all take this copy.
+                        matched = true;
+                        if (source[it->second] < 0) {
+                            source[it->second] = pos;
+                            --remaining;
+                        }
+                    }
+                }
+            }
+
+            if (matched) {
+                pos += block;
+                if (pos > last_window) {
+                    break;
+                }
+                reset_window();
+                continue;
+            }
+            if (pos == last_window) {
+                break;
+            }
+            const std::uint32_t out = data[pos];
+            const std::uint32_t in = data[pos + block];
+            a = a - out + in;
+            b = b - width * out + a;
+            ++pos;
+        }
+    }
+
+    DeltaPlan plan;
+    const auto add_fetch = [&plan](std::int64_t begin, std::int64_t end) {
+        if (!plan.fetches.empty() && plan.fetches.back().end + 1 == begin) {
+            plan.fetches.back().end = end;
+        } else {
+            plan.fetches.push_back(ByteRange{begin, end});
+        }
+        plan.fetch_bytes += end + 1 - begin;
+    };
+    for (std::size_t i = 0; i < blocks; ++i) {
+        const std::int64_t target = static_cast<std::int64_t>(i) * block;
+        if (source[i] < 0) {
+            add_fetch(target, target + block - 1);
+            continue;
+        }
+        auto& copies = plan.copies;
+        if (!copies.empty() && copies.back().target + copies.back().length == target &&
+            copies.back().source + copies.back().length == source[i]) {
+            copies.back().length += block;
+        } else {
+            copies.push_back(DeltaPlan::Copy{source[i], target, block});
+        }
+        plan.copy_bytes += block;
+    }
+    const std::int64_t tail = static_cast<std::int64_t>(blocks) * block;
+    if (tail < map.length) {
+        add_fetch(tail, map.length - 1);
+    }
+    return plan;
+}
+
+}  // namespace downloader
@@ -1,13 +1,24 @@
 #include "downloader/download_manager.h"
 
-#include <algorithm>
+#include "downloader/cpu_profiler.h"
+#include "downloader/curl_transport.h"
+#include "downloader/sha256.h"
+#include "downloader/sync.h"
+
 #include <future>
-#include <thread>
 #include <utility>
 
 namespace downloader {
 
-DownloadManager::DownloadManager(std::size_t worker_count) : pool_(worker_count) {}
+DownloadManager::DownloadManager(std::size_t worker_count,
+                                 PipelineConfig pipeline,
+                                 std::shared_ptr<Transport> transport)
+    : transport_(transport ? std::move(transport) : std::make_shared<CurlTransport>()),
+      pipeline_(pipeline),
+      pool_(worker_count, &transport_->clock(), "download worker"),
+      http_client_(pipeline_, arena_, *transport_) {
+    progress_.watch_pipeline(&pipeline_);
+}
 
 DownloadStatePtr DownloadManager::add(DownloadRequest request) {
     auto state = std::make_shared<DownloadState>(std::move(request));
@@ -17,41 +28,25 @@ DownloadStatePtr DownloadManager::add(DownloadRequest request) {
 }
 
 std::vector<DownloadResult> DownloadManager::run_all() {
-    progress_.start();
-
-    std::vector<std::future<ProbeResult>> probe_futures;
-    probe_futures.reserve(states_.size());
-    for (const auto& state : states_) {
-        state->status = DownloadStatus::Probing;
-        probe_futures.push_back(std::async(std::launch::async, [this, url = state->request.url]() {
-            return http_client_.probe(url);
-        }));
+    if (progress_enabled_) {
+        progress_.start();
     }
 
+    // Every job is queued at the same instant; a simulated clock must not
+    // move on while the first ones are already running.
+    Clock& clock = transport_->clock();
     std::vector<std::future<DownloadResult>> work_futures;
     work_futures.reserve(states_.size());
-
-    for (std::size_t i = 0; i < states_.size(); ++i) {
-        ProbeResult probe = probe_futures[i].get();
-        const auto state = states_[i];
-        if (!probe.ok) {
-            work_futures.push_back(pool_.submit([state, probe]() {
-                state->status = DownloadStatus::Failed;
-                state->error_message = probe.error_message;
-                return DownloadResult{state->request.url, state->request.output_path,
-                                      DownloadStatus::Failed, 0, probe.error_message};
-            }));
-            continue;
-        }
-
-        if (probe.content_length > 0) {
-            state->total_bytes = static_cast<std::uint64_t>(probe.content_length);
+    clock.begin_activity();
+    try {
+        for (const auto& state : states_) {
+            work_futures.push_back(pool_.submit([this, state]() { return execute(state); }));
         }
-
-        work_futures.push_back(pool_.submit([this, state, probe]() {
-            return run_one(state, probe);
-        }));
+    } catch (...) {
+        clock.end_activity();
+        throw;
     }
+    clock.end_activity();
 
     std::vector<DownloadResult> results;
     results.reserve(work_futures.size());
@@ -63,14 +58,100 @@ std::vector<DownloadResult> DownloadManager::run_all() {
     return results;
 }
 
+DownloadStatePtr DownloadManager::submit(DownloadRequest request, CompletionHandler on_complete) {
+    auto state = std::make_shared<DownloadState>(std::move(request));
+    pool_.submit([this, state, on_complete = std::move(on_complete)]() {
+        DownloadResult result = execute(state);
+        if (on_complete) {
+            on_complete(std::move(result));
+        }
+    });
+    return state;
+}
+
+DownloadResult DownloadManager::execute(const DownloadStatePtr& state) {
+    if (state->stop_source.stop_requested()) {
+        state->status = DownloadStatus::Cancelled;
+        return DownloadResult{state->request.url, state->request.output_path,
+                              DownloadStatus::Cancelled, 0, "cancelled"};
+    }
+
+    state->status = DownloadStatus::Probing;
+    const ProbeResult probe = [&]() {
+        CpuProfiler::Scope cpu(CpuPhase::Probe, &state->cpu);
+        return http_client_.probe(state->request.url);
+    }();
+    if (!probe.ok) {
+        state->status = DownloadStatus::Failed;
+        state->error_message = probe.error_message;
+        return DownloadResult{state->request.url, state->request.output_path,
+                              DownloadStatus::Failed, 0, probe.error_message};
+    }
+
+    if (probe.content_length > 0) {
+        state->total_bytes = static_cast<std::uint64_t>(probe.content_length);
+    }
+
+    const bool sync = state->request.sync != SyncMode::Off && state->request.target == DownloadTarget::File;
+    if (sync && local_copy_current(state, probe)) {
+        state->status = DownloadStatus::Completed;
+        DownloadResult result{state->request.url, state->request.output_path,
+                              DownloadStatus::Completed, probe.http_status, {}};
+        result.up_to_date = true;
+        return result;
+    }
+
+    DownloadResult result = run_one(state, probe);
+    if (sync && result.status == DownloadStatus::Completed) {
+        stamp_modification_time(state->request.output_path, probe.last_modified);
+    }
+    return result;
+}
+
+bool DownloadManager::local_copy_current(const DownloadStatePtr& state, const ProbeResult& probe) {
+    const std::string& path = state->request.output_path;
+    switch (check_local_file(path, probe, state->request.sync)) {
+        case SyncCheck::Fetch:
+            return false;
+        case SyncCheck::UpToDate:
+            return true;
+        case SyncCheck::CompareDigest:
+            break;
+    }
+
+    // Hashed on the download worker: the job cannot go on without the digest,
+    // so handing it to another pool would only park this thread meanwhile. At
+    // most as many files are hashed at once as there are download workers.
+    std::string digest;
+    try {
+        CpuProfiler::Scope cpu(CpuPhase::Hashing, &state->cpu);
+        digest = sha256_file(path);
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (digest != probe.sha256) {
+        return false;
+    }
+    // Record the match so the next run takes the metadata fast path.
+    stamp_modification_time(path, probe.last_modified);
+    return true;
+}
+
 DownloadResult DownloadManager::run_one(const DownloadStatePtr& state, ProbeResult probe) {
     const bool can_split = probe.accept_ranges && probe.content_length > (1 << 20) &&
                            state->request.preferred_chunks > 1;
 
+    const std::stop_token stop_token = state->stop_source.get_token();
+    if (state->request.delta && state->request.target == DownloadTarget::File && probe.accept_ranges &&
+        probe.content_length > 0) {
+        if (auto result = http_client_.download_delta(state, stop_token)) {
+            return std::move(*result);
+        }
+    }
     if (can_split) {
-        return http_client_.download_range_file(state, state->request.preferred_chunks, {});
+        return http_client_.download_range_file(state, state->request.preferred_chunks, stop_token);
     }
-    return http_client_.download_whole_file(state, {});
+    return http_client_.download_whole_file(state, stop_token);
 }
 
 }  // namespace downloader
@@ -1,5 +1,6 @@
 #include "downloader/file_writer.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <fcntl.h>
@@ -7,16 +8,38 @@
 #include <string>
 #include <system_error>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 namespace downloader {
 
 namespace {
+// Streaming durability starts writeback for every window once it has been
+// fully written and waits for the oldest one once too many are in flight.
+constexpr std::int64_t kWritebackWindow = 8 << 20;
+constexpr std::size_t kMaxWindowsInFlight = 4;
+
 std::runtime_error make_io_error(const std::string& prefix) {
     return std::runtime_error(prefix + ": " + std::strerror(errno));
 }
+
+void sync_parent_directory(const std::string& path) {
+    const auto slash = path.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    const int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        throw make_io_error("open failed for " + dir);
+    }
+    const int rc = ::fsync(dir_fd);
+    ::close(dir_fd);
+    if (rc != 0) {
+        throw make_io_error("fsync failed for " + dir);
+    }
+}
 }  // namespace
 
-FileWriter::FileWriter(const std::string& path, Mode mode) {
+FileWriter::FileWriter(const std::string& path, Mode mode, Durability durability)
+    : durability_(durability), path_(path) {
     int flags = O_CREAT;
     if (mode == Mode::Truncate) {
         flags |= O_WRONLY | O_TRUNC;
@@ -24,33 +47,131 @@ FileWriter::FileWriter(const std::string& path, Mode mode) {
         flags |= O_RDWR | O_TRUNC;
     }
 
-    fd_ = ::open(path.c_str(), flags, 0666);
+    if (durability_ != Durability::None || mode == Mode::ReadWriteReplace) {
+        temp_path_ = path + ".part";
+    }
+    if (durability_ == Durability::Streaming) {
+        writeback_ = std::make_unique<Writeback>();
+    }
+
+    const std::string& open_path = temp_path_.empty() ? path_ : temp_path_;
+    fd_ = ::open(open_path.c_str(), flags, 0666);
     if (fd_ < 0) {
-        throw make_io_error("open failed for " + path);
+        throw make_io_error("open failed for " + open_path);
     }
 }
 
 FileWriter::~FileWriter() {
-    if (fd_ >= 0) {
-        ::close(fd_);
-    }
+    close_and_discard();
 }
 
-FileWriter::FileWriter(FileWriter&& other) noexcept : fd_(other.fd_) {
+FileWriter::FileWriter(FileWriter&& other) noexcept
+    : fd_(other.fd_),
+      durability_(other.durability_),
+      path_(std::move(other.path_)),
+      temp_path_(std::move(other.temp_path_)),
+      committed_(other.committed_),
+      writeback_(std::move(other.writeback_)) {
     other.fd_ = -1;
 }
 
 FileWriter& FileWriter::operator=(FileWriter&& other) noexcept {
     if (this != &other) {
-        if (fd_ >= 0) {
-            ::close(fd_);
-        }
+        close_and_discard();
         fd_ = other.fd_;
+        durability_ = other.durability_;
+        path_ = std::move(other.path_);
+        temp_path_ = std::move(other.temp_path_);
+        committed_ = other.committed_;
+        writeback_ = std::move(other.writeback_);
         other.fd_ = -1;
     }
     return *this;
 }
 
+void FileWriter::close_and_discard() noexcept {
+    if (fd_ < 0) {
+        return;
+    }
+    ::close(fd_);
+    fd_ = -1;
+    if (!temp_path_.empty() && !committed_) {
+        ::unlink(temp_path_.c_str());
+    }
+}
+
+void FileWriter::commit() {
+    if (committed_ || temp_path_.empty()) {
+        committed_ = true;
+        return;
+    }
+    const bool durable = durability_ != Durability::None;
+    if (durable && ::fdatasync(fd_) != 0) {
+        throw make_io_error("fdatasync failed for " + temp_path_);
+    }
+    if (::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+        throw make_io_error("rename failed for " + temp_path_);
+    }
+    committed_ = true;
+    if (durable) {
+        sync_parent_directory(path_);
+    }
+}
+
+void FileWriter::note_written(std::int64_t offset, std::size_t size) const {
+    if (!writeback_) {
+        return;
+    }
+#if defined(__linux__)
+    // Only the bookkeeping happens under the lock. Writeback is started and
+    // waited for outside it, so a writer thread blocked on the disk does not
+    // hold up the others. Overlapping writes (hedged ranges) can make a
+    // window look complete early; that only starts its writeback sooner, the
+    // final fdatasync in commit() still covers every byte.
+    std::vector<std::int64_t> completed;
+    std::vector<std::int64_t> retired;
+    {
+        std::scoped_lock lock(writeback_->mutex);
+        const std::int64_t end = offset + static_cast<std::int64_t>(size);
+        for (std::int64_t pos = offset; pos < end;) {
+            const std::int64_t window = pos / kWritebackWindow;
+            const std::int64_t window_end = std::min(end, (window + 1) * kWritebackWindow);
+            auto& filled = writeback_->window_bytes[window];
+            filled += window_end - pos;
+            pos = window_end;
+            if (filled < kWritebackWindow) {
+                continue;
+            }
+            writeback_->window_bytes.erase(window);
+            completed.push_back(window);
+            writeback_->in_flight.push_back(window);
+        }
+        while (writeback_->in_flight.size() > kMaxWindowsInFlight) {
+            retired.push_back(writeback_->in_flight.front());
+            writeback_->in_flight.pop_front();
+        }
+    }
+
+    for (const std::int64_t window : completed) {
+        if (::sync_file_range(fd_, window * kWritebackWindow, kWritebackWindow, SYNC_FILE_RANGE_WRITE) != 0) {
+            throw make_io_error("sync_file_range failed");
+        }
+    }
+    // A retired window may not have been started yet by the thread that
+    // completed it, so the wait also asks for the write.
+    for (const std::int64_t window : retired) {
+        if (::sync_file_range(fd_, window * kWritebackWindow, kWritebackWindow,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+            throw make_io_error("sync_file_range failed");
+        }
+        ::posix_fadvise(fd_, window * kWritebackWindow, kWritebackWindow, POSIX_FADV_DONTNEED);
+    }
+#else
+    (void)offset;
+    (void)size;
+#endif
+}
+
 void FileWriter::resize(std::int64_t size) const {
     if (::ftruncate(fd_, size) != 0) {
         throw make_io_error("ftruncate failed");
@@ -71,6 +192,9 @@ std::size_t FileWriter::write_all(const void* data, std::size_t size) const {
         }
         written_total += static_cast<std::size_t>(written);
     }
+    if (writeback_) {
+        note_written(::lseek(fd_, 0, SEEK_CUR) - static_cast<std::int64_t>(written_total), written_total);
+    }
     return written_total;
 }
 
@@ -89,6 +213,7 @@ std::size_t FileWriter::pwrite_all(const void* data, std::size_t size, std::int6
         }
         written_total += static_cast<std::size_t>(written);
     }
+    note_written(offset, written_total);
     return written_total;
 }
 
@@ -1,156 +1,177 @@
 #include "downloader/http_client.h"
 
-#include "downloader/curl_raii.h"
+#include "downloader/cpu_profiler.h"
+#include "downloader/delta.h"
 #include "downloader/file_writer.h"
+#include "downloader/tracer.h"
 
 #include <algorithm>
 #include <array>
 #include <cerrno>
-#include <cctype>
 #include <chrono>
 #include <cstring>
 #include <future>
+#include <memory>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 namespace downloader {
 
 namespace {
 
-struct HeaderParseContext {
-    bool accept_ranges{false};
-};
-
-size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
-    const std::size_t total = size * nitems;
-    auto* ctx = static_cast<HeaderParseContext*>(userdata);
-    std::string header(buffer, total);
-    std::string lower = header;
-    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char ch) {
-        return static_cast<char>(std::tolower(ch));
-    });
-    if (lower.find("accept-ranges:") == 0 && lower.find("bytes") != std::string::npos) {
-        ctx->accept_ranges = true;
-    }
-    return total;
-}
-
-std::size_t write_all_fd(int fd, const char* data, std::size_t total) {
-    std::size_t written_total = 0;
-    while (written_total < total) {
-        const ssize_t written = ::write(fd, data + written_total, total - written_total);
-        if (written < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            return 0;
+constexpr auto kHedgePollInterval = std::chrono::milliseconds(50);
+constexpr auto kHedgeWarmup = std::chrono::seconds(1);
+constexpr std::int64_t kMinHedgeBytes = 256 * 1024;
+constexpr int kPieceRepairRounds = 3;
+// Ranges per multi-range request; servers cap this (Apache's MaxRanges
+// defaults to 200) and the Range header has to stay a sensible size.
+constexpr std::size_t kMaxRangesPerRequest = 64;
+constexpr std::size_t kMaxBlockMapSize = std::size_t{256} << 20;
+
+// Collects a small body, such as a block map, in memory.
+class BufferSink final : public TransferSink {
+public:
+    BufferSink(std::string& out, std::stop_token stop_token) : out_(out), stop_token_(std::move(stop_token)) {}
+
+    Write write(const char* data, std::size_t size) override {
+        if (out_.size() + size > kMaxBlockMapSize) {
+            return Write::Rejected;
         }
-        written_total += static_cast<std::size_t>(written);
+        out_.append(data, size);
+        return Write::Accepted;
     }
-    return written_total;
-}
+    bool can_resume() const override { return true; }
+    bool cancelled() const override { return stop_token_.stop_requested(); }
 
-std::size_t pwrite_all_fd(int fd, const char* data, std::size_t total, std::int64_t offset) {
-    std::size_t written_total = 0;
-    while (written_total < total) {
-        const ssize_t written = ::pwrite(fd, data + written_total, total - written_total,
-                                         offset + static_cast<std::int64_t>(written_total));
-        if (written < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            return 0;
+private:
+    std::string& out_;
+    std::stop_token stop_token_;
+};
+
+// Writes the parts of a delta fetch straight into the new file. Parts do not
+// go through the write pipeline: a multipart response cannot be paused, and
+// a delta fetches little by design.
+class DeltaSink final : public RangeSetSink {
+public:
+    DeltaSink(const FileWriter& file, const DownloadStatePtr& state, std::stop_token stop_token)
+        : file_(file), state_(state), stop_token_(std::move(stop_token)) {}
+
+    bool write_at(std::int64_t offset, const char* data, std::size_t size) override {
+        try {
+            file_.pwrite_all(data, size, offset);
+        } catch (const std::exception&) {
+            return false;
         }
-        written_total += static_cast<std::size_t>(written);
+        state_->downloaded_bytes.fetch_add(size);
+        fetched_ += size;
+        return true;
     }
-    return written_total;
-}
+    bool cancelled() const override { return stop_token_.stop_requested(); }
+
+    std::uint64_t fetched() const { return fetched_; }
+
+private:
+    const FileWriter& file_;
+    const DownloadStatePtr& state_;
+    std::stop_token stop_token_;
+    std::uint64_t fetched_{0};
+};
 
 std::int64_t compute_chunk_count(std::int64_t content_length, std::size_t preferred_chunks) {
     if (content_length <= 0) {
         return 1;
     }
-    std::int64_t chunks = static_cast<std::int64_t>(std::max<std::size_t>(1, preferred_chunks));
+    std::int64_t chunks = static_cast<std::int64_t>(std::clamp<std::size_t>(preferred_chunks, 1, kMaxPreferredChunks));
     chunks = std::min<std::int64_t>(chunks, content_length);
     return std::max<std::int64_t>(1, chunks);
 }
 
 }  // namespace
 
-ProbeResult HttpClient::probe(const std::string& url) const {
-    ProbeResult result;
-    try {
-        auto handle = make_curl_handle();
-        HeaderParseContext header_ctx;
-        configure_common(handle.get(), url);
-        curl_easy_setopt(handle.get(), CURLOPT_NOBODY, 1L);
-        curl_easy_setopt(handle.get(), CURLOPT_HEADERFUNCTION, header_callback);
-        curl_easy_setopt(handle.get(), CURLOPT_HEADERDATA, &header_ctx);
-
-        const CURLcode rc = curl_easy_perform(handle.get());
-        if (rc != CURLE_OK) {
-            result.error_message = curl_easy_strerror(rc);
-            return result;
-        }
-
-        long http_status = 0;
-        curl_off_t content_length = -1;
-        curl_easy_getinfo(handle.get(), CURLINFO_RESPONSE_CODE, &http_status);
-        curl_easy_getinfo(handle.get(), CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+HttpClient::HttpClient(WritePipeline& pipeline, MemoryArena& arena, Transport& transport)
+    : pipeline_(pipeline), arena_(arena), transport_(transport) {}
 
-        if (http_status >= 400) {
-            result.error_message = "HTTP status " + std::to_string(http_status);
-            return result;
-        }
-
-        result.ok = true;
-        result.content_length = static_cast<std::int64_t>(content_length);
-        result.accept_ranges = header_ctx.accept_ranges;
-        return result;
-    } catch (const std::exception& ex) {
-        result.error_message = ex.what();
-        return result;
-    }
+ProbeResult HttpClient::probe(const std::string& url) const {
+    const std::uint32_t track = Tracer::enabled() ? Tracer::new_track("probe " + url) : 0;
+    Tracer::record(track, TraceEvent::ProbeBegin);
+    ProbeResult result = transport_.probe(url, track);
+    Tracer::record(track, TraceEvent::ProbeEnd, result.ok ? 1 : 0, result.http_status);
+    return result;
 }
 
 DownloadResult HttpClient::download_whole_file(const DownloadStatePtr& state,
                                                std::stop_token stop_token) const {
     state->status = DownloadStatus::Running;
-    state->started_at = std::chrono::steady_clock::now();
+    state->started_at = transport_.clock().now();
     state->downloaded_bytes = 0;
 
     try {
-        FileWriter writer(state->request.output_path, FileWriter::Mode::Truncate);
-        auto handle = make_curl_handle();
-        std::array<char, CURL_ERROR_SIZE> error_buffer{};
+        std::optional<FileWriter> writer;
+        std::optional<WriteStream> stream;
+        std::optional<PieceLedger> ledger;
+        std::shared_ptr<MemoryBody> body;
         StreamContext context{};
         context.state = &state;
         context.stop_token = stop_token;
-        context.fd = writer.fd();
-
-        configure_common(handle.get(), state->request.url);
-        curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION, &HttpClient::stream_write_callback);
-        curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &context);
-        curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, &HttpClient::progress_callback);
-        curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &context);
-        curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
-        curl_easy_setopt(handle.get(), CURLOPT_ERRORBUFFER, error_buffer.data());
-
-        const CURLcode rc = curl_easy_perform(handle.get());
-        long http_status = 0;
-        curl_easy_getinfo(handle.get(), CURLINFO_RESPONSE_CODE, &http_status);
-        state->http_status = http_status;
-
-        if (stop_token.stop_requested() || rc == CURLE_ABORTED_BY_CALLBACK) {
+        context.pipeline = &pipeline_;
+        if (state->request.target == DownloadTarget::Memory) {
+            body = arena_.allocate(static_cast<std::size_t>(state->total_bytes.load()));
+            context.memory = body.get();
+        } else if (state->request.target == DownloadTarget::File) {
+            const auto& pieces = state->request.pieces;
+            if (pieces) {
+                ledger.emplace(*pieces, static_cast<std::int64_t>(state->total_bytes.load()));
+                context.pieces.emplace(*ledger, 0);
+            }
+            // Pieces that fail are read back and rewritten in place.
+            writer.emplace(state->request.output_path,
+                           pieces ? FileWriter::Mode::ReadWriteTruncate : FileWriter::Mode::Truncate,
+                           state->request.durability);
+            stream.emplace(pipeline_, *writer, 0, &state->cpu);
+            context.stream = &*stream;
+        }
+
+        context.trace_track = Tracer::enabled() ? Tracer::new_track(state->request.output_path) : 0;
+        Tracer::record(context.trace_track, TraceEvent::TransferBegin);
+
+        const TransferOutcome outcome = [&]() {
+            CpuProfiler::Scope cpu(CpuPhase::Transfer, &state->cpu);
+            return transport_.fetch(state->request.url, std::nullopt, context, context.trace_track,
+                                    Connection::Reuse);
+        }();
+        state->http_status = outcome.http_status;
+        Tracer::record(context.trace_track, TraceEvent::TransferEnd, outcome.ok ? 1 : 0, outcome.http_status);
+        std::string write_error;
+        const bool flushed = !stream || stream->finish(write_error);
+
+        if (stop_token.stop_requested() || outcome.aborted) {
             return cancelled_result(state);
         }
-        if (rc != CURLE_OK) {
-            const char* msg = error_buffer[0] != '\0' ? error_buffer.data() : curl_easy_strerror(rc);
-            return failed_result(state, http_status, msg);
+        if (!flushed) {
+            return failed_result(state, outcome.http_status, std::move(write_error));
+        }
+        if (!outcome.ok) {
+            return failed_result(state, outcome.http_status, outcome.error_message);
         }
-        return success_result(state, http_status);
+        std::uint32_t repaired = 0;
+        if (ledger && !settle_pieces(state, *ledger, *writer, stop_token, repaired, write_error)) {
+            if (stop_token.stop_requested()) {
+                return cancelled_result(state);
+            }
+            return failed_result(state, outcome.http_status, std::move(write_error));
+        }
+        if (writer) {
+            writer->commit();
+        }
+        DownloadResult result = success_result(state, outcome.http_status);
+        result.body = std::move(body);
+        result.pieces_repaired = repaired;
+        return result;
     } catch (const std::exception& ex) {
         return failed_result(state, 0, ex.what());
     }
@@ -159,149 +180,615 @@ DownloadResult HttpClient::download_whole_file(const DownloadStatePtr& state,
 DownloadResult HttpClient::download_range_file(const DownloadStatePtr& state,
                                                std::size_t chunk_count,
                                                std::stop_token stop_token) const {
+    Clock& clock = transport_.clock();
     state->status = DownloadStatus::Running;
-    state->started_at = std::chrono::steady_clock::now();
+    state->started_at = clock.now();
     state->downloaded_bytes = 0;
 
     try {
         const auto total_size = static_cast<std::int64_t>(state->total_bytes.load());
-        FileWriter writer(state->request.output_path, FileWriter::Mode::ReadWriteTruncate);
-        writer.resize(total_size);
+        std::optional<FileWriter> writer;
+        std::optional<PieceLedger> ledger;
+        std::shared_ptr<MemoryBody> body;
+        RangeSink sink;
+        if (state->request.target == DownloadTarget::Memory) {
+            body = arena_.allocate_fixed(static_cast<std::size_t>(total_size));
+            sink.memory = body.get();
+        } else if (state->request.target == DownloadTarget::File) {
+            writer.emplace(state->request.output_path, FileWriter::Mode::ReadWriteTruncate,
+                           state->request.durability);
+            writer->resize(total_size);
+            sink.file = &*writer;
+            if (state->request.pieces) {
+                ledger.emplace(*state->request.pieces, total_size);
+                sink.pieces = &*ledger;
+            }
+        }
 
-        const std::int64_t chunks = compute_chunk_count(total_size, chunk_count);
-        const std::int64_t base_chunk_size = total_size / chunks;
-        const std::int64_t remainder = total_size % chunks;
+        std::int64_t chunks = compute_chunk_count(total_size, chunk_count);
+        std::int64_t base_chunk_size = total_size / chunks;
+        std::int64_t remainder = total_size % chunks;
+        if (ledger) {
+            // Ranges start on piece boundaries so every piece is hashed by the
+            // transfer that fetched it; the last range takes the shortfall.
+            const std::int64_t piece_size = ledger->piece_size();
+            base_chunk_size = (base_chunk_size + piece_size - 1) / piece_size * piece_size;
+            chunks = (total_size + base_chunk_size - 1) / base_chunk_size;
+            remainder = total_size - chunks * base_chunk_size;
+        }
+        const HedgePolicy& hedge = state->request.hedge;
 
-        std::vector<std::future<DownloadResult>> futures;
-        futures.reserve(static_cast<std::size_t>(chunks));
+        // Declared after the sink so every attempt is joined before it goes away.
+        std::atomic<std::size_t> completions{0};
+        std::vector<std::unique_ptr<RangeSlot>> slots;
+        slots.reserve(static_cast<std::size_t>(chunks));
         std::int64_t offset = 0;
 
         for (std::int64_t i = 0; i < chunks; ++i) {
             const std::int64_t this_chunk_size = base_chunk_size + (i == chunks - 1 ? remainder : 0);
-            const std::int64_t begin = offset;
-            const std::int64_t end = begin + this_chunk_size - 1;
-            offset = end + 1;
-
-            futures.push_back(std::async(std::launch::async,
-                [this, state, fd = writer.fd(), begin, end, stop_token]() {
-                    try {
-                        auto handle = make_curl_handle();
-                        RangeContext context{};
-                        context.state = &state;
-                        context.stop_token = stop_token;
-                        context.fd = fd;
-                        context.next_offset = begin;
-                        std::array<char, CURL_ERROR_SIZE> error_buffer{};
-
-                        configure_common(handle.get(), state->request.url);
-                        const std::string range = std::to_string(begin) + "-" + std::to_string(end);
-                        curl_easy_setopt(handle.get(), CURLOPT_RANGE, range.c_str());
-                        curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION, &HttpClient::range_write_callback);
-                        curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &context);
-                        curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, &HttpClient::progress_callback);
-                        curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &context);
-                        curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
-                        curl_easy_setopt(handle.get(), CURLOPT_ERRORBUFFER, error_buffer.data());
-
-                        const CURLcode rc = curl_easy_perform(handle.get());
-                        long http_status = 0;
-                        curl_easy_getinfo(handle.get(), CURLINFO_RESPONSE_CODE, &http_status);
-
-                        if (stop_token.stop_requested() || rc == CURLE_ABORTED_BY_CALLBACK) {
-                            return cancelled_result(state);
-                        }
-                        if (rc != CURLE_OK) {
-                            const char* msg = error_buffer[0] != '\0' ? error_buffer.data() : curl_easy_strerror(rc);
-                            return failed_result(state, http_status, msg);
+            auto slot = std::make_unique<RangeSlot>();
+            slot->index = static_cast<std::size_t>(i);
+            slot->begin = offset;
+            slot->end = offset + this_chunk_size - 1;
+            slot->clock = &clock;
+            slot->completions = &completions;
+            slot->attempt_begin[RangeSlot::kPrimary] = slot->begin;
+            slot->attempt_next[RangeSlot::kPrimary] = slot->begin;
+            offset = slot->end + 1;
+
+            launch_attempt(state, *slot, RangeSlot::kPrimary, sink, stop_token);
+            slots.push_back(std::move(slot));
+        }
+
+        std::uint64_t pauses_seen = pipeline_.stats().pauses;
+
+        while (true) {
+            const std::size_t completions_seen = completions.load();
+            bool pending = false;
+            std::vector<double> rates;
+            rates.reserve(slots.size());
+            const auto now = clock.now();
+
+            for (auto& slot : slots) {
+                for (int attempt : {RangeSlot::kPrimary, RangeSlot::kHedge}) {
+                    auto& future = slot->attempts[attempt];
+                    if (slot->settled || !future.valid() || slot->finished[attempt]) {
+                        continue;
+                    }
+                    if (!slot->done[attempt].load()) {
+                        pending = true;
+                        continue;
+                    }
+
+                    slot->finished[attempt] = true;
+                    DownloadResult result = future.get();
+                    const int other = 1 - attempt;
+                    const bool other_running = slot->attempts[other].valid() && !slot->finished[other];
+
+                    if (result.status == DownloadStatus::Completed) {
+                        slot->settled = true;
+                        slot->settled_at = now;
+                        slot->abandoned[other] = true;
+                        clock.notify();
+                    } else if (!other_running) {
+                        for (auto& abandoned_slot : slots) {
+                            abandoned_slot->abandoned[RangeSlot::kPrimary] = true;
+                            abandoned_slot->abandoned[RangeSlot::kHedge] = true;
                         }
-                        if (http_status != 206 && http_status != 200) {
-                            return failed_result(state, http_status,
-                                                 "range request returned unexpected HTTP status");
+                        clock.notify();
+                        if (result.status == DownloadStatus::Cancelled) {
+                            return cancelled_result(state);
                         }
-                        return success_result(state, http_status);
-                    } catch (const std::exception& ex) {
-                        return failed_result(state, 0, ex.what());
+                        return failed_result(state, result.http_status, std::move(result.error_message));
                     }
-                }));
-        }
+                }
 
-        for (auto& future : futures) {
-            DownloadResult result = future.get();
-            if (result.status != DownloadStatus::Completed) {
-                return result;
+                const auto until = slot->settled ? slot->settled_at : now;
+                const double seconds = std::chrono::duration<double>(until - slot->started_at).count();
+                if (seconds > 0.0) {
+                    rates.push_back(static_cast<double>(slot->covered_bytes()) / seconds);
+                }
+            }
+
+            if (!pending) {
+                break;
+            }
+
+            // A range paused for disk backpressure is not a network straggler,
+            // so hedging is skipped while the write pipeline is saturated.
+            const std::uint64_t pauses = pipeline_.stats().pauses;
+            const bool backpressured = pauses != pauses_seen;
+            pauses_seen = pauses;
+            if (backpressured) {
+                for (auto& slot : slots) {
+                    slot->last_progress = now.time_since_epoch().count();
+                }
+            }
+
+            if (hedge.enabled && !backpressured && !stop_token.stop_requested()) {
+                double median_rate = 0.0;
+                if (!rates.empty()) {
+                    const auto middle = rates.begin() + static_cast<std::ptrdiff_t>(rates.size() / 2);
+                    std::nth_element(rates.begin(), middle, rates.end());
+                    median_rate = *middle;
+                }
+                for (auto& slot : slots) {
+                    if (should_hedge(*slot, hedge, median_rate, now)) {
+                        launch_attempt(state, *slot, RangeSlot::kHedge, sink, stop_token);
+                        state->hedged_ranges.fetch_add(1);
+                    }
+                }
             }
+
+            // Without hedging there is nothing to poll for between completions.
+            const auto deadline = hedge.enabled ? now + kHedgePollInterval : Clock::time_point::max();
+            clock.wait_until(deadline, [&completions, completions_seen]() {
+                return completions.load() != completions_seen;
+            });
         }
 
-        return success_result(state, 206);
+        // Join the aborted losers of hedged ranges before making the file durable.
+        slots.clear();
+        std::uint32_t repaired = 0;
+        std::string piece_error;
+        if (ledger && !settle_pieces(state, *ledger, *writer, stop_token, repaired, piece_error)) {
+            if (stop_token.stop_requested()) {
+                return cancelled_result(state);
+            }
+            return failed_result(state, 206, std::move(piece_error));
+        }
+        if (writer) {
+            writer->commit();
+        }
+        DownloadResult result = success_result(state, 206);
+        result.body = std::move(body);
+        result.pieces_repaired = repaired;
+        return result;
     } catch (const std::exception& ex) {
         return failed_result(state, 0, ex.what());
     }
 }
 
-std::size_t HttpClient::stream_write_callback(char* ptr, std::size_t size, std::size_t nmemb, void* userdata) {
-    auto* context = static_cast<StreamContext*>(userdata);
-    if (context->stop_token.stop_requested()) {
-        return 0;
+void HttpClient::launch_attempt(const DownloadStatePtr& state,
+                                RangeSlot& slot,
+                                int attempt,
+                                RangeSink sink,
+                                std::stop_token stop_token) const {
+    Clock& clock = transport_.clock();
+    const auto now = clock.now();
+    if (attempt == RangeSlot::kPrimary) {
+        slot.started_at = now;
+    } else {
+        const std::int64_t resume = slot.resume_offset();
+        std::scoped_lock lock(slot.mutex);
+        slot.attempt_begin[attempt] = resume;
+        slot.attempt_next[attempt] = resume;
+    }
+    slot.last_progress = now.time_since_epoch().count();
+
+    clock.begin_activity();
+    try {
+        slot.attempts[attempt] = std::async(std::launch::async,
+            [this, state, &slot, attempt, sink, stop_token, &clock]() {
+                CpuProfiler::set_thread_label("range transfer");
+                DownloadResult result = fetch_range(state, slot, attempt, sink, stop_token);
+                slot.done[attempt] = true;
+                slot.completions->fetch_add(1);
+                clock.notify();
+                clock.end_activity();
+                return result;
+            });
+    } catch (...) {
+        clock.end_activity();
+        throw;
+    }
+}
+
+bool HttpClient::should_hedge(RangeSlot& slot,
+                              const HedgePolicy& policy,
+                              double median_rate,
+                              Clock::time_point now) {
+    if (slot.settled || slot.attempts[RangeSlot::kHedge].valid()) {
+        return false;
+    }
+    if (slot.end + 1 - slot.resume_offset() < kMinHedgeBytes) {
+        return false;
     }
 
-    const std::size_t total = size * nmemb;
-    const std::size_t written = write_all_fd(context->fd, ptr, total);
-    if (written == 0) {
-        return 0;
+    const Clock::time_point last_progress{Clock::time_point::duration{slot.last_progress.load()}};
+    if (now - last_progress >= policy.stall_timeout) {
+        return true;
     }
 
-    if (context->state != nullptr && *context->state != nullptr) {
-        (*context->state)->downloaded_bytes.fetch_add(written);
+    const auto elapsed = now - slot.started_at;
+    if (elapsed < kHedgeWarmup || median_rate <= 0.0) {
+        return false;
     }
-    return written;
+    const double rate = static_cast<double>(slot.covered_bytes()) /
+                        std::chrono::duration<double>(elapsed).count();
+    return rate < policy.slow_fraction * median_rate;
 }
 
-std::size_t HttpClient::range_write_callback(char* ptr, std::size_t size, std::size_t nmemb, void* userdata) {
-    auto* context = static_cast<RangeContext*>(userdata);
-    if (context->stop_token.stop_requested()) {
-        return 0;
+DownloadResult HttpClient::fetch_range(const DownloadStatePtr& state,
+                                       RangeSlot& slot,
+                                       int attempt,
+                                       RangeSink sink,
+                                       std::stop_token stop_token) const {
+    const auto outcome = [&state](DownloadStatus status, long http_status, std::string message) {
+        return DownloadResult{state->request.url, state->request.output_path, status,
+                              http_status, std::move(message)};
+    };
+
+    try {
+        RangeContext context{};
+        context.state = &state;
+        context.stop_token = stop_token;
+        context.abandoned = &slot.abandoned[attempt];
+        context.pipeline = &pipeline_;
+        context.slot = &slot;
+        context.attempt = attempt;
+        {
+            std::scoped_lock lock(slot.mutex);
+            context.next_offset = slot.attempt_begin[attempt];
+        }
+        std::optional<WriteStream> stream;
+        if (sink.memory != nullptr) {
+            context.memory = sink.memory;
+        } else if (sink.file != nullptr) {
+            stream.emplace(pipeline_, *sink.file, context.next_offset, &state->cpu);
+            context.stream = &*stream;
+        }
+        if (sink.pieces != nullptr) {
+            context.pieces.emplace(*sink.pieces, context.next_offset);
+        }
+
+        if (Tracer::enabled()) {
+            context.trace_track = Tracer::new_track(state->request.output_path + " chunk " +
+                                                    std::to_string(slot.index) +
+                                                    (attempt == RangeSlot::kHedge ? " hedge" : ""));
+        }
+        const std::uint64_t start_ns = context.trace_track != 0 ? Tracer::now_ns() : 0;
+        Tracer::record_at(start_ns, context.trace_track, TraceEvent::TransferBegin, context.next_offset, slot.end);
+        if (attempt == RangeSlot::kHedge) {
+            Tracer::record_at(start_ns, context.trace_track, TraceEvent::Hedge, context.next_offset);
+        }
+
+        const TransferOutcome transfer = [&]() {
+            CpuProfiler::Scope cpu(CpuPhase::Transfer, &state->cpu);
+            return transport_.fetch(state->request.url, ByteRange{context.next_offset, slot.end}, context,
+                                    context.trace_track,
+                                    attempt == RangeSlot::kHedge ? Connection::Fresh : Connection::Reuse);
+        }();
+        Tracer::record(context.trace_track, TraceEvent::TransferEnd,
+                       transfer.ok && !slot.abandoned[attempt].load() ? 1 : 0, transfer.http_status);
+        std::string write_error;
+        const bool flushed = !stream || stream->finish(write_error);
+
+        if (slot.abandoned[attempt].load()) {
+            return outcome(DownloadStatus::Cancelled, transfer.http_status, "superseded by hedged request");
+        }
+        if (stop_token.stop_requested() || transfer.aborted) {
+            return outcome(DownloadStatus::Cancelled, transfer.http_status, "cancelled");
+        }
+        if (!flushed) {
+            return outcome(DownloadStatus::Failed, transfer.http_status, std::move(write_error));
+        }
+        if (!transfer.ok) {
+            return outcome(DownloadStatus::Failed, transfer.http_status, transfer.error_message);
+        }
+        if (transfer.http_status != 206 && transfer.http_status != 200) {
+            return outcome(DownloadStatus::Failed, transfer.http_status,
+                           "range request returned unexpected HTTP status");
+        }
+        return outcome(DownloadStatus::Completed, transfer.http_status, {});
+    } catch (const std::exception& ex) {
+        return outcome(DownloadStatus::Failed, 0, ex.what());
     }
+}
 
-    const std::size_t total = size * nmemb;
-    const std::size_t written = pwrite_all_fd(context->fd, ptr, total, context->next_offset);
-    if (written == 0) {
-        return 0;
+std::int64_t HttpClient::RangeSlot::advance(int attempt, std::int64_t next_offset) {
+    std::scoped_lock lock(mutex);
+    attempt_next[attempt] = next_offset;
+
+    // Bytes covered are the union of [begin, primary_next) and
+    // [hedge_begin, hedge_next), which only ever grows.
+    const std::int64_t primary_next = attempt_next[kPrimary];
+    std::int64_t union_bytes = primary_next - begin;
+    if (attempt_begin[kHedge] >= 0) {
+        union_bytes += std::max<std::int64_t>(
+            0, attempt_next[kHedge] - std::max(attempt_begin[kHedge], primary_next));
     }
 
-    context->next_offset += static_cast<std::int64_t>(written);
-    if (context->state != nullptr && *context->state != nullptr) {
-        (*context->state)->downloaded_bytes.fetch_add(written);
+    const std::int64_t fresh = union_bytes - covered;
+    covered = union_bytes;
+    last_progress = clock->now().time_since_epoch().count();
+    return fresh;
+}
+
+std::int64_t HttpClient::RangeSlot::covered_bytes() {
+    std::scoped_lock lock(mutex);
+    return covered;
+}
+
+std::int64_t HttpClient::RangeSlot::resume_offset() {
+    std::scoped_lock lock(mutex);
+    return attempt_next[kPrimary];
+}
+
+bool HttpClient::CallbackBase::can_resume() const {
+    return pipeline == nullptr || pipeline->has_free_buffer();
+}
+
+bool HttpClient::CallbackBase::cancelled() const {
+    return stop_token.stop_requested() ||
+           (abandoned != nullptr && abandoned->load(std::memory_order_relaxed));
+}
+
+bool HttpClient::CallbackBase::accept_status(long http_status) {
+    return required_status == 0 || http_status == required_status;
+}
+
+TransferSink::Write HttpClient::CallbackBase::stage(const char* data, std::size_t size) {
+    if (memory != nullptr) {
+        return memory->append(data, size) ? Write::Accepted : Write::Rejected;
+    }
+    if (stream == nullptr) {
+        return Write::Accepted;
     }
-    return written;
+    switch (stream->append(data, size)) {
+        case WriteStream::Status::Accepted:
+            return Write::Accepted;
+        case WriteStream::Status::PoolExhausted:
+            if (Tracer::enabled()) [[unlikely]] {
+                Tracer::record(trace_track, TraceEvent::Paused);
+            }
+            return Write::Paused;
+        case WriteStream::Status::WriteFailed:
+            break;
+    }
+    return Write::Rejected;
 }
 
-int HttpClient::progress_callback(void* clientp,
-                                  curl_off_t dltotal,
-                                  curl_off_t,
-                                  curl_off_t,
-                                  curl_off_t) {
-    auto* context = static_cast<CallbackBase*>(clientp);
-    if (context->stop_token.stop_requested()) {
-        return 1;
+TransferSink::Write HttpClient::StreamContext::write(const char* data, std::size_t size) {
+    if (cancelled()) {
+        return Write::Rejected;
+    }
+
+    const Write staged = stage(data, size);
+    if (staged != Write::Accepted) {
+        return staged;
     }
-    if (context->state != nullptr && *context->state != nullptr && dltotal > 0) {
-        auto& total_bytes = (*context->state)->total_bytes;
+
+    if (pieces) {
+        pieces->update(data, size);
+    }
+    std::uint64_t offset = 0;
+    if (state != nullptr && *state != nullptr) {
+        offset = (*state)->downloaded_bytes.fetch_add(size);
+    }
+    if (Tracer::enabled()) [[unlikely]] {
+        Tracer::record(trace_track, TraceEvent::WriteBatch, static_cast<std::int64_t>(offset),
+                       static_cast<std::int64_t>(size));
+    }
+    return Write::Accepted;
+}
+
+void HttpClient::StreamContext::expect_length(std::int64_t length) {
+    if (state != nullptr && *state != nullptr) {
+        auto& total_bytes = (*state)->total_bytes;
         if (total_bytes.load() == 0) {
-            total_bytes = static_cast<std::uint64_t>(dltotal);
+            total_bytes = static_cast<std::uint64_t>(length);
+        }
+    }
+}
+
+TransferSink::Write HttpClient::RangeContext::write(const char* data, std::size_t size) {
+    if (cancelled()) {
+        return Write::Rejected;
+    }
+
+    const Write staged = memory != nullptr
+                             ? (memory->write_at(next_offset, data, size) ? Write::Accepted : Write::Rejected)
+                             : stage(data, size);
+    if (staged != Write::Accepted) {
+        return staged;
+    }
+
+    if (pieces) {
+        pieces->update(data, size);
+    }
+    if (Tracer::enabled()) [[unlikely]] {
+        Tracer::record(trace_track, TraceEvent::WriteBatch, next_offset, static_cast<std::int64_t>(size));
+    }
+    next_offset += static_cast<std::int64_t>(size);
+    const std::int64_t fresh = slot->advance(attempt, next_offset);
+    if (fresh > 0 && state != nullptr && *state != nullptr) {
+        (*state)->downloaded_bytes.fetch_add(static_cast<std::uint64_t>(fresh));
+    }
+    return Write::Accepted;
+}
+
+std::optional<DownloadResult> HttpClient::download_delta(const DownloadStatePtr& state,
+                                                        std::stop_token stop_token) const {
+    const DownloadRequest& request = state->request;
+    std::string map_text;
+    BufferSink map_sink(map_text, stop_token);
+    const TransferOutcome map_outcome = [&]() {
+        CpuProfiler::Scope cpu(CpuPhase::Transfer, &state->cpu);
+        return transport_.fetch(request.url + ".blockmap", std::nullopt, map_sink, 0, Connection::Reuse);
+    }();
+    if (!map_outcome.ok || map_outcome.http_status != 200) {
+        return std::nullopt;
+    }
+
+    std::optional<BlockMap> map;
+    std::optional<SeedFile> seed;
+    try {
+        map.emplace(parse_block_map(map_text));
+        seed.emplace(request.output_path);
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+    // A block map left over from an older version of the file is useless.
+    if (map->length != static_cast<std::int64_t>(state->total_bytes.load())) {
+        return std::nullopt;
+    }
+    map_text.clear();
+    map_text.shrink_to_fit();
+
+    state->status = DownloadStatus::Running;
+    state->started_at = transport_.clock().now();
+    state->downloaded_bytes = 0;
+
+    try {
+        const DeltaPlan plan = [&]() {
+            CpuProfiler::Scope cpu(CpuPhase::Hashing, &state->cpu);
+            return plan_delta(*map, *seed);
+        }();
+        const std::uint32_t track = Tracer::enabled() ? Tracer::new_track(request.output_path + " delta") : 0;
+
+        // The new file is assembled in "<path>.part" and renamed over the old
+        // one, which is still being read.
+        FileWriter writer(request.output_path, FileWriter::Mode::ReadWriteReplace, request.durability);
+        writer.resize(map->length);
+
+        for (const DeltaPlan::Copy& copy : plan.copies) {
+            if (stop_token.stop_requested()) {
+                return cancelled_result(state);
+            }
+            CpuProfiler::Scope cpu(CpuPhase::DiskWrite, &state->cpu);
+            writer.pwrite_all(seed->data() + copy.source, static_cast<std::size_t>(copy.length), copy.target);
+            state->downloaded_bytes.fetch_add(static_cast<std::uint64_t>(copy.length));
+        }
+
+        DeltaSink sink(writer, state, stop_token);
+        const std::span<const ByteRange> fetches(plan.fetches);
+        long http_status = 206;
+        std::uint64_t fetched = 0;
+        std::uint64_t reused = static_cast<std::uint64_t>(plan.copy_bytes);
+        for (std::size_t first = 0; first < fetches.size(); first += kMaxRangesPerRequest) {
+            const std::uint64_t batch_start = sink.fetched();
+            const auto batch = fetches.subspan(first, std::min(kMaxRangesPerRequest, fetches.size() - first));
+            Tracer::record(track, TraceEvent::TransferBegin, batch.front().begin, batch.back().end);
+            const TransferOutcome outcome = [&]() {
+                CpuProfiler::Scope cpu(CpuPhase::Transfer, &state->cpu);
+                return transport_.fetch_ranges(request.url, batch, sink, track);
+            }();
+            Tracer::record(track, TraceEvent::TransferEnd, outcome.ok ? 1 : 0, outcome.http_status);
+            http_status = outcome.http_status;
+            if (stop_token.stop_requested() || outcome.aborted) {
+                return cancelled_result(state);
+            }
+            if (!outcome.ok) {
+                return failed_result(state, outcome.http_status, outcome.error_message);
+            }
+            // The server ignored the ranges and sent the whole file, which
+            // replaced everything copied or fetched before it.
+            if (outcome.http_status == 200) {
+                fetched = sink.fetched() - batch_start;
+                reused = 0;
+                state->downloaded_bytes = fetched;
+                break;
+            }
+            fetched = sink.fetched();
+            if (outcome.http_status != 206) {
+                return failed_result(state, outcome.http_status, "range request returned unexpected HTTP status");
+            }
+        }
+
+        const bool verified = [&]() {
+            CpuProfiler::Scope cpu(CpuPhase::Hashing, &state->cpu);
+            return sha256_fd(writer.fd()) == map->sha256;
+        }();
+        if (!verified) {
+            return failed_result(state, http_status, "delta result does not match the block map's SHA-256");
         }
+        writer.commit();
+        DownloadResult result = success_result(state, http_status);
+        result.bytes = fetched;
+        result.bytes_reused = reused;
+        return result;
+    } catch (const std::exception& ex) {
+        return failed_result(state, 0, ex.what());
     }
-    return 0;
 }
 
-void HttpClient::configure_common(CURL* handle, const std::string& url) {
-    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
-    curl_easy_setopt(handle, CURLOPT_USERAGENT, "ModernDownloader/1.0");
-    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
-    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 10L);
-    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 0L);
+bool HttpClient::settle_pieces(const DownloadStatePtr& state,
+                               PieceLedger& ledger,
+                               const FileWriter& file,
+                               std::stop_token stop_token,
+                               std::uint32_t& repaired,
+                               std::string& error) const {
+    std::vector<bool> failed_once(ledger.count(), false);
+    for (int round = 0;; ++round) {
+        {
+            CpuProfiler::Scope cpu(CpuPhase::Hashing, &state->cpu);
+            for (const std::size_t piece : ledger.pieces_in(PieceLedger::State::Unverified)) {
+                if (!verify_piece_on_disk(file.fd(), ledger, piece)) {
+                    error = "could not read back piece " + std::to_string(piece) + " for verification";
+                    return false;
+                }
+            }
+        }
+        const std::vector<std::size_t> bad = ledger.pieces_in(PieceLedger::State::Bad);
+        if (bad.empty()) {
+            repaired = static_cast<std::uint32_t>(std::count(failed_once.begin(), failed_once.end(), true));
+            return true;
+        }
+        if (round == kPieceRepairRounds) {
+            error = std::to_string(bad.size()) + " pieces still fail verification after " +
+                    std::to_string(kPieceRepairRounds) + " repair rounds";
+            return false;
+        }
+        if (stop_token.stop_requested()) {
+            error = "cancelled";
+            return false;
+        }
+
+        // Adjacent bad pieces are fetched with a single range request.
+        for (std::size_t first = 0; first < bad.size();) {
+            std::size_t last = first;
+            while (last + 1 < bad.size() && bad[last + 1] == bad[last] + 1) {
+                ++last;
+            }
+            for (std::size_t i = first; i <= last; ++i) {
+                failed_once[bad[i]] = true;
+                ledger.reset(bad[i]);
+            }
+            const ByteRange range{ledger.bounds(bad[first]).begin, ledger.bounds(bad[last]).end};
+            first = last + 1;
+
+            WriteStream stream(pipeline_, file, range.begin, &state->cpu);
+            StreamContext context{};
+            context.stop_token = stop_token;
+            context.pipeline = &pipeline_;
+            context.stream = &stream;
+            context.pieces.emplace(ledger, range.begin);
+            // A 200 carries the whole body, which must not land at range.begin.
+            context.required_status = 206;
+            if (Tracer::enabled()) {
+                context.trace_track = Tracer::new_track(state->request.output_path + " repair");
+            }
+            Tracer::record(context.trace_track, TraceEvent::TransferBegin, range.begin, range.end);
+            const TransferOutcome outcome = [&]() {
+                CpuProfiler::Scope cpu(CpuPhase::Transfer, &state->cpu);
+                return transport_.fetch(state->request.url, range, context, context.trace_track, Connection::Reuse);
+            }();
+            Tracer::record(context.trace_track, TraceEvent::TransferEnd, outcome.ok ? 1 : 0, outcome.http_status);
+            if (!stream.finish(error)) {
+                return false;
+            }
+            if (outcome.http_status != 206 && outcome.http_status < 400) {
+                error = "server ignored the range request for a piece repair";
+                return false;
+            }
+            if (!outcome.ok) {
+                error = "piece repair failed: " + outcome.error_message;
+                return false;
+            }
+            state->downloaded_bytes.fetch_add(static_cast<std::uint64_t>(range.end + 1 - range.begin));
+        }
+    }
 }
 
 DownloadResult HttpClient::cancelled_result(const DownloadStatePtr& state) {
@@ -318,11 +805,13 @@ DownloadResult HttpClient::failed_result(const DownloadStatePtr& state, long htt
                           http_status, std::move(message)};
 }
 
-DownloadResult HttpClient::success_result(const DownloadStatePtr& state, long http_status) {
+DownloadResult HttpClient::success_result(const DownloadStatePtr& state, long http_status) const {
     state->status = DownloadStatus::Completed;
     state->http_status = http_status;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        transport_.clock().now() - state->started_at);
     return DownloadResult{state->request.url, state->request.output_path, DownloadStatus::Completed,
-                          http_status, {}};
+                          http_status, {}, state->downloaded_bytes.load(), elapsed};
 }
 
 }  // namespace downloader
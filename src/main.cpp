@@ -1,14 +1,200 @@
+#include "downloader/allocation_counter.h"
+#include "downloader/cpu_profiler.h"
 #include "downloader/curl_raii.h"
+#include "downloader/daemon.h"
+#include "downloader/delta.h"
 #include "downloader/download_manager.h"
+#include "downloader/pieces.h"
+#include "downloader/shard.h"
+#include "downloader/simulated_transport.h"
+#include "downloader/tracer.h"
 
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <pthread.h>
+#include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace {
 
+// A generated workload for --simulate: `jobs` downloads of about `size`
+// bytes each, spread over `hosts` hosts of a simulated network.
+struct Scenario {
+    std::size_t jobs{1000};
+    std::int64_t size{4 * 1024 * 1024};
+    std::size_t hosts{8};
+    downloader::SimulationConfig network{};
+};
+
+struct Options {
+    std::size_t chunks{4};
+    std::size_t concurrency{0};
+    std::optional<Scenario> simulation;
+    downloader::HedgePolicy hedge{};
+    downloader::Durability durability{downloader::Durability::None};
+    downloader::SyncMode sync{downloader::SyncMode::Off};
+    bool pieces{false};
+    bool delta{false};
+    std::string make_block_map;
+    std::int64_t block_size{4096};
+    downloader::PipelineConfig pipeline{};
+    std::string daemon_socket;
+    std::string client_socket;
+    std::string trace_path;
+    bool cpu_profile{false};
+    std::string shard_manifest;
+    std::chrono::milliseconds shard_lease{30000};
+};
+
+std::string option_value(std::string_view arg) {
+    return std::string(arg.substr(arg.find('=') + 1));
+}
+
+bool parse_scenario(std::string_view spec, Scenario& scenario) {
+    using namespace std::chrono;
+    constexpr double kMiB = 1024.0 * 1024.0;
+    auto& network = scenario.network;
+    while (!spec.empty()) {
+        const auto comma = spec.find(',');
+        const std::string_view item = spec.substr(0, comma);
+        spec = comma == std::string_view::npos ? std::string_view{} : spec.substr(comma + 1);
+
+        const auto equals = item.find('=');
+        if (equals == std::string_view::npos) {
+            std::cerr << "Expected key=value in --simulate: " << item << '\n';
+            return false;
+        }
+        const std::string_view key = item.substr(0, equals);
+        const std::string value(item.substr(equals + 1));
+        if (key == "jobs") {
+            scenario.jobs = std::stoul(value);
+        } else if (key == "size-kb") {
+            scenario.size = std::stoll(value) * 1024;
+        } else if (key == "hosts") {
+            scenario.hosts = std::max<std::size_t>(1, std::stoul(value));
+        } else if (key == "rtt-ms") {
+            network.rtt = duration_cast<microseconds>(duration<double, std::milli>(std::stod(value)));
+        } else if (key == "conn-mibps") {
+            network.connection_bandwidth = std::stod(value) * kMiB;
+        } else if (key == "link-mibps") {
+            network.link_capacity = std::stod(value) * kMiB;
+        } else if (key == "fail") {
+            network.failure_rate = std::stod(value);
+        } else if (key == "stall") {
+            network.stall_rate = std::stod(value);
+        } else if (key == "stall-ms") {
+            network.stall_duration = milliseconds(std::stol(value));
+        } else if (key == "delivery-kb") {
+            network.delivery_size = std::max<std::size_t>(1, std::stoul(value)) * 1024;
+        } else if (key == "seed") {
+            network.seed = std::stoull(value);
+        } else {
+            std::cerr << "Unknown --simulate key: " << key << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parse_options(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg.starts_with("--chunks=")) {
+            options.chunks = std::clamp<std::size_t>(std::stoul(option_value(arg)), 1, downloader::kMaxPreferredChunks);
+        } else if (arg.starts_with("--concurrency=")) {
+            options.concurrency = std::stoul(option_value(arg));
+        } else if (arg == "--simulate" || arg.starts_with("--simulate=")) {
+            options.simulation.emplace();
+            if (arg != "--simulate" && !parse_scenario(option_value(arg), *options.simulation)) {
+                return false;
+            }
+        } else if (arg == "--hedge") {
+            options.hedge.enabled = true;
+        } else if (arg.starts_with("--hedge-fraction=")) {
+            options.hedge.enabled = true;
+            options.hedge.slow_fraction = std::stod(option_value(arg));
+            if (!(options.hedge.slow_fraction > 0.0 && options.hedge.slow_fraction <= 1.0)) {
+                std::cerr << "--hedge-fraction must be in (0, 1]\n";
+                return false;
+            }
+        } else if (arg.starts_with("--hedge-stall-ms=")) {
+            options.hedge.enabled = true;
+            options.hedge.stall_timeout = std::chrono::milliseconds(std::stol(option_value(arg)));
+            if (options.hedge.stall_timeout.count() <= 0) {
+                std::cerr << "--hedge-stall-ms must be positive\n";
+                return false;
+            }
+        } else if (arg.starts_with("--durability=")) {
+            const std::string mode = option_value(arg);
+            if (mode == "none") {
+                options.durability = downloader::Durability::None;
+            } else if (mode == "sync") {
+                options.durability = downloader::Durability::SyncOnComplete;
+            } else if (mode == "stream") {
+                options.durability = downloader::Durability::Streaming;
+            } else {
+                std::cerr << "Unknown durability mode: " << mode << '\n';
+                return false;
+            }
+        } else if (arg == "--sync") {
+            options.sync = downloader::SyncMode::Metadata;
+        } else if (arg.starts_with("--sync=")) {
+            const std::string mode = option_value(arg);
+            if (mode == "metadata") {
+                options.sync = downloader::SyncMode::Metadata;
+            } else if (mode == "checksum") {
+                options.sync = downloader::SyncMode::Checksum;
+            } else {
+                std::cerr << "Unknown sync mode: " << mode << '\n';
+                return false;
+            }
+        } else if (arg == "--pieces") {
+            options.pieces = true;
+        } else if (arg == "--delta") {
+            options.delta = true;
+        } else if (arg.starts_with("--make-blockmap=")) {
+            options.make_block_map = option_value(arg);
+        } else if (arg.starts_with("--block-size=")) {
+            options.block_size = std::stoll(option_value(arg));
+        } else if (arg.starts_with("--buffers=")) {
+            options.pipeline.buffer_count = std::stoul(option_value(arg));
+        } else if (arg.starts_with("--buffer-kb=")) {
+            options.pipeline.buffer_size = std::stoul(option_value(arg)) * 1024;
+        } else if (arg.starts_with("--writers=")) {
+            options.pipeline.writer_threads = std::stoul(option_value(arg));
+        } else if (arg.starts_with("--trace=")) {
+            options.trace_path = option_value(arg);
+        } else if (arg == "--cpu-profile") {
+            options.cpu_profile = true;
+        } else if (arg.starts_with("--shard=")) {
+            options.shard_manifest = option_value(arg);
+        } else if (arg.starts_with("--shard-lease-ms=")) {
+            options.shard_lease = std::chrono::milliseconds(std::max(3L, std::stol(option_value(arg))));
+        } else if (arg.starts_with("--daemon=")) {
+            options.daemon_socket = option_value(arg);
+        } else if (arg.starts_with("--client=")) {
+            options.client_socket = option_value(arg);
+        } else {
+            std::cerr << "Unknown option: " << arg << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+
 std::vector<std::string> split_tokens(const std::string& line) {
     std::stringstream ss(line);
     std::vector<std::string> tokens;
@@ -19,41 +205,525 @@ std::vector<std::string> split_tokens(const std::string& line) {
     return tokens;
 }
 
-}  // namespace
+std::optional<downloader::DownloadRequest> make_request(const Options& options,
+                                                       const std::string& url,
+                                                       const std::string& output_path) {
+    downloader::DownloadRequest request{url, output_path, options.chunks, options.hedge, options.durability};
+    request.sync = options.sync;
+    request.delta = options.delta;
+    if (options.pieces) {
+        try {
+            request.pieces = std::make_shared<const downloader::PieceHashes>(
+                downloader::load_piece_hashes(output_path + ".pieces"));
+        } catch (const std::exception& ex) {
+            std::cerr << ex.what() << '\n';
+            return std::nullopt;
+        }
+    }
+    return request;
+}
+
+std::optional<std::vector<downloader::DownloadRequest>> read_requests(const Options& options) {
+    std::cout << "Input pairs: <url1> <output1> <url2> <output2> ...\n";
+    std::string line;
+    std::getline(std::cin, line);
+
+    const auto tokens = split_tokens(line);
+    if (tokens.size() < 2 || tokens.size() % 2 != 0) {
+        std::cerr << "Expected URL/output pairs.\n";
+        return std::nullopt;
+    }
+
+    std::vector<downloader::DownloadRequest> requests;
+    for (std::size_t i = 0; i < tokens.size(); i += 2) {
+        auto request = make_request(options, tokens[i], tokens[i + 1]);
+        if (!request) {
+            return std::nullopt;
+        }
+        requests.push_back(std::move(*request));
+    }
+    return requests;
+}
+
+void print_result(const std::string& url,
+                  const std::string& output_path,
+                  downloader::DownloadStatus status,
+                  std::uint64_t bytes,
+                  std::chrono::milliseconds elapsed,
+                  const std::string& error_message,
+                  bool up_to_date = false) {
+    if (up_to_date) {
+        std::cout << "Up to date: " << url << " -> " << output_path;
+    } else if (status == downloader::DownloadStatus::Completed) {
+        std::cout << "Completed: " << url << " -> " << output_path;
+        if (elapsed.count() > 0) {
+            const double mib_per_s = static_cast<double>(bytes) / (1024.0 * 1024.0) /
+                                     (static_cast<double>(elapsed.count()) / 1000.0);
+            std::cout << " (" << mib_per_s << " MiB/s)";
+        }
+    } else {
+        std::cout << "Failed: " << url << " -> " << output_path << " | " << error_message;
+    }
+}
+
+// Only available in builds configured with DOWNLOADER_COUNT_ALLOCATIONS.
+void print_callback_allocations() {
+    if constexpr (downloader::AllocationCounter::kEnabled) {
+        const auto stats = downloader::AllocationCounter::callback_stats();
+        std::cout << "Transfer callbacks: " << stats.callbacks << ", heap allocations in them: "
+                  << stats.allocations << '\n';
+    }
+}
+
+void enable_cpu_profile(const Options& options) {
+    if (options.cpu_profile && !downloader::CpuProfiler::enable()) {
+        std::cerr << "CPU profiling is only available on Linux.\n";
+    }
+}
+
+// CPU cost of `counts` relative to the bytes transferred. Per-byte cost is in
+// cycles when the hardware counter is available and in CPU time otherwise.
+std::string describe_cpu(const downloader::CpuCounts& counts, std::uint64_t bytes) {
+    const auto support = downloader::CpuProfiler::support();
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2) << static_cast<double>(counts.cpu_ns) / 1e6 << " ms CPU";
+    if (bytes > 0) {
+        const auto per_byte = [bytes](std::uint64_t count) {
+            return static_cast<double>(count) / static_cast<double>(bytes);
+        };
+        if (support.cycles) {
+            out << ", " << per_byte(counts.cycles) << " cycles/B";
+        } else {
+            out << ", " << per_byte(counts.cpu_ns) << " ns/B";
+        }
+        if (support.syscalls) {
+            out << ", " << per_byte(counts.syscalls) * 1024 * 1024 << " syscalls/MiB";
+        }
+    }
+    if (support.cycles && support.instructions && counts.cycles > 0) {
+        out << ", IPC " << static_cast<double>(counts.instructions) / static_cast<double>(counts.cycles);
+    }
+    out << ", " << counts.context_switches << " context switches";
+    return out.str();
+}
+
+void print_cpu_profile(std::uint64_t bytes) {
+    if (!downloader::CpuProfiler::enabled()) {
+        return;
+    }
+    const auto support = downloader::CpuProfiler::support();
+    std::vector<std::string> counters;
+    if (support.cycles) {
+        counters.emplace_back("cycles");
+    }
+    if (support.instructions) {
+        counters.emplace_back("instructions");
+    }
+    counters.emplace_back(support.context_switches ? "context switches" : "context switches (getrusage)");
+    if (support.syscalls) {
+        counters.emplace_back("syscalls");
+    }
+    std::cout << "CPU profile for " << bytes << " bytes transferred; counters:";
+    for (std::size_t i = 0; i < counters.size(); ++i) {
+        std::cout << (i == 0 ? " " : ", ") << counters[i];
+    }
+    if ((support.cycles || support.instructions) && !support.kernel_mode) {
+        std::cout << " (user mode only)";
+    }
+    std::cout << '\n';
+
+    const auto& totals = downloader::CpuProfiler::totals();
+    for (std::size_t i = 0; i < downloader::kCpuPhaseCount; ++i) {
+        const auto phase = static_cast<downloader::CpuPhase>(i);
+        std::cout << "  " << downloader::to_string(phase) << ": " << describe_cpu(totals.phase(phase), bytes)
+                  << '\n';
+    }
+    std::cout << "  total: " << describe_cpu(totals.total(), bytes) << '\n';
+    for (const auto& [label, counts] : downloader::CpuProfiler::thread_totals()) {
+        std::cout << "  " << label << ": " << describe_cpu(counts, bytes) << '\n';
+    }
+}
+
+std::size_t concurrency(const Options& options) {
+    if (options.concurrency > 0) {
+        return options.concurrency;
+    }
+    return std::max<std::size_t>(2, std::thread::hardware_concurrency());
+}
+
+// Blocks SIGINT/SIGTERM in every thread created afterwards and runs
+// `on_signal` on a dedicated thread when one arrives.
+template <typename Fn>
+void handle_termination_signals(Fn on_signal) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread([signals, on_signal]() mutable {
+        int signal = 0;
+        sigwait(&signals, &signal);
+        on_signal();
+    }).detach();
+}
+
+int run_local(const Options& options) {
+    const auto requests = read_requests(options);
+    if (!requests) {
+        return 1;
+    }
+
+    if (!options.trace_path.empty()) {
+        downloader::Tracer::enable();
+    }
+    enable_cpu_profile(options);
+
+    const std::size_t worker_count = concurrency(options);
+    downloader::DownloadManager manager(worker_count, options.pipeline);
+
+    std::vector<downloader::DownloadStatePtr> states;
+    for (const auto& request : *requests) {
+        states.push_back(manager.add(request));
+    }
+
+    const auto results = manager.run_all();
+    int exit_code = 0;
+    std::size_t up_to_date = 0;
+    std::uint64_t bytes_skipped = 0;
+    std::size_t transferred = 0;
+    std::uint64_t bytes_transferred = 0;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const auto& result = results[i];
+        print_result(result.url, result.output_path, result.status, result.bytes, result.elapsed,
+                     result.error_message, result.up_to_date);
+        if (result.up_to_date) {
+            ++up_to_date;
+            bytes_skipped += states[i]->total_bytes.load();
+        } else if (result.status == downloader::DownloadStatus::Completed) {
+            ++transferred;
+            bytes_transferred += result.bytes;
+        }
+        if (const auto hedged = states[i]->hedged_ranges.load(); hedged > 0) {
+            std::cout << " (" << hedged << " hedged ranges)";
+        }
+        if (result.pieces_repaired > 0) {
+            std::cout << " (" << result.pieces_repaired << " pieces repaired)";
+        }
+        if (result.bytes_reused > 0) {
+            std::cout << " (" << result.bytes << " bytes fetched, " << result.bytes_reused
+                      << " reused from the old file)";
+        }
+        if (downloader::CpuProfiler::enabled() && !result.up_to_date) {
+            std::cout << " (" << describe_cpu(states[i]->cpu.total(), result.bytes) << ')';
+        }
+        std::cout << '\n';
+        if (result.status != downloader::DownloadStatus::Completed) {
+            exit_code = 1;
+        }
+    }
+
+    if (options.sync != downloader::SyncMode::Off) {
+        std::cout << "Sync: " << up_to_date << " up to date (" << bytes_skipped << " bytes skipped), "
+                  << transferred << " transferred (" << bytes_transferred << " bytes)\n";
+    }
+
+    const auto stats = manager.pipeline_stats();
+    std::cout << "Write pipeline: peak " << stats.peak_buffers_in_use << '/' << stats.buffer_count
+              << " buffers of " << stats.buffer_size / 1024 << " KiB, " << stats.pauses
+              << " transfer pauses, " << stats.bytes_written << " bytes written\n";
+    print_callback_allocations();
+    print_cpu_profile(bytes_transferred);
+
+    if (!options.trace_path.empty()) {
+        std::ofstream trace(options.trace_path);
+        downloader::Tracer::write_chrome_trace(trace);
+        if (!trace) {
+            std::cerr << "Could not write trace to " << options.trace_path << '\n';
+            return 1;
+        }
+        std::cout << "Trace written to " << options.trace_path << '\n';
+    }
+    return exit_code;
+}
+
+double percentile(std::vector<double>& values, double fraction) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    const auto rank = static_cast<std::size_t>(fraction * static_cast<double>(values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(rank), values.end());
+    return values[rank];
+}
+
+// Runs a generated workload through the real scheduler against a simulated
+// network and reports what happened in virtual time.
+int run_simulation(const Options& options) {
+    const Scenario& scenario = *options.simulation;
+    enable_cpu_profile(options);
+    auto network = std::make_shared<downloader::SimulatedTransport>(scenario.network);
+    downloader::DownloadManager manager(concurrency(options), options.pipeline, network);
+    manager.set_progress_enabled(false);
 
-int main() {
+    // Sizes vary between half and one and a half times the nominal size.
+    std::mt19937_64 rng(scenario.network.seed);
+    std::uniform_int_distribution<std::int64_t> size_of(std::max<std::int64_t>(1, scenario.size / 2),
+                                                         std::max<std::int64_t>(1, scenario.size * 3 / 2));
+    for (std::size_t i = 0; i < scenario.jobs; ++i) {
+        downloader::DownloadRequest request;
+        request.url = "https://host" + std::to_string(i % scenario.hosts) + ".sim/file" + std::to_string(i);
+        request.output_path = "file" + std::to_string(i);
+        request.preferred_chunks = options.chunks;
+        request.hedge = options.hedge;
+        request.target = downloader::DownloadTarget::Discard;
+        network->add_resource(request.url, size_of(rng));
+        manager.add(std::move(request));
+    }
+
+    const auto wall_start = std::chrono::steady_clock::now();
+    const auto results = manager.run_all();
+    const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+
+    std::size_t completed = 0;
+    std::uint64_t bytes = 0;
+    std::vector<double> seconds;
+    seconds.reserve(results.size());
+    for (const auto& result : results) {
+        if (result.status == downloader::DownloadStatus::Completed) {
+            ++completed;
+            bytes += result.bytes;
+            seconds.push_back(std::chrono::duration<double>(result.elapsed).count());
+        }
+    }
+
+    const double makespan = std::chrono::duration<double>(network->now().time_since_epoch()).count();
+    const auto stats = network->stats();
+    std::cout << "Simulated " << results.size() << " jobs: " << completed << " completed, "
+              << results.size() - completed << " failed\n"
+              << "Virtual time: " << makespan << " s, goodput "
+              << (makespan > 0.0 ? static_cast<double>(bytes) / (1024.0 * 1024.0) / makespan : 0.0)
+              << " MiB/s\n"
+              << "Download time: p50 " << percentile(seconds, 0.5) << " s, p99 " << percentile(seconds, 0.99)
+              << " s, max " << percentile(seconds, 1.0) << " s\n"
+              << "Transfers: " << stats.transfers << ", connections opened " << stats.connections_opened
+              << ", resets " << stats.failures << ", stalls " << stats.stalls << '\n'
+              << "Wall time: " << wall.count() << " s\n";
+    print_callback_allocations();
+    print_cpu_profile(bytes);
+    return completed == results.size() ? 0 : 1;
+}
+
+int run_make_block_map(const Options& options) {
+    const std::string out_path = options.make_block_map + ".blockmap";
+    const std::string map = downloader::make_block_map(options.make_block_map, options.block_size);
+    std::ofstream out(out_path, std::ios::binary);
+    out.write(map.data(), static_cast<std::streamsize>(map.size()));
+    if (!out) {
+        std::cerr << "Could not write " << out_path << '\n';
+        return 1;
+    }
+    std::cout << "Wrote " << out_path << " (" << map.size() << " bytes, block size " << options.block_size
+              << ")\n";
+    return 0;
+}
+
+int run_daemon(const Options& options) {
+    std::stop_source stop;
+    handle_termination_signals([stop]() mutable { stop.request_stop(); });
+
+    const std::size_t worker_count = concurrency(options);
+    downloader::DaemonServer server(options.daemon_socket, worker_count, options.pipeline);
+    std::cout << "Listening on " << options.daemon_socket << std::endl;
+    server.run(stop.get_token());
+    return 0;
+}
+
+// One worker of a sharded run. Any number of them, on this host or on others
+// sharing the filesystem, can work through the same manifest at once.
+int run_shard(const Options& options) {
+    std::vector<downloader::ManifestEntry> entries;
     try {
-        downloader::CurlGlobal curl_global;
+        entries = downloader::load_manifest(options.shard_manifest);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << '\n';
+        return 1;
+    }
+    std::vector<downloader::DownloadRequest> requests;
+    for (const auto& entry : entries) {
+        auto request = make_request(options, entry.url, entry.output_path);
+        if (!request) {
+            return 1;
+        }
+        requests.push_back(std::move(*request));
+    }
 
-        std::cout << "Input pairs: <url1> <output1> <url2> <output2> ...\n";
-        std::string line;
-        std::getline(std::cin, line);
+    std::stop_source stop;
+    handle_termination_signals([stop]() mutable { stop.request_stop(); });
+    enable_cpu_profile(options);
 
-        const auto tokens = split_tokens(line);
-        if (tokens.size() < 2 || tokens.size() % 2 != 0) {
-            std::cerr << "Expected URL/output pairs.\n";
+    const std::string log_path = options.shard_manifest + ".claims";
+    downloader::ShardWorker worker(std::move(requests), log_path, downloader::default_worker_id(),
+                                   options.shard_lease, concurrency(options), options.pipeline);
+    std::cout << "Worker " << worker.log().worker() << " claiming jobs from " << log_path << std::endl;
+    const auto results = worker.run(stop.get_token());
+
+    std::uint64_t bytes_transferred = 0;
+    for (const auto& [job, result] : results) {
+        print_result(result.url, result.output_path, result.status, result.bytes, result.elapsed,
+                     result.error_message, result.up_to_date);
+        std::cout << '\n';
+        if (result.status == downloader::DownloadStatus::Completed && !result.up_to_date) {
+            bytes_transferred += result.bytes;
+        }
+    }
+    print_cpu_profile(bytes_transferred);
+
+    // The merged report covers the results of every worker.
+    struct Tally {
+        std::size_t jobs{0};
+        std::size_t failed{0};
+        std::uint64_t bytes{0};
+    };
+    std::map<std::string, Tally> workers;
+    std::size_t completed = 0;
+    std::size_t failed = 0;
+    std::size_t outstanding = 0;
+    const auto jobs = worker.log().jobs();
+    for (const auto& job : jobs) {
+        if (job.state != downloader::ShardJob::State::Done) {
+            ++outstanding;
+            continue;
+        }
+        Tally& tally = workers[job.worker];
+        ++tally.jobs;
+        tally.bytes += job.bytes;
+        if (job.status == downloader::DownloadStatus::Completed) {
+            ++completed;
+        } else {
+            ++tally.failed;
+            ++failed;
+        }
+    }
+    std::cout << "Shard report: " << jobs.size() << " jobs, " << completed << " completed, " << failed
+              << " failed, " << outstanding << " not done, " << workers.size() << " workers\n";
+    for (const auto& [id, tally] : workers) {
+        std::cout << "  " << id << ": " << tally.jobs << " jobs, " << tally.failed << " failed, " << tally.bytes
+                  << " bytes\n";
+    }
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        if (jobs[i].state == downloader::ShardJob::State::Done &&
+            jobs[i].status != downloader::DownloadStatus::Completed) {
+            std::cout << "  Failed: " << entries[i].url << " -> " << entries[i].output_path << " | "
+                      << jobs[i].error_message << " (" << jobs[i].worker << ")\n";
+        }
+    }
+    if (results.empty() && outstanding == 0 && !stop.stop_requested()) {
+        std::cout << "Every job was already done according to " << log_path << "; delete it to run them again.\n";
+    }
+    return failed == 0 && outstanding == 0 ? 0 : 1;
+}
+
+int run_client(const Options& options) {
+    // These act on the process that runs the transfers, which is the daemon.
+    const std::pair<bool, const char*> unsupported[] = {
+        {options.pieces, "--pieces"},
+        {!options.trace_path.empty(), "--trace"},
+        {options.cpu_profile, "--cpu-profile"},
+    };
+    for (const auto& [given, name] : unsupported) {
+        if (given) {
+            std::cerr << name << " is not supported together with --client.\n";
             return 1;
         }
+    }
+    auto requests = read_requests(options);
+    if (!requests) {
+        return 1;
+    }
 
-        const std::size_t worker_count = std::max<std::size_t>(2, std::thread::hardware_concurrency());
-        downloader::DownloadManager manager(worker_count);
+    // The daemon has its own working directory.
+    for (auto& request : *requests) {
+        request.output_path = std::filesystem::absolute(request.output_path).string();
+    }
 
-        for (std::size_t i = 0; i < tokens.size(); i += 2) {
-            manager.add(downloader::DownloadRequest{tokens[i], tokens[i + 1], 4});
+    auto client = std::make_shared<downloader::DaemonClient>(options.client_socket);
+    const std::size_t job_count = requests->size();
+    handle_termination_signals([client, job_count]() {
+        for (std::uint64_t job_id = 0; job_id < job_count; ++job_id) {
+            client->cancel(job_id);
         }
+    });
 
-        const auto results = manager.run_all();
-        int exit_code = 0;
-        for (const auto& result : results) {
-            if (result.status == downloader::DownloadStatus::Completed) {
-                std::cout << "Completed: " << result.url << " -> " << result.output_path << '\n';
+    for (std::uint64_t job_id = 0; job_id < job_count; ++job_id) {
+        client->submit(job_id, (*requests)[job_id]);
+    }
+
+    namespace protocol = downloader::protocol;
+    std::size_t remaining = job_count;
+    int exit_code = 0;
+    while (remaining > 0) {
+        const auto frame = client->next_frame();
+        if (!frame) {
+            std::cerr << "Daemon closed the connection.\n";
+            return 1;
+        }
+        if (frame->type == protocol::FrameType::Progress) {
+            const auto progress = protocol::decode_progress(frame->payload);
+            if (progress.job_id >= job_count) {
+                continue;
+            }
+            const auto& request = (*requests)[progress.job_id];
+            std::cout << '[' << downloader::to_string(progress.status) << "] " << request.output_path << " : ";
+            if (progress.total_bytes > 0) {
+                std::cout << (progress.downloaded_bytes * 100) / progress.total_bytes << "% ("
+                          << progress.downloaded_bytes << '/' << progress.total_bytes << " bytes)\n";
             } else {
-                std::cout << "Failed: " << result.url << " -> " << result.output_path
-                          << " | " << result.error_message << '\n';
+                std::cout << progress.downloaded_bytes << " bytes\n";
+            }
+        } else if (frame->type == protocol::FrameType::Result) {
+            const auto result = protocol::decode_result(frame->payload);
+            if (result.job_id >= job_count) {
+                continue;
+            }
+            const auto& request = (*requests)[result.job_id];
+            print_result(request.url, request.output_path, result.status, result.bytes,
+                         std::chrono::milliseconds(result.elapsed_ms), result.error_message, result.up_to_date);
+            std::cout << '\n';
+            if (result.status != downloader::DownloadStatus::Completed) {
                 exit_code = 1;
             }
+            --remaining;
+        }
+    }
+    return exit_code;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        Options options;
+        if (!parse_options(argc, argv, options)) {
+            return 1;
+        }
+
+        if (!options.make_block_map.empty()) {
+            return run_make_block_map(options);
+        }
+        if (!options.client_socket.empty()) {
+            return run_client(options);
+        }
+        if (options.simulation) {
+            return run_simulation(options);
+        }
+
+        downloader::CurlGlobal curl_global;
+        if (!options.daemon_socket.empty()) {
+            return run_daemon(options);
+        }
+        if (!options.shard_manifest.empty()) {
+            return run_shard(options);
         }
-        return exit_code;
+        return run_local(options);
     } catch (const std::exception& ex) {
         std::cerr << "Fatal error: " << ex.what() << '\n';
         return 1;
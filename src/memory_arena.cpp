@@ -0,0 +1,86 @@
+#include "downloader/memory_arena.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <utility>
+
+namespace downloader {
+
+namespace {
+constexpr std::size_t kMinBlockSize = 4096;
+
+std::size_t size_class(std::size_t capacity) {
+    return std::bit_ceil(std::max(capacity, kMinBlockSize));
+}
+}  // namespace
+
+MemoryBody::Block MemoryBody::Pool::take(std::size_t min_capacity) {
+    const std::size_t capacity = size_class(min_capacity);
+    {
+        std::scoped_lock lock(mutex);
+        auto it = free_blocks.find(capacity);
+        if (it != free_blocks.end() && !it->second.empty()) {
+            Block block = std::move(it->second.back());
+            it->second.pop_back();
+            cached_bytes -= capacity;
+            return block;
+        }
+    }
+    return Block{std::make_unique_for_overwrite<std::byte[]>(capacity), capacity};
+}
+
+void MemoryBody::Pool::give(Block block) {
+    std::scoped_lock lock(mutex);
+    if (cached_bytes + block.capacity > max_cached_bytes) {
+        return;
+    }
+    cached_bytes += block.capacity;
+    free_blocks[block.capacity].push_back(std::move(block));
+}
+
+MemoryBody::~MemoryBody() {
+    if (auto pool = pool_.lock()) {
+        pool->give(std::move(block_));
+    }
+}
+
+bool MemoryBody::append(const char* data, std::size_t size) {
+    if (size_ + size > block_.capacity) {
+        const std::size_t wanted = std::max(block_.capacity * 2, size_ + size);
+        auto pool = pool_.lock();
+        Block grown = pool ? pool->take(wanted)
+                           : Block{std::make_unique_for_overwrite<std::byte[]>(size_class(wanted)),
+                                   size_class(wanted)};
+        std::memcpy(grown.data.get(), block_.data.get(), size_);
+        Block old = std::exchange(block_, std::move(grown));
+        if (pool) {
+            pool->give(std::move(old));
+        }
+    }
+    std::memcpy(block_.data.get() + size_, data, size);
+    size_ += size;
+    return true;
+}
+
+bool MemoryBody::write_at(std::int64_t offset, const char* data, std::size_t size) {
+    if (offset < 0 || static_cast<std::size_t>(offset) + size > size_) {
+        return false;
+    }
+    std::memcpy(block_.data.get() + offset, data, size);
+    return true;
+}
+
+MemoryArena::MemoryArena(std::size_t max_cached_bytes) : pool_(std::make_shared<MemoryBody::Pool>()) {
+    pool_->max_cached_bytes = max_cached_bytes;
+}
+
+std::shared_ptr<MemoryBody> MemoryArena::allocate(std::size_t capacity) {
+    return std::shared_ptr<MemoryBody>(new MemoryBody(pool_, pool_->take(capacity), 0));
+}
+
+std::shared_ptr<MemoryBody> MemoryArena::allocate_fixed(std::size_t size) {
+    return std::shared_ptr<MemoryBody>(new MemoryBody(pool_, pool_->take(size), size));
+}
+
+}  // namespace downloader
@@ -0,0 +1,255 @@
+#include "downloader/pieces.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+namespace downloader {
+
+namespace {
+
+constexpr std::size_t kReadBackSize = 1 << 20;
+
+int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+bool parse_hex_digest(std::string_view text, Sha256::Digest& digest) {
+    if (text.size() != digest.size() * 2) {
+        return false;
+    }
+    for (std::size_t i = 0; i < digest.size(); ++i) {
+        const int high = hex_value(text[i * 2]);
+        const int low = hex_value(text[i * 2 + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        digest[i] = static_cast<std::uint8_t>(high << 4 | low);
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view text) {
+    const auto is_space = [](char ch) { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'; };
+    while (!text.empty() && is_space(text.front())) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && is_space(text.back())) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+// 1-based line of `offset` in `text`.
+std::size_t line_at(std::string_view text, std::size_t offset) {
+    return static_cast<std::size_t>(std::count(text.begin(), text.begin() + offset, '\n')) + 1;
+}
+
+// Positive byte count, reported against `path:line` when it is not one.
+std::int64_t parse_piece_size(std::string_view text, const std::string& path, std::size_t line) {
+    text = trim(text);
+    std::int64_t value = 0;
+    const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != std::errc{} || result.ptr != text.data() + text.size() || value <= 0) {
+        throw std::runtime_error(path + ":" + std::to_string(line) + ": bad piece size \"" + std::string(text) +
+                                 "\"");
+    }
+    return value;
+}
+
+// Value of `name="..."` inside a start tag.
+std::string_view attribute(std::string_view tag, std::string_view name) {
+    const std::string key = std::string(name) + "=\"";
+    const std::size_t begin = tag.find(key);
+    if (begin == std::string_view::npos) {
+        return {};
+    }
+    const std::size_t value = begin + key.size();
+    const std::size_t end = tag.find('"', value);
+    return end == std::string_view::npos ? std::string_view{} : tag.substr(value, end - value);
+}
+
+PieceHashes parse_metalink(std::string_view text, const std::string& path) {
+    std::size_t cursor = 0;
+    while ((cursor = text.find("<pieces", cursor)) != std::string_view::npos) {
+        const std::size_t tag_end = text.find('>', cursor);
+        const std::size_t close = text.find("</pieces>", cursor);
+        if (tag_end == std::string_view::npos || close == std::string_view::npos) {
+            break;
+        }
+        const std::string_view tag = text.substr(cursor, tag_end - cursor);
+        cursor = close;
+        if (attribute(tag, "type") != "sha-256") {
+            continue;
+        }
+
+        PieceHashes hashes;
+        hashes.piece_size = parse_piece_size(attribute(tag, "length"), path, line_at(text, tag_end));
+        std::string_view body = text.substr(tag_end + 1, close - tag_end - 1);
+        std::size_t hash = 0;
+        while ((hash = body.find("<hash>")) != std::string_view::npos) {
+            const std::size_t hash_end = body.find("</hash>", hash);
+            if (hash_end == std::string_view::npos) {
+                break;
+            }
+            Sha256::Digest digest{};
+            const std::string_view value = trim(body.substr(hash + 6, hash_end - hash - 6));
+            if (!parse_hex_digest(value, digest)) {
+                const auto offset = static_cast<std::size_t>(body.data() - text.data()) + hash;
+                throw std::runtime_error(path + ":" + std::to_string(line_at(text, offset)) + ": bad piece hash \"" +
+                                         std::string(value) + "\"");
+            }
+            hashes.sha256.push_back(digest);
+            body.remove_prefix(hash_end + 7);
+        }
+        return hashes;
+    }
+    throw std::runtime_error("no sha-256 <pieces> element in " + path);
+}
+
+PieceHashes parse_sidecar(std::istream& in, const std::string& path) {
+    PieceHashes hashes;
+    std::string line;
+    std::size_t line_number = 0;
+    while (std::getline(in, line)) {
+        ++line_number;
+        const std::string_view text = trim(line);
+        if (text.empty() || text.front() == '#') {
+            continue;
+        }
+        if (text.starts_with("piece-size")) {
+            hashes.piece_size = parse_piece_size(text.substr(10), path, line_number);
+            continue;
+        }
+        Sha256::Digest digest{};
+        if (!parse_hex_digest(text.substr(0, std::min(text.find_first_of(" \t"), text.size())), digest)) {
+            throw std::runtime_error(path + ":" + std::to_string(line_number) + ": bad piece hash \"" + line + "\"");
+        }
+        hashes.sha256.push_back(digest);
+    }
+    return hashes;
+}
+
+}  // namespace
+
+PieceHashes load_piece_hashes(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("cannot open piece list " + path);
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    const std::string text = buffer.str();
+
+    PieceHashes hashes;
+    if (text.find("<metalink") != std::string::npos) {
+        hashes = parse_metalink(text, path);
+    } else {
+        std::istringstream lines(text);
+        hashes = parse_sidecar(lines, path);
+    }
+    if (hashes.piece_size <= 0 || hashes.sha256.empty()) {
+        throw std::runtime_error("piece list " + path + " has no piece size or no hashes");
+    }
+    return hashes;
+}
+
+PieceLedger::PieceLedger(const PieceHashes& hashes, std::int64_t length)
+    : hashes_(hashes), length_(length), states_(hashes.sha256.size()) {
+    if (hashes.piece_size <= 0 || length <= 0 ||
+        static_cast<std::size_t>((length + hashes.piece_size - 1) / hashes.piece_size) != hashes.sha256.size()) {
+        throw std::runtime_error("piece list does not match the size of the download");
+    }
+}
+
+ByteRange PieceLedger::bounds(std::size_t piece) const {
+    const std::int64_t begin = static_cast<std::int64_t>(piece) * hashes_.piece_size;
+    return ByteRange{begin, std::min(begin + hashes_.piece_size, length_) - 1};
+}
+
+void PieceLedger::record(std::size_t piece, const Sha256::Digest& digest) {
+    if (digest != hashes_.sha256[piece]) {
+        states_[piece].store(State::Bad, std::memory_order_release);
+        return;
+    }
+    State expected = State::Unverified;
+    states_[piece].compare_exchange_strong(expected, State::Good, std::memory_order_acq_rel);
+}
+
+std::vector<std::size_t> PieceLedger::pieces_in(State state) const {
+    std::vector<std::size_t> pieces;
+    for (std::size_t i = 0; i < states_.size(); ++i) {
+        if (states_[i].load(std::memory_order_acquire) == state) {
+            pieces.push_back(i);
+        }
+    }
+    return pieces;
+}
+
+PieceHasher::PieceHasher(PieceLedger& ledger, std::int64_t offset)
+    : ledger_(ledger),
+      offset_(offset),
+      piece_(static_cast<std::size_t>(offset / ledger.piece_size())),
+      from_start_(offset % ledger.piece_size() == 0) {}
+
+void PieceHasher::update(const char* data, std::size_t size) {
+    while (size > 0 && piece_ < ledger_.count()) {
+        const ByteRange bounds = ledger_.bounds(piece_);
+        const auto take = static_cast<std::size_t>(std::min<std::int64_t>(
+            static_cast<std::int64_t>(size), bounds.end + 1 - offset_));
+        if (from_start_) {
+            hash_.update(data, take);
+        }
+        data += take;
+        size -= take;
+        offset_ += static_cast<std::int64_t>(take);
+        if (offset_ == bounds.end + 1) {
+            if (from_start_) {
+                ledger_.record(piece_, hash_.finish());
+                hash_ = Sha256{};
+            }
+            ++piece_;
+            from_start_ = true;
+        }
+    }
+}
+
+bool verify_piece_on_disk(int fd, PieceLedger& ledger, std::size_t piece) {
+    const ByteRange bounds = ledger.bounds(piece);
+    std::vector<char> buffer(static_cast<std::size_t>(
+        std::min<std::int64_t>(bounds.end + 1 - bounds.begin, kReadBackSize)));
+    Sha256 hash;
+    std::int64_t offset = bounds.begin;
+    while (offset <= bounds.end) {
+        const auto want = static_cast<std::size_t>(std::min<std::int64_t>(
+            bounds.end + 1 - offset, static_cast<std::int64_t>(buffer.size())));
+        const ssize_t got = ::pread(fd, buffer.data(), want, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        hash.update(buffer.data(), static_cast<std::size_t>(got));
+        offset += got;
+    }
+    ledger.record(piece, hash.finish());
+    return true;
+}
+
+}  // namespace downloader
@@ -14,6 +14,11 @@ void ProgressReporter::watch(const DownloadStatePtr& state) {
     states_.push_back(state);
 }
 
+void ProgressReporter::watch_pipeline(const WritePipeline* pipeline) {
+    std::scoped_lock lock(mutex_);
+    pipeline_ = pipeline;
+}
+
 void ProgressReporter::start() {
     if (printer_) {
         return;
@@ -48,6 +53,11 @@ void ProgressReporter::run(std::stop_token stop_token) {
                 }
                 std::cout << '\n';
             }
+            if (pipeline_ != nullptr && !states_.empty()) {
+                const PipelineStats stats = pipeline_->stats();
+                std::cout << "write buffers: " << stats.buffers_in_use << '/' << stats.buffer_count
+                          << " in use, " << stats.pauses << " pauses\n";
+            }
             if (!states_.empty()) {
                 std::cout << "-----\n";
             }
@@ -0,0 +1,509 @@
+#include "downloader/shard.h"
+
+#include "downloader/sha256.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+
+namespace downloader {
+
+namespace {
+
+constexpr std::size_t kReadChunk = 64 * 1024;
+// A beats file slot: a zero-padded decimal counter and a newline.
+constexpr std::size_t kBeatDigits = 20;
+constexpr std::size_t kBeatSlotSize = kBeatDigits + 1;
+
+std::runtime_error make_log_error(const std::string& prefix) {
+    return std::runtime_error(prefix + ": " + std::strerror(errno));
+}
+
+// Exclusive fcntl lock on the whole claim log. fcntl locks are honoured over
+// NFS, and taking one makes the client revalidate its cached view of the
+// file, so every holder sees what the previous one appended.
+class FileLock {
+public:
+    explicit FileLock(int fd) : fd_(fd) {
+        if (!set(F_WRLCK)) {
+            throw make_log_error("could not lock the claim log");
+        }
+    }
+    ~FileLock() { set(F_UNLCK); }
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+private:
+    bool set(short type) {
+        struct flock lock{};
+        lock.l_type = type;
+        lock.l_whence = SEEK_SET;
+        while (::fcntl(fd_, F_SETLKW, &lock) != 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int fd_;
+};
+
+void pwrite_exact(int fd, const char* data, std::size_t size, std::int64_t offset, const std::string& path) {
+    std::size_t written = 0;
+    while (written < size) {
+        const ssize_t rc = ::pwrite(fd, data + written, size - written, offset + static_cast<std::int64_t>(written));
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw make_log_error("write failed for " + path);
+        }
+        written += static_cast<std::size_t>(rc);
+    }
+}
+
+// Error messages end a record, so they must stay on one line.
+std::string single_line(std::string text) {
+    std::replace(text.begin(), text.end(), '\n', ' ');
+    std::replace(text.begin(), text.end(), '\r', ' ');
+    return text;
+}
+
+}  // namespace
+
+std::vector<ManifestEntry> load_manifest(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("could not open manifest " + path);
+    }
+    std::vector<ManifestEntry> entries;
+    std::string line;
+    for (std::size_t number = 1; std::getline(in, line); ++number) {
+        std::istringstream fields(line);
+        ManifestEntry entry;
+        if (!(fields >> entry.url) || entry.url.starts_with('#')) {
+            continue;
+        }
+        std::string extra;
+        if (!(fields >> entry.output_path) || fields >> extra) {
+            throw std::runtime_error(path + ":" + std::to_string(number) + ": expected \"<url> <output>\"");
+        }
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+std::string manifest_digest(const std::vector<DownloadRequest>& jobs) {
+    Sha256 hash;
+    for (const auto& job : jobs) {
+        const std::string line = job.url + ' ' + job.output_path + '\n';
+        hash.update(line.data(), line.size());
+    }
+    return Sha256::to_hex(hash.finish());
+}
+
+std::string default_worker_id() {
+    std::array<char, 256> host{};
+    if (::gethostname(host.data(), host.size() - 1) != 0) {
+        std::strcpy(host.data(), "localhost");
+    }
+    return std::string(host.data()) + ":" + std::to_string(::getpid());
+}
+
+ClaimLog::ClaimLog(const std::string& path,
+                   std::string worker,
+                   const std::string& manifest,
+                   std::size_t job_count,
+                   std::chrono::milliseconds lease)
+    : path_(path), worker_(std::move(worker)), lease_(lease), jobs_(job_count) {
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd_ < 0) {
+        throw make_log_error("open failed for " + path_);
+    }
+    // Not O_APPEND: slots are rewritten in place.
+    const std::string beats_path = path_ + ".beats";
+    beats_fd_ = ::open(beats_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (beats_fd_ < 0) {
+        const auto error = make_log_error("open failed for " + beats_path);
+        ::close(fd_);
+        throw error;
+    }
+
+    try {
+        const std::string header = "manifest " + manifest + ' ' + std::to_string(job_count);
+        FileLock lock(fd_);
+        catch_up();
+        if (read_offset_ == 0) {
+            // A new log: counters left over from an earlier run mean nothing.
+            if (::ftruncate(beats_fd_, 0) != 0) {
+                throw make_log_error("ftruncate failed for " + beats_path);
+            }
+            append(header);
+        } else if (header_ != header) {
+            throw std::runtime_error(path_ + " was written for a different manifest; move it away to start over");
+        }
+        append("join " + worker_);
+        write_beat();
+    } catch (...) {
+        ::close(beats_fd_);
+        ::close(fd_);
+        throw;
+    }
+}
+
+ClaimLog::~ClaimLog() {
+    ::close(beats_fd_);
+    ::close(fd_);
+}
+
+std::optional<std::size_t> ClaimLog::claim() {
+    std::scoped_lock guard(mutex_);
+    FileLock lock(fd_);
+    catch_up();
+    const auto now = std::chrono::steady_clock::now();
+    read_beats(now);
+    for (std::size_t job = 0; job < jobs_.size(); ++job) {
+        const ShardJob& entry = jobs_[job];
+        const bool free = entry.state == ShardJob::State::Open ||
+                          (entry.state == ShardJob::State::Claimed && !lease_live(entry, now));
+        if (free) {
+            append("claim " + std::to_string(job) + ' ' + worker_);
+            held_.push_back(job);
+            return job;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<std::size_t> ClaimLog::heartbeat() {
+    std::scoped_lock guard(mutex_);
+    FileLock lock(fd_);
+    catch_up();
+    write_beat();
+
+    std::vector<std::size_t> lost;
+    std::erase_if(held_, [this, &lost](std::size_t job) {
+        const ShardJob& entry = jobs_[job];
+        if (entry.state == ShardJob::State::Claimed && entry.worker == worker_) {
+            return false;
+        }
+        lost.push_back(job);
+        return true;
+    });
+    return lost;
+}
+
+bool ClaimLog::finish(std::size_t job, const DownloadResult& result) {
+    std::scoped_lock guard(mutex_);
+    std::erase(held_, job);
+    FileLock lock(fd_);
+    catch_up();
+    const ShardJob& entry = jobs_[job];
+    if (entry.state != ShardJob::State::Claimed || entry.worker != worker_) {
+        return false;
+    }
+
+    if (result.status == DownloadStatus::Cancelled) {
+        append("release " + std::to_string(job) + ' ' + worker_);
+        return true;
+    }
+    std::ostringstream record;
+    record << "done " << job << ' ' << worker_ << ' ' << static_cast<int>(result.status) << ' ' << result.bytes
+           << ' ' << result.elapsed.count() << ' ' << result.http_status << ' ' << (result.up_to_date ? 1 : 0)
+           << ' ' << single_line(result.error_message);
+    append(record.str());
+    return true;
+}
+
+bool ClaimLog::settled() {
+    std::scoped_lock guard(mutex_);
+    {
+        FileLock lock(fd_);
+        catch_up();
+    }
+    return std::all_of(jobs_.begin(), jobs_.end(),
+                       [](const ShardJob& job) { return job.state == ShardJob::State::Done; });
+}
+
+std::vector<ShardJob> ClaimLog::jobs() {
+    std::scoped_lock guard(mutex_);
+    {
+        FileLock lock(fd_);
+        catch_up();
+    }
+    return jobs_;
+}
+
+void ClaimLog::catch_up() {
+    const auto now = std::chrono::steady_clock::now();
+    std::string chunk(kReadChunk, '\0');
+    while (true) {
+        const ssize_t got = ::pread(fd_, chunk.data(), chunk.size(), read_offset_);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw make_log_error("read failed for " + path_);
+        }
+        if (got == 0) {
+            break;
+        }
+        read_offset_ += got;
+        partial_.append(chunk.data(), static_cast<std::size_t>(got));
+
+        std::size_t start = 0;
+        for (std::size_t end; (end = partial_.find('\n', start)) != std::string::npos; start = end + 1) {
+            apply(partial_.substr(start, end - start), now);
+        }
+        partial_.erase(0, start);
+    }
+}
+
+void ClaimLog::apply(const std::string& line, SteadyTime now) {
+    std::istringstream fields(line);
+    std::string op;
+    std::string worker;
+    if (!(fields >> op)) {
+        return;
+    }
+    if (op == "manifest") {
+        if (header_.empty()) {
+            header_ = line;
+        }
+        return;
+    }
+    if (op == "join") {
+        if (fields >> worker) {
+            // Slots are numbered in log order, so every reader agrees on them.
+            if (worker == worker_) {
+                own_slot_ = slot_workers_.size();
+            }
+            last_seen_[worker] = now;
+            slot_workers_.push_back(std::move(worker));
+            slot_beats_.push_back(0);
+        }
+        return;
+    }
+
+    std::size_t job = 0;
+    if (!(fields >> job >> worker) || job >= jobs_.size()) {
+        return;
+    }
+    last_seen_[worker] = now;
+    ShardJob& entry = jobs_[job];
+    const bool holder = entry.state == ShardJob::State::Claimed && entry.worker == worker;
+
+    if (op == "claim") {
+        if (entry.state != ShardJob::State::Done) {
+            entry.state = ShardJob::State::Claimed;
+            entry.worker = worker;
+        }
+    } else if (op == "release") {
+        if (holder) {
+            entry.state = ShardJob::State::Open;
+        }
+    } else if (op == "done") {
+        int status = 0;
+        int up_to_date = 0;
+        ShardJob done;
+        if (!holder ||
+            !(fields >> status >> done.bytes >> done.elapsed_ms >> done.http_status >> up_to_date) ||
+            status < static_cast<int>(DownloadStatus::Pending) || status > static_cast<int>(DownloadStatus::Cancelled)) {
+            return;
+        }
+        std::getline(fields >> std::ws, done.error_message);
+        done.state = ShardJob::State::Done;
+        done.worker = worker;
+        done.status = static_cast<DownloadStatus>(status);
+        done.up_to_date = up_to_date != 0;
+        entry = std::move(done);
+    }
+}
+
+void ClaimLog::append(const std::string& line) {
+    std::string record;
+    if (!partial_.empty()) {
+        // Terminate the torn line so it cannot swallow this record, and drop
+        // it rather than replay a truncated record.
+        record.push_back('\n');
+        partial_.clear();
+    }
+    record += line;
+    record.push_back('\n');
+
+    std::size_t written = 0;
+    while (written < record.size()) {
+        const ssize_t rc = ::write(fd_, record.data() + written, record.size() - written);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw make_log_error("write failed for " + path_);
+        }
+        written += static_cast<std::size_t>(rc);
+    }
+    // Replays the record itself, so the local view only ever changes by
+    // reading the log.
+    catch_up();
+}
+
+void ClaimLog::write_beat() {
+    if (!own_slot_) {
+        return;
+    }
+    std::array<char, kBeatSlotSize + 1> slot{};
+    std::snprintf(slot.data(), slot.size(), "%0*llu\n", static_cast<int>(kBeatDigits),
+                  static_cast<unsigned long long>(++beats_));
+    // Locked so that a reader, possibly on another NFS client, never sees a
+    // half-written counter.
+    FileLock lock(beats_fd_);
+    pwrite_exact(beats_fd_, slot.data(), kBeatSlotSize, static_cast<std::int64_t>(*own_slot_ * kBeatSlotSize),
+                 path_ + ".beats");
+}
+
+void ClaimLog::read_beats(SteadyTime now) {
+    std::string slots(slot_workers_.size() * kBeatSlotSize, '\0');
+    std::size_t got = 0;
+    {
+        FileLock lock(beats_fd_);
+        while (got < slots.size()) {
+            const ssize_t rc = ::pread(beats_fd_, slots.data() + got, slots.size() - got, static_cast<off_t>(got));
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw make_log_error("read failed for " + path_ + ".beats");
+            }
+            if (rc == 0) {
+                break;
+            }
+            got += static_cast<std::size_t>(rc);
+        }
+    }
+
+    for (std::size_t slot = 0; (slot + 1) * kBeatSlotSize <= got; ++slot) {
+        const char* const begin = slots.data() + slot * kBeatSlotSize;
+        std::uint64_t beats = 0;
+        const auto parsed = std::from_chars(begin, begin + kBeatDigits, beats);
+        if (parsed.ec != std::errc{} || parsed.ptr != begin + kBeatDigits || beats == slot_beats_[slot]) {
+            continue;
+        }
+        slot_beats_[slot] = beats;
+        last_seen_[slot_workers_[slot]] = now;
+    }
+}
+
+bool ClaimLog::lease_live(const ShardJob& job, SteadyTime now) const {
+    if (job.worker == worker_) {
+        return true;
+    }
+    const auto seen = last_seen_.find(job.worker);
+    return seen != last_seen_.end() && now - seen->second < lease_;
+}
+
+ShardWorker::ShardWorker(std::vector<DownloadRequest> jobs,
+                         const std::string& log_path,
+                         std::string worker,
+                         std::chrono::milliseconds lease,
+                         std::size_t worker_count,
+                         PipelineConfig pipeline)
+    : jobs_(std::move(jobs)),
+      log_(log_path, std::move(worker), manifest_digest(jobs_), jobs_.size(), lease),
+      slots_(std::max<std::size_t>(1, worker_count)),
+      manager_(slots_, pipeline) {}
+
+std::vector<std::pair<std::size_t, DownloadResult>> ShardWorker::run(std::stop_token stop_token) {
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::unordered_map<std::size_t, DownloadStatePtr> running;
+    std::uint64_t completions = 0;
+    std::vector<std::pair<std::size_t, DownloadResult>> results;
+    const auto poll_interval = log_.lease() / 3;
+
+    std::jthread heartbeat([&](std::stop_token heartbeat_stop) {
+        std::mutex sleep_mutex;
+        std::condition_variable_any sleep_cv;
+        while (!heartbeat_stop.stop_requested()) {
+            try {
+                for (const std::size_t job : log_.heartbeat()) {
+                    std::scoped_lock lock(mutex);
+                    if (const auto it = running.find(job); it != running.end()) {
+                        it->second->stop_source.request_stop();
+                    }
+                }
+            } catch (const std::exception&) {
+                // Tried again on the next beat; if the log stays unreachable
+                // the leases lapse and other workers take the jobs over.
+            }
+            std::unique_lock lock(sleep_mutex);
+            sleep_cv.wait_for(lock, heartbeat_stop, poll_interval, [] { return false; });
+        }
+    });
+
+    const auto drain = [&]() {
+        std::unique_lock lock(mutex);
+        for (const auto& [job, state] : running) {
+            state->stop_source.request_stop();
+        }
+        cv.wait(lock, [&] { return running.empty(); });
+    };
+
+    try {
+        while (!stop_token.stop_requested()) {
+            {
+                std::unique_lock lock(mutex);
+                if (!cv.wait(lock, stop_token, [&] { return running.size() < slots_; })) {
+                    break;
+                }
+            }
+            if (const auto job = log_.claim()) {
+                std::scoped_lock lock(mutex);
+                running[*job] = manager_.submit(jobs_[*job], [&, job = *job](DownloadResult result) {
+                    try {
+                        if (!log_.finish(job, result)) {
+                            result.error_message = "lease lost to another worker";
+                        }
+                    } catch (const std::exception&) {
+                        // The claim lapses and another worker redoes the job.
+                    }
+                    std::scoped_lock lock(mutex);
+                    running.erase(job);
+                    results.emplace_back(job, std::move(result));
+                    ++completions;
+                    cv.notify_all();
+                });
+                continue;
+            }
+            if (log_.settled()) {
+                break;
+            }
+            // Nothing to claim right now: wait for a slot to free up or for
+            // another worker's lease to run out.
+            std::unique_lock lock(mutex);
+            const std::uint64_t seen = completions;
+            cv.wait_for(lock, stop_token, poll_interval, [&] { return completions != seen; });
+        }
+    } catch (...) {
+        drain();
+        throw;
+    }
+    drain();
+
+    std::sort(results.begin(), results.end(),
+              [](const auto& left, const auto& right) { return left.first < right.first; });
+    return results;
+}
+
+}  // namespace downloader
@@ -0,0 +1,397 @@
+#include "downloader/simulated_transport.h"
+
+#include "downloader/allocation_counter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string_view>
+#include <thread>
+#include <tuple>
+
+namespace downloader {
+
+namespace {
+
+// Same write size curl uses, so sinks see realistic pieces.
+constexpr std::size_t kMaxWrite = 16 * 1024;
+constexpr auto kPausedPoll = std::chrono::milliseconds(1);
+
+// Hands bytes to the sink the way curl's write callback would, accounted
+// the same way.
+TransferSink::Write deliver(TransferSink& sink, const char* data, std::size_t size) {
+    const AllocationCounter::CallbackScope scope;
+    return sink.write(data, size);
+}
+
+std::uint64_t mix(std::uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+std::uint64_t hash_request(std::string_view url, std::int64_t begin, std::int64_t end) {
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char ch : url) {
+        hash = (hash ^ static_cast<unsigned char>(ch)) * 0x100000001b3ULL;
+    }
+    return mix(mix(hash ^ static_cast<std::uint64_t>(begin)) ^ static_cast<std::uint64_t>(end));
+}
+
+double unit_interval(std::uint64_t value) {
+    return static_cast<double>(value >> 11) * 0x1.0p-53;
+}
+
+std::string_view host_of(std::string_view url) {
+    const auto scheme = url.find("://");
+    const auto start = scheme == std::string_view::npos ? 0 : scheme + 3;
+    const auto end = url.find('/', start);
+    return url.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+}
+
+std::int64_t to_ns(std::chrono::nanoseconds duration) {
+    return duration.count();
+}
+
+}  // namespace
+
+SimulatedTransport::SimulatedTransport(SimulationConfig config)
+    : config_(config), zeros_(kMaxWrite, '\0') {}
+
+void SimulatedTransport::add_resource(const std::string& url, std::int64_t size, bool accept_ranges) {
+    std::scoped_lock lock(mutex_);
+    resources_[url] = Resource{size, accept_ranges};
+}
+
+SimulationStats SimulatedTransport::stats() const {
+    std::scoped_lock lock(mutex_);
+    return stats_;
+}
+
+ProbeResult SimulatedTransport::probe(const std::string& url, std::uint32_t) {
+    ProbeResult result;
+    std::unique_lock lock(mutex_);
+    Connect request{&url};
+    const std::function<bool()> never = []() { return false; };
+    connect(lock, request, never);
+
+    const auto it = resources_.find(url);
+    if (it == resources_.end()) {
+        result.http_status = 404;
+        result.error_message = "HTTP status 404";
+        return result;
+    }
+    release_connection(url);
+    result.ok = true;
+    result.http_status = 200;
+    result.content_length = it->second.size;
+    result.accept_ranges = it->second.accept_ranges;
+    return result;
+}
+
+TransferOutcome SimulatedTransport::fetch(const std::string& url,
+                                          std::optional<ByteRange> range,
+                                          TransferSink& sink,
+                                          std::uint32_t,
+                                          Connection connection) {
+    TransferOutcome outcome;
+    const std::function<bool()> cancelled = [&sink]() { return sink.cancelled(); };
+
+    std::unique_lock lock(mutex_);
+    ++stats_.transfers;
+    Connect request{&url, range ? range->begin : -1, range ? range->end : -1};
+    request.fresh = connection == Connection::Fresh;
+    connect(lock, request, cancelled);
+    if (!request.resolved || sink.cancelled()) {
+        outcome.aborted = true;
+        outcome.error_message = "Callback aborted";
+        return outcome;
+    }
+
+    const auto it = resources_.find(url);
+    if (it == resources_.end()) {
+        outcome.http_status = 404;
+        outcome.error_message = "The requested URL returned error: 404";
+        return outcome;
+    }
+    const Resource resource = it->second;
+    std::int64_t length = resource.size;
+    outcome.http_status = 200;
+    if (range && resource.accept_ranges) {
+        if (range->begin >= resource.size) {
+            outcome.http_status = 416;
+            outcome.error_message = "The requested URL returned error: 416";
+            return outcome;
+        }
+        length = std::min(range->end, resource.size - 1) - range->begin + 1;
+        outcome.http_status = 206;
+    }
+
+    const auto fate_at = static_cast<std::int64_t>(request.fate_point * static_cast<double>(length));
+    const std::int64_t fail_at = request.fate == Fate::Fail ? fate_at : -1;
+    std::int64_t stall_at = request.fate == Fate::Stall ? fate_at : -1;
+
+    lock.unlock();
+    sink.expect_length(length);
+    const bool accepted = sink.accept_status(outcome.http_status);
+    lock.lock();
+    if (!accepted) {
+        // Like curl, a refused response closes its connection.
+        outcome.error_message = "Failure writing output to destination";
+        return outcome;
+    }
+
+    Flow flow;
+    flows_.push_back(&flow);
+    std::int64_t delivered = 0;
+    while (true) {
+        if (delivered == fail_at) {
+            ++stats_.failures;
+            outcome.error_message = "Recv failure: Connection reset by peer";
+            break;
+        }
+        if (delivered == stall_at) {
+            ++stats_.stalls;
+            flow.stalled_until = now_.load() + to_ns(config_.stall_duration);
+            stall_at = -1;
+        }
+        if (delivered == length) {
+            outcome.ok = true;
+            if (!request.fresh) {
+                release_connection(url);
+            }
+            break;
+        }
+
+        std::int64_t target = std::min(delivered + static_cast<std::int64_t>(config_.delivery_size), length);
+        for (const std::int64_t milestone : {fail_at, stall_at}) {
+            if (milestone > delivered) {
+                target = std::min(target, milestone);
+            }
+        }
+        flow.target = target;
+        Waiter waiter;
+        waiter.deadline = kForever;
+        waiter.ready = &cancelled;
+        waiter.flow = &flow;
+        block(lock, waiter);
+        if (sink.cancelled()) {
+            outcome.aborted = true;
+            outcome.error_message = "Callback aborted";
+            break;
+        }
+
+        const std::int64_t ready = std::min(static_cast<std::int64_t>(flow.received), target);
+        lock.unlock();
+        std::int64_t handed = delivered;
+        bool rejected = false;
+        while (handed < ready && !rejected) {
+            const auto piece = static_cast<std::size_t>(std::min<std::int64_t>(ready - handed, kMaxWrite));
+            switch (deliver(sink, zeros_.data(), piece)) {
+                case TransferSink::Write::Accepted:
+                    handed += static_cast<std::int64_t>(piece);
+                    break;
+                case TransferSink::Write::Paused:
+                    // The disk is not part of the model: the thread stays
+                    // active, so virtual time stands still until it resumes.
+                    while (!sink.can_resume() && !sink.cancelled()) {
+                        std::this_thread::sleep_for(kPausedPoll);
+                    }
+                    rejected = sink.cancelled();
+                    break;
+                case TransferSink::Write::Rejected:
+                    rejected = true;
+                    break;
+            }
+        }
+        lock.lock();
+        stats_.bytes += static_cast<std::uint64_t>(handed - delivered);
+        delivered = handed;
+        if (rejected) {
+            outcome.aborted = sink.cancelled();
+            outcome.error_message = "Failure writing output to destination";
+            break;
+        }
+    }
+    flows_.erase(std::find(flows_.begin(), flows_.end(), &flow));
+    return outcome;
+}
+
+SimulatedTransport::time_point SimulatedTransport::now() const {
+    return time_point(std::chrono::nanoseconds(now_.load()));
+}
+
+void SimulatedTransport::wait_until(time_point deadline, const std::function<bool()>& ready) {
+    std::unique_lock lock(mutex_);
+    if (ready()) {
+        return;
+    }
+    Waiter waiter;
+    waiter.deadline = to_ns(deadline.time_since_epoch());
+    waiter.ready = &ready;
+    block(lock, waiter);
+}
+
+void SimulatedTransport::notify() {
+    std::scoped_lock lock(mutex_);
+    // Waking a waiter makes it active before this thread can go idle, so
+    // time cannot slip past the event that woke it.
+    for (std::size_t i = 0; i < waiters_.size();) {
+        Waiter& waiter = *waiters_[i];
+        if (waiter.ready != nullptr && (*waiter.ready)()) {
+            wake(waiter);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void SimulatedTransport::begin_activity() {
+    std::scoped_lock lock(mutex_);
+    ++runnable_;
+}
+
+void SimulatedTransport::end_activity() {
+    std::scoped_lock lock(mutex_);
+    --runnable_;
+    advance();
+}
+
+void SimulatedTransport::connect(std::unique_lock<std::mutex>& lock,
+                                 Connect& request,
+                                 const std::function<bool()>& cancelled) {
+    Waiter waiter;
+    waiter.deadline = kForever;
+    waiter.ready = &cancelled;
+    waiter.connect = &request;
+    block(lock, waiter);
+}
+
+void SimulatedTransport::release_connection(const std::string& url) {
+    ++idle_connections_[std::string(host_of(url))];
+}
+
+void SimulatedTransport::block(std::unique_lock<std::mutex>& lock, Waiter& waiter) {
+    waiters_.push_back(&waiter);
+    --runnable_;
+    advance();
+    waiter.cv.wait(lock, [&waiter]() { return waiter.woken; });
+}
+
+void SimulatedTransport::wake(Waiter& waiter) {
+    waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &waiter));
+    waiter.woken = true;
+    ++runnable_;
+    waiter.cv.notify_one();
+}
+
+void SimulatedTransport::advance() {
+    while (runnable_ == 0 && !waiters_.empty()) {
+        resolve_connects();
+
+        const double rate = flow_rate();
+        std::int64_t next = kForever;
+        for (const Waiter* waiter : waiters_) {
+            next = std::min(next, next_event(*waiter, rate));
+        }
+        if (next == kForever) {
+            return;
+        }
+
+        const std::int64_t now = now_.load();
+        if (next > now) {
+            const double moved = rate * static_cast<double>(next - now) / 1e9;
+            for (Flow* flow : flows_) {
+                if (flow->stalled_until < 0) {
+                    flow->received = std::min(flow->received + moved, static_cast<double>(flow->target));
+                }
+            }
+            now_ = next;
+        }
+
+        for (std::size_t i = 0; i < waiters_.size();) {
+            Waiter& waiter = *waiters_[i];
+            Flow* flow = waiter.flow;
+            if (flow != nullptr && flow->stalled_until >= 0 && flow->stalled_until <= next) {
+                flow->stalled_until = -1;
+            }
+            const bool due = waiter.deadline <= next ||
+                             (flow != nullptr && flow->stalled_until < 0 &&
+                              flow->received >= static_cast<double>(flow->target)) ||
+                             (waiter.ready != nullptr && (*waiter.ready)());
+            if (due) {
+                wake(waiter);
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+void SimulatedTransport::resolve_connects() {
+    std::vector<Waiter*> pending;
+    for (Waiter* waiter : waiters_) {
+        if (waiter->connect != nullptr && !waiter->connect->resolved) {
+            pending.push_back(waiter);
+        }
+    }
+    if (pending.empty()) {
+        return;
+    }
+    std::sort(pending.begin(), pending.end(), [](const Waiter* a, const Waiter* b) {
+        return std::tie(*a->connect->url, a->connect->begin, a->connect->end) <
+               std::tie(*b->connect->url, b->connect->begin, b->connect->end);
+    });
+
+    const std::int64_t rtt = to_ns(config_.rtt);
+    for (Waiter* waiter : pending) {
+        Connect& request = *waiter->connect;
+        const std::uint64_t key = hash_request(*request.url, request.begin, request.end);
+        const std::uint64_t roll = mix(key ^ mix(config_.seed + request_counts_[key]++));
+        const double chance = unit_interval(roll);
+        request.fate_point = unit_interval(mix(roll));
+        if (chance < config_.failure_rate) {
+            request.fate = Fate::Fail;
+        } else if (chance < config_.failure_rate + config_.stall_rate) {
+            request.fate = Fate::Stall;
+        }
+
+        auto& idle = idle_connections_[std::string(host_of(*request.url))];
+        request.reused = !request.fresh && idle > 0;
+        if (request.reused) {
+            --idle;
+        } else {
+            ++stats_.connections_opened;
+        }
+        request.resolved = true;
+        waiter->deadline = now_.load() + rtt * (request.reused ? 1 : 1 + config_.connect_round_trips);
+    }
+}
+
+double SimulatedTransport::flow_rate() const {
+    const auto active = std::count_if(flows_.begin(), flows_.end(),
+                                      [](const Flow* flow) { return flow->stalled_until < 0; });
+    if (active == 0) {
+        return config_.connection_bandwidth;
+    }
+    return std::min(config_.connection_bandwidth, config_.link_capacity / static_cast<double>(active));
+}
+
+std::int64_t SimulatedTransport::next_event(const Waiter& waiter, double rate) const {
+    std::int64_t next = waiter.deadline;
+    const Flow* flow = waiter.flow;
+    if (flow == nullptr) {
+        return next;
+    }
+    if (flow->stalled_until >= 0) {
+        return std::min(next, flow->stalled_until);
+    }
+    const double missing = static_cast<double>(flow->target) - flow->received;
+    if (missing <= 0.0) {
+        return now_.load();
+    }
+    const auto wait = static_cast<std::int64_t>(std::ceil(missing / rate * 1e9));
+    return std::min(next, now_.load() + std::max<std::int64_t>(1, wait));
+}
+
+}  // namespace downloader
@@ -0,0 +1,42 @@
+#include "downloader/sync.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace downloader {
+
+SyncCheck check_local_file(const std::string& path, const ProbeResult& probe, SyncMode mode) {
+    if (mode == SyncMode::Off || probe.content_length < 0) {
+        return SyncCheck::Fetch;
+    }
+
+    struct stat info {};
+    if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode) ||
+        static_cast<std::int64_t>(info.st_size) != probe.content_length) {
+        return SyncCheck::Fetch;
+    }
+
+    // Last-Modified has one-second resolution and stamp_modification_time()
+    // writes whole seconds, so a file touched since then has a fractional part.
+    if (probe.last_modified >= 0 && static_cast<std::int64_t>(info.st_mtim.tv_sec) == probe.last_modified &&
+        info.st_mtim.tv_nsec == 0) {
+        return SyncCheck::UpToDate;
+    }
+    if (mode == SyncMode::Checksum && !probe.sha256.empty()) {
+        return SyncCheck::CompareDigest;
+    }
+    return SyncCheck::Fetch;
+}
+
+bool stamp_modification_time(const std::string& path, std::int64_t seconds) {
+    if (seconds < 0) {
+        return false;
+    }
+    struct timespec times[2] {};
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = static_cast<time_t>(seconds);
+    times[1].tv_nsec = 0;
+    return ::utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+}
+
+}  // namespace downloader
@@ -1,14 +1,24 @@
 #include "downloader/thread_pool.h"
 
+#include "downloader/cpu_profiler.h"
+
+#include <algorithm>
+
 namespace downloader {
 
-ThreadPool::ThreadPool(std::size_t worker_count) {
+ThreadPool::ThreadPool(std::size_t worker_count, Clock* clock, std::string name) : clock_(clock) {
     if (worker_count == 0) {
         worker_count = 1;
     }
     workers_.reserve(worker_count);
     for (std::size_t i = 0; i < worker_count; ++i) {
-        workers_.emplace_back([this](std::stop_token stop_token) { worker_loop(stop_token); });
+        if (clock_ != nullptr) {
+            clock_->begin_activity();
+        }
+        workers_.emplace_back([this, label = name + ' ' + std::to_string(i)](std::stop_token stop_token) {
+            CpuProfiler::set_thread_label(label);
+            worker_loop(stop_token);
+        });
     }
 }
 
@@ -31,13 +41,40 @@ void ThreadPool::request_stop() {
     cv_.notify_all();
 }
 
+bool ThreadPool::is_worker_thread() const {
+    const auto self = std::this_thread::get_id();
+    return std::any_of(workers_.begin(), workers_.end(),
+                       [self](const std::jthread& worker) { return worker.get_id() == self; });
+}
+
 void ThreadPool::worker_loop(std::stop_token stop_token) {
+    // Starts out active: the constructor began activity for every worker.
+    bool active = true;
     while (true) {
         std::function<void()> job;
         {
             std::unique_lock lock(mutex_);
-            cv_.wait(lock, stop_token, [this]() { return stopping_ || !jobs_.empty(); });
+            while (jobs_.empty() && !stopping_) {
+                if (active && clock_ != nullptr) {
+                    clock_->end_activity();
+                }
+                active = false;
+                ++idle_;
+                const bool woken = cv_.wait(lock, stop_token, [this]() { return stopping_ || wakeups_ > 0; });
+                --idle_;
+                if (!woken) {
+                    return;
+                }
+                if (wakeups_ > 0) {
+                    // Activity was begun on this worker's behalf by submit().
+                    --wakeups_;
+                    active = true;
+                }
+            }
             if ((stopping_ && jobs_.empty()) || stop_token.stop_requested()) {
+                if (active && clock_ != nullptr) {
+                    clock_->end_activity();
+                }
                 return;
             }
             job = std::move(jobs_.front());
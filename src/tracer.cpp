@@ -0,0 +1,228 @@
+#include "downloader/tracer.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace downloader {
+
+namespace {
+
+struct TraceRecord {
+    std::uint64_t timestamp_ns{0};
+    std::int64_t arg0{0};
+    std::int64_t arg1{0};
+    std::uint32_t track{0};
+    TraceEvent event{TraceEvent::ProbeBegin};
+};
+
+// Single-producer ring; the oldest records are overwritten when it wraps.
+// A ring outlives its thread and is handed to the next new thread, so the
+// number of rings is bounded by the peak number of tracing threads.
+struct TraceRing {
+    static constexpr std::size_t kCapacity = 8192;
+
+    void push(const TraceRecord& record) {
+        const std::uint64_t head = head_.load(std::memory_order_relaxed);
+        records_[head % kCapacity] = record;
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    void collect(std::vector<TraceRecord>& out) const {
+        const std::uint64_t head = head_.load(std::memory_order_acquire);
+        const std::uint64_t first = head > kCapacity ? head - kCapacity : 0;
+        for (std::uint64_t i = first; i < head; ++i) {
+            out.push_back(records_[i % kCapacity]);
+        }
+    }
+
+    std::array<TraceRecord, kCapacity> records_{};
+    std::atomic<std::uint64_t> head_{0};
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    std::vector<TraceRing*> idle_rings;
+    std::vector<std::string> track_names;
+};
+
+Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+class RingLease {
+public:
+    ~RingLease() {
+        if (ring_ != nullptr) {
+            auto& reg = registry();
+            std::scoped_lock lock(reg.mutex);
+            reg.idle_rings.push_back(ring_);
+        }
+    }
+
+    TraceRing& get() {
+        if (ring_ == nullptr) {
+            auto& reg = registry();
+            std::scoped_lock lock(reg.mutex);
+            if (!reg.idle_rings.empty()) {
+                ring_ = reg.idle_rings.back();
+                reg.idle_rings.pop_back();
+            } else {
+                reg.rings.push_back(std::make_unique<TraceRing>());
+                ring_ = reg.rings.back().get();
+            }
+        }
+        return *ring_;
+    }
+
+private:
+    TraceRing* ring_{nullptr};
+};
+
+thread_local RingLease t_ring;
+
+const char* event_name(TraceEvent event) {
+    switch (event) {
+        case TraceEvent::ProbeBegin:
+        case TraceEvent::ProbeEnd: return "probe";
+        case TraceEvent::TransferBegin:
+        case TraceEvent::TransferEnd: return "transfer";
+        case TraceEvent::Connected: return "connect";
+        case TraceEvent::TlsConnected: return "tls";
+        case TraceEvent::FirstByte: return "first byte";
+        case TraceEvent::WriteBatch: return "write";
+        case TraceEvent::Paused: return "paused";
+        case TraceEvent::Hedge: return "hedge";
+    }
+    return "unknown";
+}
+
+void write_json_string(std::ostream& out, const std::string& value) {
+    out << '"';
+    for (const char ch : value) {
+        switch (ch) {
+            case '"': out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                    out << escaped;
+                } else {
+                    out << ch;
+                }
+        }
+    }
+    out << '"';
+}
+
+}  // namespace
+
+std::uint64_t Tracer::now_ns() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+std::uint32_t Tracer::new_track(std::string name) {
+    if (!enabled()) {
+        return 0;
+    }
+    auto& reg = registry();
+    std::scoped_lock lock(reg.mutex);
+    reg.track_names.push_back(std::move(name));
+    return static_cast<std::uint32_t>(reg.track_names.size());
+}
+
+void Tracer::record(std::uint32_t track, TraceEvent event, std::int64_t arg0, std::int64_t arg1) {
+    record_at(now_ns(), track, event, arg0, arg1);
+}
+
+void Tracer::record_at(std::uint64_t timestamp_ns,
+                       std::uint32_t track,
+                       TraceEvent event,
+                       std::int64_t arg0,
+                       std::int64_t arg1) {
+    if (!enabled() || track == 0) {
+        return;
+    }
+    t_ring.get().push(TraceRecord{timestamp_ns, arg0, arg1, track, event});
+}
+
+void Tracer::write_chrome_trace(std::ostream& out) {
+    auto& reg = registry();
+    std::vector<TraceRecord> records;
+    std::vector<std::string> track_names;
+    {
+        std::scoped_lock lock(reg.mutex);
+        for (const auto& ring : reg.rings) {
+            ring->collect(records);
+        }
+        track_names = reg.track_names;
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) { return a.timestamp_ns < b.timestamp_ns; });
+    const std::uint64_t origin = records.empty() ? 0 : records.front().timestamp_ns;
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    const auto separator = [&out, &first]() {
+        out << (first ? "" : ",\n");
+        first = false;
+    };
+
+    for (std::size_t i = 0; i < track_names.size(); ++i) {
+        separator();
+        out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << i + 1 << ",\"args\":{\"name\":";
+        write_json_string(out, track_names[i]);
+        out << "}}";
+    }
+
+    for (const auto& record : records) {
+        separator();
+        // Fixed-point microseconds: a double at the stream's default
+        // precision loses resolution once a trace runs past a second.
+        const std::uint64_t elapsed_ns = record.timestamp_ns - origin;
+        char ts_us[32];
+        std::snprintf(ts_us, sizeof(ts_us), "%llu.%03llu", static_cast<unsigned long long>(elapsed_ns / 1000),
+                      static_cast<unsigned long long>(elapsed_ns % 1000));
+        out << "{\"name\":\"" << event_name(record.event) << "\",\"pid\":1,\"tid\":" << record.track
+            << ",\"ts\":" << ts_us;
+        switch (record.event) {
+            case TraceEvent::ProbeBegin:
+                out << ",\"ph\":\"B\"}";
+                break;
+            case TraceEvent::TransferBegin:
+                out << ",\"ph\":\"B\",\"args\":{\"offset\":" << record.arg0 << ",\"end\":" << record.arg1 << "}}";
+                break;
+            case TraceEvent::ProbeEnd:
+            case TraceEvent::TransferEnd:
+                out << ",\"ph\":\"E\",\"args\":{\"ok\":" << (record.arg0 != 0 ? "true" : "false")
+                    << ",\"http_status\":" << record.arg1 << "}}";
+                break;
+            case TraceEvent::Connected:
+                out << ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"reused\":" << (record.arg0 != 0 ? "true" : "false")
+                    << "}}";
+                break;
+            case TraceEvent::WriteBatch:
+                out << ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"offset\":" << record.arg0 << ",\"bytes\":" << record.arg1
+                    << "}}";
+                break;
+            case TraceEvent::Hedge:
+                out << ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"resume_offset\":" << record.arg0 << "}}";
+                break;
+            default:
+                out << ",\"ph\":\"i\",\"s\":\"t\"}";
+                break;
+        }
+    }
+    out << "\n]}\n";
+}
+
+}  // namespace downloader
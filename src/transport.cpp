@@ -0,0 +1,78 @@
+#include "downloader/transport.h"
+
+#include <thread>
+#include <utility>
+
+namespace downloader {
+
+namespace {
+
+// Feeds one ranged fetch() into a RangeSetSink at the range's offset.
+class OffsetSink final : public TransferSink {
+public:
+    OffsetSink(RangeSetSink& target, std::int64_t offset) : target_(target), offset_(offset) {}
+
+    Write write(const char* data, std::size_t size) override {
+        if (!target_.write_at(offset_, data, size)) {
+            return Write::Rejected;
+        }
+        offset_ += static_cast<std::int64_t>(size);
+        return Write::Accepted;
+    }
+    bool can_resume() const override { return true; }
+    bool cancelled() const override { return target_.cancelled(); }
+
+private:
+    RangeSetSink& target_;
+    std::int64_t offset_;
+};
+
+}  // namespace
+
+TransferOutcome Transport::fetch_ranges(const std::string& url,
+                                        std::span<const ByteRange> ranges,
+                                        RangeSetSink& sink,
+                                        std::uint32_t trace_track) {
+    TransferOutcome outcome;
+    outcome.ok = true;
+    for (const ByteRange& range : ranges) {
+        OffsetSink part(sink, range.begin);
+        outcome = fetch(url, range, part, trace_track, Connection::Reuse);
+        if (!outcome.ok) {
+            break;
+        }
+        if (outcome.http_status != 206) {
+            outcome.ok = false;
+            outcome.error_message = "range request returned unexpected HTTP status";
+            break;
+        }
+    }
+    return outcome;
+}
+
+// The thread counts as activity for a simulated clock until its result is in.
+// Activity ends before `done` runs: once it has, the transport may be gone.
+void Transport::start_probe(const std::string& url, std::uint32_t trace_track, ProbeCallback done) {
+    clock().begin_activity();
+    std::thread([this, url, trace_track, done = std::move(done)]() {
+        ProbeResult result = probe(url, trace_track);
+        clock().end_activity();
+        done(std::move(result));
+    }).detach();
+}
+
+void Transport::start_fetch(const std::string& url,
+                            std::optional<ByteRange> range,
+                            TransferSink& sink,
+                            std::uint32_t trace_track,
+                            Connection connection,
+                            FetchCallback done) {
+    clock().begin_activity();
+    std::thread([this, url, range, &sink, trace_track, connection, done = std::move(done)]() {
+        TransferOutcome outcome = fetch(url, range, sink, trace_track, connection);
+        clock().end_activity();
+        done(std::move(outcome));
+    }).detach();
+}
+
+}  // namespace downloader
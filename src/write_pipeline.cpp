@@ -0,0 +1,223 @@
+#include "downloader/write_pipeline.h"
+
+#include "downloader/cpu_profiler.h"
+#include "downloader/file_writer.h"
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <utility>
+
+namespace downloader {
+
+void WritePipeline::Tracker::wait() {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this]() { return pending_ == 0; });
+}
+
+std::string WritePipeline::Tracker::error() const {
+    std::scoped_lock lock(mutex_);
+    return error_;
+}
+
+void WritePipeline::Tracker::begin() {
+    std::scoped_lock lock(mutex_);
+    ++pending_;
+}
+
+void WritePipeline::Tracker::end(std::string error) {
+    // Notify under the lock: the waiter owns the tracker and may destroy it
+    // as soon as it sees pending_ reach zero.
+    std::scoped_lock lock(mutex_);
+    if (!error.empty() && error_.empty()) {
+        error_ = std::move(error);
+        failed_ = true;
+    }
+    --pending_;
+    cv_.notify_all();
+}
+
+WritePipeline::WritePipeline(PipelineConfig config)
+    // A curl write callback never delivers more than CURL_MAX_WRITE_SIZE, so
+    // one spare buffer is always enough to accept a whole callback.
+    : buffer_size_(std::max<std::size_t>(config.buffer_size, CURL_MAX_WRITE_SIZE)) {
+    const std::size_t count = std::max<std::size_t>(2, config.buffer_count);
+    slab_ = std::make_unique<std::byte[]>(buffer_size_ * count);
+    buffers_.resize(count);
+    free_.reserve(count);
+    jobs_.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        buffers_[i].data = slab_.get() + i * buffer_size_;
+        free_.push_back(&buffers_[i]);
+    }
+
+    const std::size_t writer_count = std::max<std::size_t>(1, config.writer_threads);
+    writers_.reserve(writer_count);
+    for (std::size_t i = 0; i < writer_count; ++i) {
+        writers_.emplace_back([this, i](std::stop_token stop_token) {
+            CpuProfiler::set_thread_label("disk writer " + std::to_string(i));
+            writer_loop(stop_token);
+        });
+    }
+}
+
+WritePipeline::~WritePipeline() {
+    for (auto& writer : writers_) {
+        writer.request_stop();
+    }
+    queue_cv_.notify_all();
+    writers_.clear();
+}
+
+bool WritePipeline::has_free_buffer() const {
+    std::scoped_lock lock(pool_mutex_);
+    return !free_.empty();
+}
+
+WritePipeline::Buffer* WritePipeline::try_acquire() {
+    std::scoped_lock lock(pool_mutex_);
+    if (free_.empty()) {
+        return nullptr;
+    }
+    Buffer* buffer = free_.back();
+    free_.pop_back();
+    buffer->size = 0;
+    peak_in_use_ = std::max(peak_in_use_, buffers_.size() - free_.size());
+    return buffer;
+}
+
+void WritePipeline::release(Buffer* buffer) {
+    std::scoped_lock lock(pool_mutex_);
+    free_.push_back(buffer);
+}
+
+void WritePipeline::submit(const FileWriter& file, std::int64_t offset, Buffer* buffer, Tracker& tracker) {
+    tracker.begin();
+    {
+        std::scoped_lock lock(queue_mutex_);
+        jobs_[(jobs_head_ + jobs_size_) % jobs_.size()] = WriteJob{&file, offset, buffer, &tracker};
+        ++jobs_size_;
+    }
+    queue_cv_.notify_one();
+}
+
+PipelineStats WritePipeline::stats() const {
+    PipelineStats stats;
+    stats.buffer_size = buffer_size_;
+    stats.buffer_count = buffers_.size();
+    {
+        std::scoped_lock lock(pool_mutex_);
+        stats.buffers_in_use = buffers_.size() - free_.size();
+        stats.peak_buffers_in_use = peak_in_use_;
+    }
+    stats.pauses = pauses_.load(std::memory_order_relaxed);
+    stats.bytes_written = bytes_written_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void WritePipeline::writer_loop(std::stop_token stop_token) {
+    while (true) {
+        WriteJob job;
+        {
+            std::unique_lock lock(queue_mutex_);
+            queue_cv_.wait(lock, stop_token, [this]() { return jobs_size_ > 0; });
+            if (jobs_size_ == 0) {
+                return;
+            }
+            job = jobs_[jobs_head_];
+            jobs_head_ = (jobs_head_ + 1) % jobs_.size();
+            --jobs_size_;
+        }
+
+        std::string error;
+        try {
+            CpuProfiler::Scope cpu(CpuPhase::DiskWrite, job.tracker->account_);
+            const std::size_t written = job.file->pwrite_all(job.buffer->data, job.buffer->size, job.offset);
+            bytes_written_.fetch_add(written, std::memory_order_relaxed);
+        } catch (const std::exception& ex) {
+            error = ex.what();
+        }
+
+        release(job.buffer);
+        job.tracker->end(std::move(error));
+    }
+}
+
+WriteStream::WriteStream(WritePipeline& pipeline, const FileWriter& file, std::int64_t offset, CpuAccount* account)
+    : pipeline_(pipeline), file_(file), current_offset_(offset) {
+    tracker_.account_ = account;
+}
+
+WriteStream::~WriteStream() {
+    if (current_ != nullptr) {
+        pipeline_.release(current_);
+    }
+    tracker_.wait();
+}
+
+WriteStream::Status WriteStream::append(const char* data, std::size_t size) {
+    if (tracker_.failed()) {
+        return Status::WriteFailed;
+    }
+    if (size == 0) {
+        return Status::Accepted;
+    }
+
+    const std::size_t capacity = pipeline_.buffer_size();
+    const std::size_t space = current_ != nullptr ? capacity - current_->size : 0;
+    WritePipeline::Buffer* spare = nullptr;
+    if (size > space) {
+        spare = pipeline_.try_acquire();
+        if (spare == nullptr) {
+            // Hand over the partial buffer too, so a paused transfer holds no
+            // pool memory and other transfers can always make progress.
+            if (current_ != nullptr) {
+                submit_current();
+            }
+            pipeline_.record_pause();
+            return Status::PoolExhausted;
+        }
+    }
+
+    const std::size_t head = std::min(size, space);
+    if (head > 0) {
+        std::memcpy(current_->data + current_->size, data, head);
+        current_->size += head;
+    }
+    if (spare != nullptr) {
+        if (current_ != nullptr) {
+            submit_current();
+        }
+        current_ = spare;
+        std::memcpy(current_->data, data + head, size - head);
+        current_->size = size - head;
+    }
+    if (current_->size == capacity) {
+        submit_current();
+    }
+    return Status::Accepted;
+}
+
+bool WriteStream::finish(std::string& error) {
+    if (current_ != nullptr && current_->size > 0) {
+        submit_current();
+    }
+    tracker_.wait();
+    if (tracker_.failed()) {
+        error = tracker_.error();
+        return false;
+    }
+    return true;
+}
+
+void WriteStream::submit_current() {
+    const auto size = static_cast<std::int64_t>(current_->size);
+    pipeline_.submit(file_, current_offset_, current_, tracker_);
+    current_offset_ += size;
+    current_ = nullptr;
+}
+
+}  // namespace downloader
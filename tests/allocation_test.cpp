@@ -0,0 +1,67 @@
+// Built against a copy of the library with DOWNLOADER_COUNT_ALLOCATIONS, so
+// every transfer callback is counted.
+
+#include "downloader/allocation_counter.h"
+#include "downloader/download_manager.h"
+#include "downloader/simulated_transport.h"
+
+#include "test_support.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace {
+
+using namespace downloader;
+
+static_assert(AllocationCounter::kEnabled, "allocation_test needs DOWNLOADER_COUNT_ALLOCATIONS");
+
+// Runs whole and split downloads into `target` over the simulated network
+// and returns the callback totals they added.
+CallbackAllocationStats run_downloads(DownloadTarget target, const std::string& label, const test::TempDir& dir) {
+    SimulationConfig network;
+    // Small deliveries mean many callbacks per transfer.
+    network.delivery_size = 64 * 1024;
+    auto transport = std::make_shared<SimulatedTransport>(network);
+    DownloadManager manager(2, PipelineConfig{64 * 1024, 4, 1}, transport);
+    manager.set_progress_enabled(false);
+    for (const std::size_t chunks : {1, 4}) {
+        DownloadRequest request;
+        request.url = "https://host.sim/chunks" + std::to_string(chunks);
+        request.output_path = dir.file(label + std::to_string(chunks));
+        request.preferred_chunks = chunks;
+        request.target = target;
+        transport->add_resource(request.url, (2 << 20) + 4321);
+        manager.add(std::move(request));
+    }
+
+    const CallbackAllocationStats before = AllocationCounter::callback_stats();
+    for (const auto& result : manager.run_all()) {
+        CHECK(result.status == DownloadStatus::Completed);
+        CHECK(result.bytes == (2 << 20) + 4321);
+    }
+    const CallbackAllocationStats after = AllocationCounter::callback_stats();
+    return CallbackAllocationStats{after.callbacks - before.callbacks, after.allocations - before.allocations};
+}
+
+void transfer_callbacks_do_not_allocate() {
+    test::TempDir dir;
+    const std::pair<DownloadTarget, std::string> targets[] = {
+        {DownloadTarget::File, "file"},
+        {DownloadTarget::Discard, "discard"},
+        {DownloadTarget::Memory, "memory"},
+    };
+    for (const auto& [target, label] : targets) {
+        const CallbackAllocationStats stats = run_downloads(target, label, dir);
+        CHECK(stats.callbacks > 0);
+        CHECK(stats.allocations == 0);
+    }
+}
+
+}  // namespace
+
+int main() {
+    transfer_callbacks_do_not_allocate();
+    return test::exit_code();
+}
@@ -0,0 +1,352 @@
+#include "downloader/async_client.h"
+#include "downloader/curl_transport.h"
+#include "downloader/thread_pool.h"
+
+#include "fake_transport.h"
+#include "test_support.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace downloader;
+
+// Minimal fire-and-forget coroutine: starts eagerly and frees its frame when
+// it returns.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// The client lives in the coroutine frame, so it is destroyed by the
+// coroutine itself right after the awaited download resumes it.
+Detached download_with_own_client(std::shared_ptr<test::FakeTransport> transport,
+                                  DownloadRequest request,
+                                  std::promise<DownloadResult>& done) {
+    DownloadResult result;
+    {
+        AsyncClient client(2, {}, std::move(transport));
+        result = co_await client.download(std::move(request));
+    }
+    done.set_value(std::move(result));
+}
+
+template <typename T>
+bool ready_within(std::future<T>& future, std::chrono::seconds timeout) {
+    return future.wait_for(timeout) == std::future_status::ready;
+}
+
+std::size_t thread_count() {
+    std::size_t count = 0;
+    for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator("/proc/self/task")) {
+        ++count;
+    }
+    return count;
+}
+
+// Serves one body over HTTP on 127.0.0.1, from a single thread, so it adds
+// the same one thread however many transfers it has open. Answers to GETs
+// are held back until release(), which lets a test look at the client while
+// every one of them is in flight.
+class LocalServer {
+public:
+    explicit LocalServer(std::string body) : body_(std::move(body)) {
+        listener_ = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (listener_ < 0 || bind(listener_, reinterpret_cast<sockaddr*>(&address), length) != 0 ||
+            listen(listener_, 128) != 0 ||
+            getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            throw std::runtime_error("cannot listen on 127.0.0.1");
+        }
+        port_ = ntohs(address.sin_port);
+        thread_ = std::jthread([this](std::stop_token stop_token) { run(stop_token); });
+    }
+
+    ~LocalServer() {
+        thread_.request_stop();
+        thread_.join();
+        for (const Client& client : clients_) {
+            close(client.fd);
+        }
+        close(listener_);
+    }
+
+    std::string url(const std::string& path) const {
+        return "http://127.0.0.1:" + std::to_string(port_) + path;
+    }
+
+    // Waits until `count` GETs are being held back.
+    bool wait_for_held(std::size_t count, std::chrono::seconds timeout) {
+        std::unique_lock lock(mutex_);
+        return held_cv_.wait_for(lock, timeout, [&]() { return held_ >= count; });
+    }
+
+    void release() { released_ = true; }
+
+private:
+    struct Client {
+        int fd{-1};
+        std::string request;
+        std::string response;
+        std::size_t sent{0};
+        bool held{false};
+    };
+
+    void run(std::stop_token stop_token) {
+        std::vector<pollfd> fds;
+        while (!stop_token.stop_requested()) {
+            fds.assign(1, pollfd{listener_, POLLIN, 0});
+            for (const Client& client : clients_) {
+                const bool sending = !client.response.empty() && (!client.held || released_);
+                fds.push_back(pollfd{client.fd, static_cast<short>(sending ? POLLOUT : POLLIN), 0});
+            }
+            poll(fds.data(), fds.size(), 5);
+            if ((fds[0].revents & POLLIN) != 0) {
+                const int fd = accept(listener_, nullptr, nullptr);
+                if (fd >= 0) {
+                    Client client;
+                    client.fd = fd;
+                    clients_.push_back(std::move(client));
+                }
+            }
+            for (std::size_t i = 0; i < clients_.size();) {
+                if (serve(clients_[i])) {
+                    ++i;
+                } else {
+                    close(clients_[i].fd);
+                    clients_.erase(clients_.begin() + static_cast<std::ptrdiff_t>(i));
+                }
+            }
+        }
+    }
+
+    // False once the connection is done with.
+    bool serve(Client& client) {
+        pollfd ready{client.fd, POLLIN | POLLOUT, 0};
+        poll(&ready, 1, 0);
+        if (client.response.empty()) {
+            if ((ready.revents & (POLLIN | POLLHUP)) == 0) {
+                return true;
+            }
+            char buffer[4096];
+            const ssize_t got = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (got <= 0) {
+                return false;
+            }
+            client.request.append(buffer, static_cast<std::size_t>(got));
+            if (client.request.find("\r\n\r\n") != std::string::npos) {
+                respond(client);
+            }
+            return true;
+        }
+        if ((client.held && !released_) || (ready.revents & POLLOUT) == 0) {
+            return true;
+        }
+        const ssize_t sent = send(client.fd, client.response.data() + client.sent,
+                                  client.response.size() - client.sent, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        client.sent += static_cast<std::size_t>(sent);
+        return client.sent < client.response.size();
+    }
+
+    void respond(Client& client) {
+        const bool head = client.request.starts_with("HEAD ");
+        std::int64_t begin = 0;
+        std::int64_t end = static_cast<std::int64_t>(body_.size()) - 1;
+        const std::size_t range = client.request.find("Range: bytes=");
+        if (range != std::string::npos) {
+            const char* const last = client.request.data() + client.request.size();
+            const auto first = std::from_chars(client.request.data() + range + 13, last, begin);
+            std::from_chars(first.ptr + 1, last, end);
+        }
+        const std::string status = range != std::string::npos ? "206 Partial Content" : "200 OK";
+        client.response = "HTTP/1.1 " + status + "\r\nAccept-Ranges: bytes\r\nConnection: close\r\n" +
+                          "Content-Length: " + std::to_string(end + 1 - begin) + "\r\n";
+        if (range != std::string::npos) {
+            client.response += "Content-Range: bytes " + std::to_string(begin) + "-" + std::to_string(end) + "/" +
+                               std::to_string(body_.size()) + "\r\n";
+        }
+        client.response += "\r\n";
+        if (!head) {
+            client.response.append(body_, static_cast<std::size_t>(begin), static_cast<std::size_t>(end + 1 - begin));
+            client.held = true;
+            std::scoped_lock lock(mutex_);
+            ++held_;
+            held_cv_.notify_all();
+        }
+    }
+
+    const std::string body_;
+    int listener_{-1};
+    std::uint16_t port_{0};
+    std::vector<Client> clients_;
+    std::atomic<bool> released_{false};
+    std::mutex mutex_;
+    std::condition_variable held_cv_;
+    std::size_t held_{0};
+    std::jthread thread_;
+};
+
+void coroutine_can_own_its_client() {
+    test::TempDir dir;
+    auto transport = std::make_shared<test::FakeTransport>();
+    const std::string body = test::pattern_body(200000);
+    transport->add("http://fake/owned", body);
+
+    DownloadRequest request;
+    request.url = "http://fake/owned";
+    request.output_path = dir.file("owned.bin");
+    std::promise<DownloadResult> done;
+    std::future<DownloadResult> result = done.get_future();
+    download_with_own_client(transport, request, done);
+
+    if (!ready_within(result, std::chrono::seconds(30))) {
+        // A hang here is the bug under test; the frame cannot be unwound.
+        std::cerr << "coroutine owning its client did not finish\n";
+        std::_Exit(1);
+    }
+    const DownloadResult downloaded = result.get();
+    CHECK(downloaded.status == DownloadStatus::Completed);
+    CHECK(test::read_file(request.output_path) == body);
+}
+
+void destroying_the_client_waits_for_callbacks() {
+    test::TempDir dir;
+    auto transport = std::make_shared<test::FakeTransport>();
+    const std::string body = test::pattern_body(50000, 3);
+    transport->add("http://fake/shared", body);
+
+    std::promise<DownloadResult> callback_done;
+    std::future<DownloadResult> callback_result = callback_done.get_future();
+    {
+        AsyncClient client(2, {}, transport);
+        DownloadRequest request;
+        request.url = "http://fake/shared";
+        request.output_path = dir.file("callback.bin");
+        client.download(request, [&](DownloadResult result) { callback_done.set_value(std::move(result)); });
+    }
+    CHECK(ready_within(callback_result, std::chrono::seconds(0)));
+    CHECK(callback_result.get().status == DownloadStatus::Completed);
+    CHECK(test::read_file(dir.file("callback.bin")) == body);
+}
+
+// Eight downloads of four ranges each are in flight over libcurl at once.
+// They add one thread between them, the event loop, and every handler runs
+// on the executor the caller passed in.
+void transfers_share_one_event_loop() {
+    test::TempDir dir;
+    const std::string body = test::pattern_body((2 << 20) + 999, 4);
+    LocalServer server(body);
+    auto executor = std::make_shared<ThreadPool>(2, nullptr, "test executor");
+    constexpr std::size_t kDownloads = 8;
+    constexpr std::size_t kChunks = 4;
+
+    std::vector<std::future<DownloadResult>> results;
+    std::atomic<std::size_t> off_executor{0};
+    std::size_t idle_threads = 0;
+    std::size_t busy_threads = 0;
+    {
+        AsyncClient client(2, {}, std::make_shared<CurlTransport>(), executor);
+        idle_threads = thread_count();
+        for (std::size_t i = 0; i < kDownloads; ++i) {
+            DownloadRequest request;
+            request.url = server.url("/file" + std::to_string(i));
+            request.output_path = dir.file("file" + std::to_string(i));
+            request.preferred_chunks = kChunks;
+            auto done = std::make_shared<std::promise<DownloadResult>>();
+            results.push_back(done->get_future());
+            client.download(request, [done, executor, &off_executor](DownloadResult result) {
+                if (!executor->is_worker_thread()) {
+                    ++off_executor;
+                }
+                done->set_value(std::move(result));
+            });
+        }
+        CHECK(server.wait_for_held(kDownloads * kChunks, std::chrono::seconds(60)));
+        busy_threads = thread_count();
+        server.release();
+    }
+
+    CHECK(busy_threads <= idle_threads + 1);
+    CHECK(off_executor == 0);
+    for (std::size_t i = 0; i < kDownloads; ++i) {
+        CHECK(ready_within(results[i], std::chrono::seconds(0)));
+        const DownloadResult result = results[i].get();
+        CHECK(result.status == DownloadStatus::Completed);
+        CHECK(test::read_file(dir.file("file" + std::to_string(i))) == body);
+    }
+}
+
+// Split downloads write each range at its offset, to a file or to memory.
+void split_download_lands_in_place() {
+    test::TempDir dir;
+    const std::string body = test::pattern_body((3 << 20) + 17, 6);
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add("http://fake/split", body);
+    AsyncClient client(2, {}, transport);
+
+    for (const DownloadTarget target : {DownloadTarget::File, DownloadTarget::Memory}) {
+        DownloadRequest request;
+        request.url = "http://fake/split";
+        request.output_path = dir.file("split.bin");
+        request.target = target;
+        request.preferred_chunks = 4;
+        std::promise<DownloadResult> done;
+        std::future<DownloadResult> result = done.get_future();
+        client.download(request, [&done](DownloadResult outcome) { done.set_value(std::move(outcome)); });
+        CHECK(ready_within(result, std::chrono::seconds(60)));
+        const DownloadResult downloaded = result.get();
+        CHECK(downloaded.status == DownloadStatus::Completed);
+        CHECK(downloaded.bytes == body.size());
+        if (target == DownloadTarget::File) {
+            CHECK(test::read_file(request.output_path) == body);
+        } else {
+            CHECK(downloaded.body != nullptr && downloaded.body->text() == body);
+        }
+    }
+    const auto fetches = transport->fetches();
+    CHECK(fetches.size() == 8);
+    for (const auto& fetch : fetches) {
+        CHECK(fetch.range.has_value());
+    }
+}
+
+}  // namespace
+
+int main() {
+    coroutine_can_own_its_client();
+    destroying_the_client_waits_for_callbacks();
+    transfers_share_one_event_loop();
+    split_download_lands_in_place();
+    return test::exit_code();
+}
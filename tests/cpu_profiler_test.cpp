@@ -0,0 +1,95 @@
+#include "downloader/cpu_profiler.h"
+
+#include "test_support.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <time.h>
+
+namespace {
+
+using namespace downloader;
+using namespace std::chrono_literals;
+
+std::uint64_t thread_cpu_ns() {
+    timespec cpu{};
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    return static_cast<std::uint64_t>(cpu.tv_sec) * 1'000'000'000 + static_cast<std::uint64_t>(cpu.tv_nsec);
+}
+
+// Burns `cpu` of this thread's CPU time.
+void spin(std::chrono::nanoseconds cpu) {
+    const std::uint64_t until = thread_cpu_ns() + static_cast<std::uint64_t>(cpu.count());
+    while (thread_cpu_ns() < until) {
+    }
+}
+
+// Hashing nested in a transfer pauses it: the inner 20 ms go to hashing only
+// and the 40 ms around them to the transfer only.
+void nested_scopes_charge_each_interval_once() {
+    CpuAccount account;
+    const std::uint64_t start = thread_cpu_ns();
+    {
+        CpuProfiler::Scope transfer(CpuPhase::Transfer, &account);
+        spin(20ms);
+        {
+            CpuProfiler::Scope hashing(CpuPhase::Hashing, &account);
+            spin(20ms);
+        }
+        spin(20ms);
+    }
+    const std::uint64_t elapsed = thread_cpu_ns() - start;
+
+    const std::uint64_t transfer = account.phase(CpuPhase::Transfer).cpu_ns;
+    const std::uint64_t hashing = account.phase(CpuPhase::Hashing).cpu_ns;
+    CHECK(transfer >= 40'000'000 && transfer < 55'000'000);
+    CHECK(hashing >= 20'000'000 && hashing < 35'000'000);
+    CHECK(account.phase(CpuPhase::Probe).cpu_ns == 0);
+    CHECK(account.phase(CpuPhase::DiskWrite).cpu_ns == 0);
+    CHECK(account.total().cpu_ns == transfer + hashing);
+    CHECK(account.total().cpu_ns <= elapsed);
+}
+
+// Each sleep gives up the CPU, which perf or getrusage counts as a switch.
+void context_switches_are_counted() {
+    CpuAccount account;
+    {
+        CpuProfiler::Scope probe(CpuPhase::Probe, &account);
+        for (int i = 0; i < 10; ++i) {
+            std::this_thread::sleep_for(1ms);
+        }
+    }
+    CHECK(account.phase(CpuPhase::Probe).context_switches >= 10);
+}
+
+// The profiler's own reads at the edges of a scope are not charged to it.
+void empty_scope_makes_no_syscalls() {
+    if (!CpuProfiler::support().syscalls) {
+        return;
+    }
+    CpuAccount account;
+    { CpuProfiler::Scope disk(CpuPhase::DiskWrite, &account); }
+    CHECK(account.phase(CpuPhase::DiskWrite).syscalls == 0);
+}
+
+}  // namespace
+
+// With --no-perf the profiler runs as it does on a host that refuses every
+// perf_event counter.
+int main(int argc, char** argv) {
+    const bool perf = !(argc > 1 && std::string_view(argv[1]) == "--no-perf");
+    CHECK(CpuProfiler::enable(perf));
+    const CpuCounterSupport support = CpuProfiler::support();
+    if (!perf) {
+        CHECK(!support.cycles && !support.instructions && !support.context_switches && !support.syscalls);
+    }
+    std::cout << "context switches from " << (support.context_switches ? "perf" : "getrusage") << '\n';
+
+    nested_scopes_charge_each_interval_once();
+    context_switches_are_counted();
+    empty_scope_makes_no_syscalls();
+    return test::exit_code();
+}
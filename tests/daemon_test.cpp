@@ -0,0 +1,192 @@
+#include "downloader/daemon.h"
+#include "downloader/daemon_protocol.h"
+
+#include "test_support.h"
+
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+using namespace downloader;
+
+bool refuses(const std::string& path, const std::string& expected) {
+    try {
+        DaemonServer server(path, 1);
+    } catch (const std::runtime_error& error) {
+        return std::string(error.what()).find(expected) != std::string::npos;
+    }
+    return false;
+}
+
+// Leaves a socket file behind the way a killed daemon does.
+void make_stale_socket(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    CHECK(::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+    ::close(fd);
+}
+
+bool is_socket(const std::string& path) {
+    struct stat info {};
+    return ::lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode);
+}
+
+void socket_path_is_only_replaced_when_stale() {
+    test::TempDir dir;
+
+    const std::string regular = dir.file("regular");
+    test::write_file(regular, "keep me");
+    CHECK(refuses(regular, "not a socket"));
+    CHECK(test::read_file(regular) == "keep me");
+
+    const std::string live = dir.file("live.sock");
+    {
+        DaemonServer first(live, 1);
+        CHECK(refuses(live, "already listening"));
+        CHECK(is_socket(live));
+    }
+
+    const std::string stale = dir.file("stale.sock");
+    make_stale_socket(stale);
+    CHECK(is_socket(stale));
+    {
+        DaemonServer server(stale, 1);
+        CHECK(is_socket(stale));
+    }
+    CHECK(!is_socket(stale));
+}
+
+// A TCP listener that accepts connections into its backlog and never
+// answers, so a download against it stays in flight until cancelled.
+class SilentServer {
+public:
+    SilentServer() : fd_(::socket(AF_INET, SOCK_STREAM, 0)) {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        CHECK(::bind(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+        CHECK(::listen(fd_, 8) == 0);
+        CHECK(::getsockname(fd_, reinterpret_cast<sockaddr*>(&address), &length) == 0);
+        port_ = ntohs(address.sin_port);
+    }
+    ~SilentServer() { ::close(fd_); }
+
+    std::string url() const { return "http://127.0.0.1:" + std::to_string(port_) + "/never"; }
+
+private:
+    int fd_;
+    int port_{0};
+};
+
+void duplicate_job_id_drops_the_client() {
+    test::TempDir dir;
+    const std::string path = dir.file("daemon.sock");
+    DaemonServer server(path, 2);
+    // Destroyed before the daemon: closing it resets the pending connection,
+    // which ends the probe the daemon would otherwise wait on forever.
+    SilentServer silent;
+    std::jthread serving([&server](std::stop_token stop_token) { server.run(stop_token); });
+
+    DaemonClient client(path);
+    DownloadRequest request;
+    request.url = silent.url();
+    request.output_path = dir.file("never.bin");
+    client.submit(7, request);
+    client.submit(7, request);
+    // Dropped without a result for either submission.
+    CHECK(!client.next_frame().has_value());
+}
+
+// Patches the little-endian u32 at offset in an encoded Submit payload.
+void put_u32(std::string& payload, std::size_t offset, std::uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        payload[offset + i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+bool decode_fails(const std::string& payload) {
+    try {
+        protocol::decode_submit(payload);
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+bool encode_fails(const protocol::SubmitMessage& message) {
+    try {
+        protocol::encode(message);
+    } catch (const std::invalid_argument&) {
+        return true;
+    }
+    return false;
+}
+
+void submit_parameters_are_bounded() {
+    protocol::SubmitMessage message;
+    message.job_id = 1;
+    message.request.url = "http://host/file";
+    message.request.output_path = "file";
+    message.request.preferred_chunks = 8;
+    message.request.hedge.slow_fraction = 0.5;
+    message.request.hedge.stall_timeout = std::chrono::milliseconds(250);
+    const std::string payload = protocol::encode(message);
+    const auto decoded = protocol::decode_submit(payload);
+    CHECK(decoded.request.preferred_chunks == 8);
+    CHECK(decoded.request.hedge.slow_fraction == 0.5);
+    CHECK(decoded.request.hedge.stall_timeout == std::chrono::milliseconds(250));
+
+    // job id, two length-prefixed strings, then chunks, durability, hedge
+    // flag, slow fraction in thousandths and stall timeout in ms.
+    const std::size_t chunks_at = 8 + 4 + message.request.url.size() + 4 + message.request.output_path.size();
+    const std::size_t fraction_at = chunks_at + 4 + 1 + 1;
+    const std::size_t stall_at = fraction_at + 4;
+
+    std::string huge = payload;
+    put_u32(huge, chunks_at, 4'000'000'000u);
+    CHECK(protocol::decode_submit(huge).request.preferred_chunks == kMaxPreferredChunks);
+    std::string none = payload;
+    put_u32(none, chunks_at, 0);
+    CHECK(protocol::decode_submit(none).request.preferred_chunks == 1);
+
+    for (const std::uint32_t fraction : {0u, 1001u, 4'000'000'000u}) {
+        std::string bad = payload;
+        put_u32(bad, fraction_at, fraction);
+        CHECK(decode_fails(bad));
+    }
+    std::string whole = payload;
+    put_u32(whole, fraction_at, 1000);
+    CHECK(protocol::decode_submit(whole).request.hedge.slow_fraction == 1.0);
+    std::string no_stall = payload;
+    put_u32(no_stall, stall_at, 0);
+    CHECK(decode_fails(no_stall));
+
+    for (const double fraction : {0.0, -0.5, 1.5, 5e9}) {
+        auto bad = message;
+        bad.request.hedge.slow_fraction = fraction;
+        CHECK(encode_fails(bad));
+    }
+    auto many = message;
+    many.request.preferred_chunks = 1'000'000;
+    CHECK(protocol::decode_submit(protocol::encode(many)).request.preferred_chunks == kMaxPreferredChunks);
+}
+
+}  // namespace
+
+int main() {
+    submit_parameters_are_bounded();
+    socket_path_is_only_replaced_when_stale();
+    duplicate_job_id_drops_the_client();
+    return test::exit_code();
+}
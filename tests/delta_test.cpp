@@ -0,0 +1,125 @@
+#include "downloader/delta.h"
+#include "downloader/download_manager.h"
+
+#include "fake_transport.h"
+#include "test_support.h"
+
+#include <filesystem>
+#include <memory>
+#include <string>
+
+namespace {
+
+using namespace downloader;
+
+constexpr std::int64_t kBlockSize = 4096;
+constexpr std::size_t kInsertion = 777;
+
+// The new version has bytes inserted part-way through and a changed tail, so
+// every block after the insertion sits at a different offset than before.
+struct Versions {
+    std::string old_body;
+    std::string new_body;
+};
+
+Versions make_versions() {
+    Versions versions;
+    versions.old_body = test::pattern_body(300000, 9);
+    versions.new_body = versions.old_body.substr(0, 100000) + test::pattern_body(kInsertion, 10) +
+                        versions.old_body.substr(100000, 190000) + test::pattern_body(5000, 11);
+    return versions;
+}
+
+std::string apply(const DeltaPlan& plan, const std::string& seed, const std::string& fetched_from) {
+    std::string result(fetched_from.size(), '\0');
+    for (const auto& copy : plan.copies) {
+        result.replace(static_cast<std::size_t>(copy.target), static_cast<std::size_t>(copy.length),
+                       seed, static_cast<std::size_t>(copy.source), static_cast<std::size_t>(copy.length));
+    }
+    for (const auto& range : plan.fetches) {
+        const auto length = static_cast<std::size_t>(range.end + 1 - range.begin);
+        result.replace(static_cast<std::size_t>(range.begin), length, fetched_from,
+                       static_cast<std::size_t>(range.begin), length);
+    }
+    return result;
+}
+
+// Blocks shifted by the insertion are still found by the rolling checksum;
+// only the blocks around the edits are fetched.
+void rolling_checksum_finds_shifted_blocks() {
+    test::TempDir dir;
+    const Versions versions = make_versions();
+    const std::string new_path = dir.file("new.bin");
+    const std::string old_path = dir.file("old.bin");
+    test::write_file(new_path, versions.new_body);
+    test::write_file(old_path, versions.old_body);
+
+    const BlockMap map = parse_block_map(make_block_map(new_path, kBlockSize));
+    const SeedFile seed(old_path);
+    const DeltaPlan plan = plan_delta(map, seed);
+
+    const auto length = static_cast<std::int64_t>(versions.new_body.size());
+    CHECK(plan.copy_bytes + plan.fetch_bytes == length);
+    // The block holding the insertion, the block straddling the start of the
+    // new tail, and the tail itself.
+    CHECK(plan.fetch_bytes <= static_cast<std::int64_t>(kInsertion) + 5000 + 3 * kBlockSize);
+    CHECK(plan.copy_bytes >= 190000 - kBlockSize);
+    CHECK(apply(plan, versions.old_body, versions.new_body) == versions.new_body);
+}
+
+DownloadResult run_delta(const std::shared_ptr<test::FakeTransport>& transport, const std::string& output) {
+    DownloadManager manager(1, {}, transport);
+    manager.set_progress_enabled(false);
+    DownloadRequest request;
+    request.url = "http://fake/new.bin";
+    request.output_path = output;
+    request.delta = true;
+    manager.add(request);
+    const auto results = manager.run_all();
+    CHECK(results.size() == 1);
+    return results.front();
+}
+
+void delta_download_fetches_only_changes() {
+    test::TempDir dir;
+    const Versions versions = make_versions();
+    const std::string published = dir.file("published.bin");
+    test::write_file(published, versions.new_body);
+    const std::string map_text = make_block_map(published, kBlockSize);
+    const DeltaPlan plan = [&]() {
+        const std::string old_path = dir.file("seed.bin");
+        test::write_file(old_path, versions.old_body);
+        return plan_delta(parse_block_map(map_text), SeedFile(old_path));
+    }();
+
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add("http://fake/new.bin", versions.new_body);
+    transport->add("http://fake/new.bin.blockmap", map_text);
+
+    const std::string output = dir.file("output.bin");
+    test::write_file(output, versions.old_body);
+    const DownloadResult result = run_delta(transport, output);
+    CHECK(result.status == DownloadStatus::Completed);
+    CHECK(result.bytes == static_cast<std::uint64_t>(plan.fetch_bytes));
+    CHECK(result.bytes_reused == static_cast<std::uint64_t>(plan.copy_bytes));
+    CHECK(test::read_file(output) == versions.new_body);
+    CHECK(!std::filesystem::exists(output + ".part"));
+
+    // A server that ignores the ranges sends the whole file once; nothing
+    // copied before that counts as reused, and no byte is counted twice.
+    transport->ignore_ranges("http://fake/new.bin");
+    test::write_file(output, versions.old_body);
+    const DownloadResult fallback = run_delta(transport, output);
+    CHECK(fallback.status == DownloadStatus::Completed);
+    CHECK(fallback.bytes == versions.new_body.size());
+    CHECK(fallback.bytes_reused == 0);
+    CHECK(test::read_file(output) == versions.new_body);
+}
+
+}  // namespace
+
+int main() {
+    rolling_checksum_finds_shifted_blocks();
+    delta_download_fetches_only_changes();
+    return test::exit_code();
+}
@@ -0,0 +1,197 @@
+#include "fake_transport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace test {
+
+using downloader::ByteRange;
+using downloader::TransferOutcome;
+using downloader::TransferSink;
+
+void FakeTransport::add(const std::string& url, std::string body, bool accept_ranges) {
+    std::scoped_lock lock(mutex_);
+    Resource& resource = resources_[url];
+    resource.body = std::move(body);
+    resource.accept_ranges = accept_ranges;
+}
+
+void FakeTransport::corrupt_once(const std::string& url, std::int64_t offset) {
+    std::scoped_lock lock(mutex_);
+    resources_[url].corrupt.insert(offset);
+}
+
+void FakeTransport::stall_once(const std::string& url, std::int64_t offset, std::chrono::milliseconds limit) {
+    std::scoped_lock lock(mutex_);
+    resources_[url].stalls[offset] = limit;
+}
+
+void FakeTransport::ignore_ranges(const std::string& url) {
+    std::scoped_lock lock(mutex_);
+    resources_[url].ignore_ranges = true;
+}
+
+void FakeTransport::set_metadata(const std::string& url, std::int64_t last_modified, std::string sha256) {
+    std::scoped_lock lock(mutex_);
+    Resource& resource = resources_[url];
+    resource.last_modified = last_modified;
+    resource.sha256 = std::move(sha256);
+}
+
+std::vector<FakeTransport::Fetch> FakeTransport::fetches() const {
+    std::scoped_lock lock(mutex_);
+    return fetches_;
+}
+
+downloader::ProbeResult FakeTransport::probe(const std::string& url, std::uint32_t) {
+    downloader::ProbeResult result;
+    std::scoped_lock lock(mutex_);
+    const auto it = resources_.find(url);
+    if (it == resources_.end()) {
+        result.http_status = 404;
+        result.error_message = "HTTP status 404";
+        return result;
+    }
+    result.ok = true;
+    result.http_status = 200;
+    result.content_length = static_cast<std::int64_t>(it->second.body.size());
+    result.accept_ranges = it->second.accept_ranges;
+    result.last_modified = it->second.last_modified;
+    result.sha256 = it->second.sha256;
+    return result;
+}
+
+TransferOutcome FakeTransport::fetch(const std::string& url,
+                                     std::optional<ByteRange> range,
+                                     TransferSink& sink,
+                                     std::uint32_t,
+                                     downloader::Connection connection) {
+    TransferOutcome outcome;
+    std::string body;
+    std::int64_t begin = 0;
+    std::size_t fetch_index = 0;
+    // Offset in `body` where delivery stalls, if it does.
+    std::optional<std::size_t> stall_at;
+    std::chrono::milliseconds stall_limit{0};
+    {
+        std::scoped_lock lock(mutex_);
+        fetch_index = fetches_.size();
+        fetches_.push_back(Fetch{url, range, connection});
+        const auto it = resources_.find(url);
+        if (it == resources_.end()) {
+            outcome.http_status = 404;
+            outcome.error_message = "The requested URL returned error: 404";
+            return outcome;
+        }
+        Resource& resource = it->second;
+        std::int64_t end = static_cast<std::int64_t>(resource.body.size()) - 1;
+        outcome.http_status = 200;
+        if (range && resource.accept_ranges && !resource.ignore_ranges) {
+            begin = range->begin;
+            end = std::min(range->end, end);
+            outcome.http_status = 206;
+        }
+        body = resource.body.substr(static_cast<std::size_t>(begin), static_cast<std::size_t>(end + 1 - begin));
+        for (auto corrupt = resource.corrupt.lower_bound(begin);
+             corrupt != resource.corrupt.end() && *corrupt <= end;) {
+            body[static_cast<std::size_t>(*corrupt - begin)] ^= 0x5a;
+            corrupt = resource.corrupt.erase(corrupt);
+        }
+        if (const auto stall = resource.stalls.lower_bound(begin);
+            stall != resource.stalls.end() && stall->first <= end) {
+            stall_at = static_cast<std::size_t>(stall->first - begin);
+            stall_limit = stall->second;
+            resource.stalls.erase(stall);
+        }
+    }
+
+    sink.expect_length(static_cast<std::int64_t>(body.size()));
+    if (!sink.accept_status(outcome.http_status)) {
+        outcome.error_message = "Failure writing output to destination";
+        return outcome;
+    }
+    const auto abort = [&]() {
+        std::scoped_lock lock(mutex_);
+        fetches_[fetch_index].aborted = true;
+        outcome.aborted = true;
+        outcome.error_message = "Callback aborted";
+        return outcome;
+    };
+    std::size_t handed = 0;
+    while (handed < body.size()) {
+        if (sink.cancelled()) {
+            return abort();
+        }
+        if (stall_at && handed == *stall_at) {
+            const auto until = std::chrono::steady_clock::now() + stall_limit;
+            while (!sink.cancelled() && std::chrono::steady_clock::now() < until) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            stall_at.reset();
+            continue;
+        }
+        std::size_t piece = std::min(write_size_, body.size() - handed);
+        if (stall_at && handed < *stall_at) {
+            piece = std::min(piece, *stall_at - handed);
+        }
+        switch (sink.write(body.data() + handed, piece)) {
+            case TransferSink::Write::Accepted:
+                handed += piece;
+                {
+                    std::scoped_lock lock(mutex_);
+                    fetches_[fetch_index].accepted += piece;
+                }
+                break;
+            case TransferSink::Write::Paused:
+                while (!sink.can_resume() && !sink.cancelled()) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+                break;
+            case TransferSink::Write::Rejected:
+                if (sink.cancelled()) {
+                    return abort();
+                }
+                outcome.error_message = "Failure writing output to destination";
+                return outcome;
+        }
+    }
+    outcome.ok = true;
+    return outcome;
+}
+
+TransferOutcome FakeTransport::fetch_ranges(const std::string& url,
+                                            std::span<const ByteRange> ranges,
+                                            downloader::RangeSetSink& sink,
+                                            std::uint32_t trace_track) {
+    bool whole_body = false;
+    std::string body;
+    {
+        std::scoped_lock lock(mutex_);
+        const auto it = resources_.find(url);
+        whole_body = it != resources_.end() && it->second.ignore_ranges;
+        if (whole_body) {
+            fetches_.push_back(Fetch{url, std::nullopt});
+            body = it->second.body;
+        }
+    }
+    if (!whole_body) {
+        return Transport::fetch_ranges(url, ranges, sink, trace_track);
+    }
+
+    // Like a server that ignores a multi-range request: the whole body from
+    // offset 0 with a 200.
+    TransferOutcome outcome;
+    outcome.http_status = 200;
+    for (std::size_t handed = 0; handed < body.size(); handed += write_size_) {
+        const std::size_t piece = std::min(write_size_, body.size() - handed);
+        if (!sink.write_at(static_cast<std::int64_t>(handed), body.data() + handed, piece)) {
+            outcome.error_message = "Failure writing output to destination";
+            return outcome;
+        }
+    }
+    outcome.ok = true;
+    return outcome;
+}
+
+}  // namespace test
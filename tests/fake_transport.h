@@ -0,0 +1,82 @@
+#pragma once
+
+#include "downloader/clock.h"
+#include "downloader/transport.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace test {
+
+// Serves in-memory bodies in real time, with hooks for the failure modes the
+// tests need. Unlike SimulatedTransport it delivers real content, so results
+// can be compared byte for byte.
+class FakeTransport final : public downloader::Transport {
+public:
+    struct Fetch {
+        std::string url;
+        std::optional<downloader::ByteRange> range;
+        downloader::Connection connection{downloader::Connection::Reuse};
+        // Body bytes the sink accepted.
+        std::uint64_t accepted{0};
+        // The sink cancelled the fetch before its body was complete.
+        bool aborted{false};
+    };
+
+    // Body bytes are handed to sinks in writes of this size at most.
+    explicit FakeTransport(std::size_t write_size = 10007) : write_size_(write_size) {}
+
+    void add(const std::string& url, std::string body, bool accept_ranges = true);
+    // The next fetch that carries byte `offset` of `url` delivers it flipped.
+    void corrupt_once(const std::string& url, std::int64_t offset);
+    // The next fetch that carries byte `offset` of `url` stops sending just
+    // before it until the sink cancels, or for `limit` at most. A fetch
+    // takes at most one stall, the first one in its range.
+    void stall_once(const std::string& url, std::int64_t offset, std::chrono::milliseconds limit);
+    // Probes still advertise ranges, but fetches answer 200 with the whole body.
+    void ignore_ranges(const std::string& url);
+    // What probes report as Last-Modified (seconds since the epoch) and as
+    // the Repr-Digest SHA-256 (hex).
+    void set_metadata(const std::string& url, std::int64_t last_modified, std::string sha256);
+
+    std::vector<Fetch> fetches() const;
+
+    downloader::ProbeResult probe(const std::string& url, std::uint32_t trace_track) override;
+    downloader::TransferOutcome fetch(const std::string& url,
+                                      std::optional<downloader::ByteRange> range,
+                                      downloader::TransferSink& sink,
+                                      std::uint32_t trace_track,
+                                      downloader::Connection connection) override;
+    downloader::TransferOutcome fetch_ranges(const std::string& url,
+                                             std::span<const downloader::ByteRange> ranges,
+                                             downloader::RangeSetSink& sink,
+                                             std::uint32_t trace_track) override;
+    downloader::Clock& clock() override { return clock_; }
+
+private:
+    struct Resource {
+        std::string body;
+        bool accept_ranges{true};
+        bool ignore_ranges{false};
+        std::int64_t last_modified{-1};
+        std::string sha256;
+        std::set<std::int64_t> corrupt;
+        std::map<std::int64_t, std::chrono::milliseconds> stalls;
+    };
+
+    const std::size_t write_size_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Resource> resources_;
+    std::vector<Fetch> fetches_;
+    downloader::SystemClock clock_;
+};
+
+}  // namespace test
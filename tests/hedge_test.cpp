@@ -0,0 +1,129 @@
+#include "downloader/download_manager.h"
+
+#include "fake_transport.h"
+#include "test_support.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace {
+
+using namespace downloader;
+using namespace std::chrono_literals;
+
+constexpr std::int64_t kRangeSize = 1 << 20;
+
+// Range 2 of 4 stops sending 300 000 bytes in. A hedge re-requests the
+// rest of it on a fresh connection, wins, and the stalled primary is
+// cancelled; the file is exact even though both attempts wrote to it.
+void stalled_range_is_hedged() {
+    test::TempDir dir;
+    const std::string url = "http://fake/hedged";
+    const std::string body = test::pattern_body(4 * kRangeSize, 13);
+    const std::int64_t stalled_begin = 2 * kRangeSize;
+    const std::int64_t stall_offset = stalled_begin + 300'000;
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add(url, body);
+    // Long enough that only cancellation ends the stall within the test.
+    transport->stall_once(url, stall_offset, 30s);
+
+    DownloadManager manager(1, PipelineConfig{64 * 1024, 8, 1}, transport);
+    manager.set_progress_enabled(false);
+    DownloadRequest request;
+    request.url = url;
+    request.output_path = dir.file("hedged.bin");
+    request.preferred_chunks = 4;
+    request.hedge.enabled = true;
+    request.hedge.stall_timeout = 200ms;
+    const DownloadStatePtr state = manager.add(request);
+    const auto started = std::chrono::steady_clock::now();
+    const auto results = manager.run_all();
+    const auto elapsed = std::chrono::steady_clock::now() - started;
+
+    CHECK(results.size() == 1);
+    CHECK(results[0].status == DownloadStatus::Completed);
+    CHECK(results[0].bytes == body.size());
+    CHECK(elapsed < 20s);
+    CHECK(state->hedged_ranges.load() == 1);
+    CHECK(test::read_file(request.output_path) == body);
+
+    const auto fetches = transport->fetches();
+    CHECK(fetches.size() == 5);
+    int hedges = 0;
+    for (const auto& fetch : fetches) {
+        CHECK(fetch.range.has_value());
+        if (!fetch.range) {
+            continue;
+        }
+        if (fetch.connection == Connection::Fresh) {
+            ++hedges;
+            // The hedge picks up where the primary's accepted bytes end.
+            CHECK(fetch.range->begin > stalled_begin && fetch.range->begin <= stall_offset);
+            CHECK(fetch.range->end == stalled_begin + kRangeSize - 1);
+            CHECK(!fetch.aborted);
+            CHECK(static_cast<std::int64_t>(fetch.accepted) == fetch.range->end + 1 - fetch.range->begin);
+        } else if (fetch.range->begin == stalled_begin) {
+            // The loser: stalled, then cancelled once the hedge finished.
+            CHECK(fetch.aborted);
+            CHECK(static_cast<std::int64_t>(fetch.accepted) == stall_offset - stalled_begin);
+        } else {
+            CHECK(!fetch.aborted);
+        }
+    }
+    CHECK(hedges == 1);
+}
+
+// The primary comes back from its stall after the hedge has written the
+// first 100 000 bytes of the same region, then stalls itself. The primary
+// overwrites those bytes with identical ones and wins, and the hedge is
+// cancelled.
+void primary_wins_over_an_overlapping_hedge() {
+    test::TempDir dir;
+    const std::string url = "http://fake/overlap";
+    const std::string body = test::pattern_body(4 * kRangeSize, 14);
+    const std::int64_t stalled_begin = 2 * kRangeSize;
+    const std::int64_t stall_offset = stalled_begin + 300'000;
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add(url, body);
+    transport->stall_once(url, stall_offset, 600ms);
+    transport->stall_once(url, stall_offset + 100'000, 30s);
+
+    DownloadManager manager(1, PipelineConfig{64 * 1024, 8, 1}, transport);
+    manager.set_progress_enabled(false);
+    DownloadRequest request;
+    request.url = url;
+    request.output_path = dir.file("overlap.bin");
+    request.preferred_chunks = 4;
+    request.hedge.enabled = true;
+    request.hedge.stall_timeout = 200ms;
+    const DownloadStatePtr state = manager.add(request);
+    const auto results = manager.run_all();
+
+    CHECK(results.size() == 1);
+    CHECK(results[0].status == DownloadStatus::Completed);
+    CHECK(results[0].bytes == body.size());
+    CHECK(state->hedged_ranges.load() == 1);
+    CHECK(test::read_file(request.output_path) == body);
+
+    const auto fetches = transport->fetches();
+    CHECK(fetches.size() == 5);
+    for (const auto& fetch : fetches) {
+        if (fetch.connection == Connection::Fresh) {
+            CHECK(fetch.aborted);
+            CHECK(fetch.range && fetch.range->begin == stall_offset);
+            CHECK(fetch.accepted == 100'000);
+        } else {
+            CHECK(!fetch.aborted);
+            CHECK(fetch.accepted == kRangeSize);
+        }
+    }
+}
+
+}  // namespace
+
+int main() {
+    stalled_range_is_hedged();
+    primary_wins_over_an_overlapping_hedge();
+    return test::exit_code();
+}
@@ -0,0 +1,65 @@
+#include "downloader/download_manager.h"
+
+#include "fake_transport.h"
+#include "test_support.h"
+
+#include <cstring>
+#include <future>
+#include <memory>
+#include <string>
+
+namespace {
+
+using namespace downloader;
+
+// Large enough to be split into ranges.
+constexpr std::size_t kBodySize = (2 << 20) + 4321;
+
+DownloadResult download(DownloadManager& manager, const std::string& url, std::size_t chunks) {
+    DownloadRequest request;
+    request.url = url;
+    request.preferred_chunks = chunks;
+    request.target = DownloadTarget::Memory;
+    std::promise<DownloadResult> done;
+    manager.submit(std::move(request), [&done](DownloadResult result) { done.set_value(std::move(result)); });
+    return done.get_future().get();
+}
+
+// Whole and split downloads land byte for byte in the body, and a second
+// download of the same size gets the block the first one released.
+void bodies_match_and_blocks_are_reused() {
+    const std::string served = test::pattern_body(kBodySize, 11);
+    for (const std::size_t chunks : {1, 4}) {
+        const std::string url = "http://fake/memory" + std::to_string(chunks);
+        auto transport = std::make_shared<test::FakeTransport>();
+        transport->add(url, served);
+        DownloadManager manager(1, {}, transport);
+
+        DownloadResult first = download(manager, url, chunks);
+        CHECK(first.status == DownloadStatus::Completed);
+        CHECK(first.body != nullptr);
+        if (first.body == nullptr) {
+            continue;
+        }
+        CHECK(first.body->text() == served);
+        CHECK(first.body->bytes().size() == served.size());
+        CHECK(std::memcmp(first.body->bytes().data(), served.data(), served.size()) == 0);
+        const std::byte* const block = first.body->bytes().data();
+        const std::size_t first_capacity = first.body->capacity();
+        first.body.reset();
+        // Had the block gone back to the heap, this would likely take it.
+        const auto decoy = std::make_unique<std::byte[]>(first_capacity);
+
+        const DownloadResult second = download(manager, url, chunks);
+        CHECK(second.status == DownloadStatus::Completed);
+        CHECK(second.body != nullptr && second.body->bytes().data() == block);
+        CHECK(second.body != nullptr && second.body->text() == served);
+    }
+}
+
+}  // namespace
+
+int main() {
+    bodies_match_and_blocks_are_reused();
+    return test::exit_code();
+}
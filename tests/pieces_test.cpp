@@ -0,0 +1,140 @@
+#include "downloader/download_manager.h"
+#include "downloader/pieces.h"
+#include "downloader/sha256.h"
+
+#include "fake_transport.h"
+#include "test_support.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+using namespace downloader;
+
+// Eight pieces make a body large enough to be split into ranges.
+constexpr std::int64_t kPieceSize = 256 * 1024;
+
+std::shared_ptr<const PieceHashes> hash_pieces(const std::string& body) {
+    auto hashes = std::make_shared<PieceHashes>();
+    hashes->piece_size = kPieceSize;
+    for (std::size_t begin = 0; begin < body.size(); begin += kPieceSize) {
+        Sha256 hash;
+        hash.update(body.data() + begin, std::min<std::size_t>(kPieceSize, body.size() - begin));
+        hashes->sha256.push_back(hash.finish());
+    }
+    return hashes;
+}
+
+bool same_range(const std::optional<ByteRange>& range, std::int64_t begin, std::int64_t end) {
+    return range && range->begin == begin && range->end == end;
+}
+
+// Pieces 2 and 5 arrive corrupted once. Only those two pieces are fetched
+// again, each with its own range request, and the file ends up intact.
+void only_bad_pieces_are_fetched_again() {
+    test::TempDir dir;
+    const std::string body = test::pattern_body(8 * kPieceSize - 1000, 5);
+    const auto hashes = hash_pieces(body);
+
+    for (const std::size_t chunks : {1, 4}) {
+        auto transport = std::make_shared<test::FakeTransport>();
+        transport->add("http://fake/pieces", body);
+        transport->corrupt_once("http://fake/pieces", 2 * kPieceSize + 17);
+        transport->corrupt_once("http://fake/pieces", 6 * kPieceSize - 1);
+
+        DownloadManager manager(1, {}, transport);
+        manager.set_progress_enabled(false);
+        DownloadRequest request;
+        request.url = "http://fake/pieces";
+        request.output_path = dir.file("pieces" + std::to_string(chunks));
+        request.preferred_chunks = chunks;
+        request.pieces = hashes;
+        manager.add(request);
+        const auto results = manager.run_all();
+
+        CHECK(results.size() == 1);
+        CHECK(results[0].status == DownloadStatus::Completed);
+        CHECK(results[0].pieces_repaired == 2);
+        CHECK(test::read_file(request.output_path) == body);
+
+        // The first pass is one fetch per chunk; the repairs follow it.
+        const auto fetches = transport->fetches();
+        CHECK(fetches.size() == chunks + 2);
+        if (fetches.size() == chunks + 2) {
+            CHECK(same_range(fetches[chunks].range, 2 * kPieceSize, 3 * kPieceSize - 1));
+            CHECK(same_range(fetches[chunks + 1].range, 5 * kPieceSize, 6 * kPieceSize - 1));
+        }
+    }
+}
+
+// The server honours no ranges, so the repair of a corrupted piece comes
+// back as a 200 with the whole body. It is refused before a byte of it is
+// written over the file.
+void repair_refuses_a_full_body() {
+    test::TempDir dir;
+    const std::string body = test::pattern_body(4 * kPieceSize, 9);
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add("http://fake/whole", body);
+    transport->ignore_ranges("http://fake/whole");
+    transport->corrupt_once("http://fake/whole", 3 * kPieceSize + 5);
+
+    DownloadManager manager(1, {}, transport);
+    manager.set_progress_enabled(false);
+    DownloadRequest request;
+    request.url = "http://fake/whole";
+    request.output_path = dir.file("whole");
+    request.preferred_chunks = 1;
+    request.pieces = hash_pieces(body);
+    manager.add(request);
+    const auto results = manager.run_all();
+
+    CHECK(results.size() == 1);
+    CHECK(results[0].status == DownloadStatus::Failed);
+    CHECK(results[0].error_message.find("ignored the range request") != std::string::npos);
+    const auto fetches = transport->fetches();
+    CHECK(fetches.size() == 2);
+    if (fetches.size() == 2) {
+        CHECK(same_range(fetches[1].range, 3 * kPieceSize, 4 * kPieceSize - 1));
+        CHECK(fetches[1].accepted == 0);
+    }
+}
+
+bool load_fails_with(const std::string& path, const std::string& expected) {
+    try {
+        load_piece_hashes(path);
+    } catch (const std::runtime_error& error) {
+        return std::string(error.what()).find(expected) != std::string::npos;
+    }
+    return false;
+}
+
+void malformed_lists_name_the_line() {
+    test::TempDir dir;
+    const std::string hash(64, 'a');
+
+    const std::string sidecar = dir.file("sidecar.pieces");
+    test::write_file(sidecar, "# pieces\npiece-size 64k\n" + hash + "\n");
+    CHECK(load_fails_with(sidecar, sidecar + ":2: bad piece size"));
+
+    test::write_file(sidecar, "piece-size 65536\n" + hash + "\nnot-a-hash\n");
+    CHECK(load_fails_with(sidecar, sidecar + ":3: bad piece hash"));
+
+    const std::string metalink = dir.file("file.meta4");
+    test::write_file(metalink, "<metalink>\n<file>\n<pieces length=\"\" type=\"sha-256\">\n<hash>" + hash +
+                                   "</hash>\n</pieces>\n</file>\n</metalink>\n");
+    CHECK(load_fails_with(metalink, metalink + ":3: bad piece size"));
+
+    test::write_file(sidecar, "piece-size 65536\n" + hash + "\n");
+    CHECK(load_piece_hashes(sidecar).piece_size == 65536);
+}
+
+}  // namespace
+
+int main() {
+    only_bad_pieces_are_fetched_again();
+    repair_refuses_a_full_body();
+    malformed_lists_name_the_line();
+    return test::exit_code();
+}
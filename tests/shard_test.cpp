@@ -0,0 +1,107 @@
+#include "downloader/shard.h"
+
+#include "test_support.h"
+
+#include <chrono>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace {
+
+using namespace downloader;
+using namespace std::chrono_literals;
+
+constexpr auto kLease = 400ms;
+
+DownloadResult completed() {
+    DownloadResult result;
+    result.status = DownloadStatus::Completed;
+    result.bytes = 42;
+    return result;
+}
+
+// A worker that stops renewing loses its claim once the lease has run out
+// on the observer's clock, and finds out on its next heartbeat.
+void expired_lease_is_reclaimed() {
+    test::TempDir dir;
+    const std::string path = dir.file("jobs.claims");
+    ClaimLog first(path, "first", "m", 2, kLease);
+    ClaimLog second(path, "second", "m", 2, kLease);
+
+    CHECK(first.claim() == 0u);
+    CHECK(second.claim() == 1u);
+    CHECK(!second.claim());
+
+    std::this_thread::sleep_for(kLease + 100ms);
+    CHECK(second.heartbeat().empty());
+    CHECK(second.claim() == 0u);
+
+    const auto lost = first.heartbeat();
+    CHECK(lost.size() == 1 && lost.front() == 0);
+    CHECK(!first.finish(0, completed()));
+    CHECK(second.finish(0, completed()));
+    CHECK(second.finish(1, completed()));
+    CHECK(first.settled());
+
+    const auto jobs = first.jobs();
+    CHECK(jobs[0].state == ShardJob::State::Done && jobs[0].worker == "second" && jobs[0].bytes == 42);
+}
+
+// Heartbeats keep a claim alive past its lease and rewrite the beats file in
+// place, so the log does not grow with them.
+void heartbeats_renew_in_place() {
+    test::TempDir dir;
+    const std::string path = dir.file("jobs.claims");
+    ClaimLog holder(path, "holder", "m", 1, kLease);
+    ClaimLog waiter(path, "waiter", "m", 1, kLease);
+    CHECK(holder.claim() == 0u);
+
+    const auto log_size = std::filesystem::file_size(path);
+    const auto beats_size = std::filesystem::file_size(path + ".beats");
+    for (int beat = 0; beat < 8; ++beat) {
+        std::this_thread::sleep_for(kLease / 4);
+        CHECK(holder.heartbeat().empty());
+        CHECK(!waiter.claim());
+    }
+    CHECK(std::filesystem::file_size(path) == log_size);
+    CHECK(std::filesystem::file_size(path + ".beats") == beats_size);
+}
+
+bool opening_fails(const std::string& path, const std::string& manifest, std::size_t job_count) {
+    try {
+        ClaimLog log(path, "late", manifest, job_count, kLease);
+    } catch (const std::runtime_error& error) {
+        return std::string(error.what()).find("different manifest") != std::string::npos;
+    }
+    return false;
+}
+
+void log_belongs_to_one_manifest() {
+    test::TempDir dir;
+    const std::string path = dir.file("jobs.claims");
+    {
+        ClaimLog log(path, "first", "m", 2, kLease);
+    }
+    CHECK(opening_fails(path, "other", 2));
+    CHECK(opening_fails(path, "m", 3));
+    CHECK(!opening_fails(path, "m", 2));
+
+    DownloadRequest a;
+    a.url = "http://host/a";
+    a.output_path = "a";
+    DownloadRequest b = a;
+    b.output_path = "b";
+    CHECK(manifest_digest({a, b}) != manifest_digest({b, a}));
+    CHECK(manifest_digest({a, b}) == manifest_digest({a, b}));
+}
+
+}  // namespace
+
+int main() {
+    expired_lease_is_reclaimed();
+    heartbeats_renew_in_place();
+    log_belongs_to_one_manifest();
+    return test::exit_code();
+}
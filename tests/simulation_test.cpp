@@ -0,0 +1,104 @@
+#include "downloader/download_manager.h"
+#include "downloader/simulated_transport.h"
+
+#include "test_support.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace downloader;
+using namespace std::chrono_literals;
+
+struct JobOutcome {
+    DownloadStatus status{DownloadStatus::Pending};
+    long http_status{0};
+    std::uint64_t bytes{0};
+    std::chrono::milliseconds elapsed{0};
+    std::string error_message;
+
+    bool operator==(const JobOutcome&) const = default;
+};
+
+struct RunOutcome {
+    std::vector<JobOutcome> jobs;
+    Clock::time_point finished_at{};
+    std::uint64_t transfers{0};
+    std::uint64_t connections_opened{0};
+    std::uint64_t failures{0};
+    std::uint64_t stalls{0};
+    std::uint64_t hedged_ranges{0};
+
+    bool operator==(const RunOutcome&) const = default;
+};
+
+// Whole and split jobs over a network that resets and stalls transfers,
+// with hedging on, so every scheduling path is in play.
+RunOutcome run_scenario(std::uint64_t seed) {
+    SimulationConfig network;
+    network.failure_rate = 0.05;
+    network.stall_rate = 0.1;
+    network.stall_duration = 2s;
+    network.delivery_size = 64 * 1024;
+    network.seed = seed;
+    auto transport = std::make_shared<SimulatedTransport>(network);
+    DownloadManager manager(4, {}, transport);
+    manager.set_progress_enabled(false);
+
+    std::vector<DownloadStatePtr> states;
+    for (std::size_t i = 0; i < 24; ++i) {
+        DownloadRequest request;
+        request.url = "https://host" + std::to_string(i % 3) + ".sim/file" + std::to_string(i);
+        request.output_path = "file" + std::to_string(i);
+        request.preferred_chunks = i % 2 == 0 ? 1 : 4;
+        request.hedge.enabled = true;
+        request.hedge.stall_timeout = 500ms;
+        request.target = DownloadTarget::Discard;
+        transport->add_resource(request.url, static_cast<std::int64_t>((1 << 20) + i * 97'531));
+        states.push_back(manager.add(std::move(request)));
+    }
+
+    RunOutcome outcome;
+    for (const auto& result : manager.run_all()) {
+        outcome.jobs.push_back(JobOutcome{result.status, result.http_status, result.bytes,
+                                          std::chrono::duration_cast<std::chrono::milliseconds>(result.elapsed),
+                                          result.error_message});
+    }
+    outcome.finished_at = transport->now();
+    const SimulationStats stats = transport->stats();
+    outcome.transfers = stats.transfers;
+    outcome.connections_opened = stats.connections_opened;
+    outcome.failures = stats.failures;
+    outcome.stalls = stats.stalls;
+    for (const auto& state : states) {
+        outcome.hedged_ranges += state->hedged_ranges.load();
+    }
+    return outcome;
+}
+
+// Two runs with the same seed and the same failure and stall rates play out
+// identically, down to each job's virtual elapsed time.
+void same_seed_same_run() {
+    const RunOutcome first = run_scenario(7);
+    const RunOutcome second = run_scenario(7);
+    CHECK(first.jobs.size() == 24);
+    // The scenario must actually exercise resets, stalls and hedges.
+    CHECK(first.failures > 0);
+    CHECK(first.stalls > 0);
+    CHECK(first.hedged_ranges > 0);
+    CHECK(first.finished_at > Clock::time_point{});
+    CHECK(first == second);
+
+    const RunOutcome other = run_scenario(8);
+    CHECK(!(other == first));
+}
+
+}  // namespace
+
+int main() {
+    same_seed_same_run();
+    return test::exit_code();
+}
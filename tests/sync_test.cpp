@@ -0,0 +1,139 @@
+#include "downloader/download_manager.h"
+#include "downloader/sha256.h"
+#include "downloader/sync.h"
+
+#include "fake_transport.h"
+#include "test_support.h"
+
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+
+namespace {
+
+using namespace downloader;
+
+constexpr const char* kUrl = "http://fake/synced";
+constexpr std::int64_t kLastModified = 1'700'000'000;
+
+std::string hex_sha256(const std::string& data) {
+    Sha256 hash;
+    hash.update(data.data(), data.size());
+    return Sha256::to_hex(hash.finish());
+}
+
+// Sets the modification time with a fractional second, as a plain write or
+// `touch` does.
+void touch(const std::string& path, std::int64_t seconds) {
+    struct timespec times[2] {};
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = static_cast<time_t>(seconds);
+    times[1].tv_nsec = 123'456'789;
+    CHECK(::utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+}
+
+bool stamped(const std::string& path, std::int64_t seconds) {
+    struct stat info {};
+    return ::stat(path.c_str(), &info) == 0 && info.st_mtim.tv_sec == seconds && info.st_mtim.tv_nsec == 0;
+}
+
+DownloadResult sync_one(const std::shared_ptr<test::FakeTransport>& transport, const std::string& path, SyncMode mode) {
+    DownloadManager manager(1, {}, transport);
+    manager.set_progress_enabled(false);
+    DownloadRequest request;
+    request.url = kUrl;
+    request.output_path = path;
+    request.preferred_chunks = 1;
+    request.sync = mode;
+    manager.add(request);
+    auto results = manager.run_all();
+    CHECK(results.size() == 1);
+    return results.empty() ? DownloadResult{} : std::move(results[0]);
+}
+
+// Size and modification time match the probe: nothing is fetched.
+void matching_metadata_is_skipped() {
+    test::TempDir dir;
+    const std::string body = test::pattern_body(64 * 1024, 3);
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add(kUrl, body);
+    transport->set_metadata(kUrl, kLastModified, {});
+
+    const std::string path = dir.file("same");
+    test::write_file(path, body);
+    CHECK(stamp_modification_time(path, kLastModified));
+
+    const DownloadResult result = sync_one(transport, path, SyncMode::Metadata);
+    CHECK(result.status == DownloadStatus::Completed);
+    CHECK(result.up_to_date);
+    CHECK(transport->fetches().empty());
+    CHECK(test::read_file(path) == body);
+}
+
+// A touched copy whose SHA-256 matches the probed Repr-Digest is skipped
+// and stamped, so the next run takes the metadata path. One whose content
+// differs is fetched.
+void touched_file_is_settled_by_digest() {
+    test::TempDir dir;
+    const std::string body = test::pattern_body(64 * 1024, 4);
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add(kUrl, body);
+    transport->set_metadata(kUrl, kLastModified, hex_sha256(body));
+
+    const std::string path = dir.file("touched");
+    test::write_file(path, body);
+    touch(path, kLastModified + 60);
+    DownloadResult result = sync_one(transport, path, SyncMode::Checksum);
+    CHECK(result.status == DownloadStatus::Completed);
+    CHECK(result.up_to_date);
+    CHECK(transport->fetches().empty());
+    CHECK(stamped(path, kLastModified));
+
+    // Metadata mode never hashes, so the same touched file is fetched.
+    touch(path, kLastModified + 60);
+    result = sync_one(transport, path, SyncMode::Metadata);
+    CHECK(!result.up_to_date);
+    CHECK(transport->fetches().size() == 1);
+
+    const std::string edited = test::pattern_body(body.size(), 5);
+    test::write_file(path, edited);
+    touch(path, kLastModified + 60);
+    result = sync_one(transport, path, SyncMode::Checksum);
+    CHECK(result.status == DownloadStatus::Completed);
+    CHECK(!result.up_to_date);
+    CHECK(transport->fetches().size() == 2);
+    CHECK(test::read_file(path) == body);
+    CHECK(stamped(path, kLastModified));
+}
+
+// The server's Last-Modified moved on: a same-sized file stamped with the
+// old time is fetched again and stamped with the new one.
+void changed_last_modified_forces_a_fetch() {
+    test::TempDir dir;
+    const std::string old_body = test::pattern_body(64 * 1024, 6);
+    const std::string new_body = test::pattern_body(64 * 1024, 7);
+    auto transport = std::make_shared<test::FakeTransport>();
+    transport->add(kUrl, new_body);
+    transport->set_metadata(kUrl, kLastModified + 3600, hex_sha256(new_body));
+
+    const std::string path = dir.file("stale");
+    test::write_file(path, old_body);
+    CHECK(stamp_modification_time(path, kLastModified));
+
+    const DownloadResult result = sync_one(transport, path, SyncMode::Metadata);
+    CHECK(result.status == DownloadStatus::Completed);
+    CHECK(!result.up_to_date);
+    CHECK(transport->fetches().size() == 1);
+    CHECK(test::read_file(path) == new_body);
+    CHECK(stamped(path, kLastModified + 3600));
+}
+
+}  // namespace
+
+int main() {
+    matching_metadata_is_skipped();
+    touched_file_is_settled_by_digest();
+    changed_last_modified_forces_a_fetch();
+    return test::exit_code();
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <system_error>
+
+// A deliberately small harness: a failed CHECK reports the expression and
+// carries on, and the test's main() returns test::exit_code().
+namespace test {
+
+inline int g_failures = 0;
+
+inline void fail(const char* file, int line, const char* expression) {
+    ++g_failures;
+    std::cerr << file << ':' << line << ": CHECK(" << expression << ") failed\n";
+}
+
+inline int exit_code() {
+    if (g_failures > 0) {
+        std::cerr << g_failures << " check(s) failed\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// A fresh directory under the system temp directory, removed with its
+// contents on destruction.
+class TempDir {
+public:
+    TempDir() {
+        std::string pattern = (std::filesystem::temp_directory_path() / "downloader-test-XXXXXX").string();
+        if (::mkdtemp(pattern.data()) == nullptr) {
+            std::cerr << "mkdtemp failed\n";
+            std::exit(EXIT_FAILURE);
+        }
+        path_ = pattern;
+    }
+    ~TempDir() {
+        std::error_code ignored;
+        std::filesystem::remove_all(path_, ignored);
+    }
+
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+
+    std::string file(const std::string& name) const { return (path_ / name).string(); }
+
+private:
+    std::filesystem::path path_;
+};
+
+// Bytes that differ from block to block, so misplaced writes show up.
+inline std::string pattern_body(std::size_t size, std::uint32_t seed = 1) {
+    std::string body(size, '\0');
+    std::uint32_t state = seed;
+    for (char& ch : body) {
+        state = state * 1664525u + 1013904223u;
+        ch = static_cast<char>(state >> 24);
+    }
+    return body;
+}
+
+inline std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+inline void write_file(const std::string& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+}  // namespace test
+
+#define CHECK(expression)                                    \
+    do {                                                     \
+        if (!(expression)) {                                 \
+            ::test::fail(__FILE__, __LINE__, #expression);   \
+        }                                                    \
+    } while (false)
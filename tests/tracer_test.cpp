@@ -0,0 +1,67 @@
+#include "downloader/tracer.h"
+
+#include "test_support.h"
+
+#include <charconv>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace downloader;
+
+// The "ts" values in trace order, parsed back as nanoseconds. The writer
+// emits fixed-point microseconds with three decimals.
+std::vector<std::uint64_t> timestamps_ns(const std::string& json) {
+    std::vector<std::uint64_t> out;
+    const std::string key = "\"ts\":";
+    for (std::size_t at = json.find(key); at != std::string::npos; at = json.find(key, at)) {
+        at += key.size();
+        const char* const end = json.data() + json.size();
+        std::uint64_t micros = 0;
+        auto parsed = std::from_chars(json.data() + at, end, micros);
+        CHECK(parsed.ec == std::errc());
+        if (parsed.ptr == end || *parsed.ptr != '.') {
+            CHECK(!"ts has no fractional part");
+            out.push_back(micros * 1000);
+            continue;
+        }
+        const char* const fraction_begin = parsed.ptr + 1;
+        std::uint64_t fraction = 0;
+        parsed = std::from_chars(fraction_begin, end, fraction);
+        CHECK(parsed.ec == std::errc());
+        CHECK(parsed.ptr - fraction_begin == 3);
+        out.push_back(micros * 1000 + fraction);
+    }
+    return out;
+}
+
+// Events a few nanoseconds apart more than an hour into a trace keep their
+// exact offsets and their order.
+void long_trace_keeps_nanosecond_offsets() {
+    Tracer::enable();
+    const std::uint32_t track = Tracer::new_track("chunk 0");
+    const std::uint64_t origin = 1'000'000'000;
+    const std::vector<std::uint64_t> offsets = {
+        0, 999, 1'234'567'891, 1'234'568'891, 1'234'568'892, 3'600'000'000'001,
+    };
+    Tracer::record_at(origin + offsets[0], track, TraceEvent::TransferBegin, 0, 100);
+    for (std::size_t i = 1; i + 1 < offsets.size(); ++i) {
+        Tracer::record_at(origin + offsets[i], track, TraceEvent::WriteBatch, static_cast<std::int64_t>(i), 1);
+    }
+    Tracer::record_at(origin + offsets.back(), track, TraceEvent::TransferEnd, 1, 206);
+
+    std::ostringstream out;
+    Tracer::write_chrome_trace(out);
+    const std::string json = out.str();
+    CHECK(timestamps_ns(json) == offsets);
+}
+
+}  // namespace
+
+int main() {
+    long_trace_keeps_nanosecond_offsets();
+    return test::exit_code();
+}
@@ -0,0 +1,101 @@
+#include "downloader/download_manager.h"
+#include "downloader/file_writer.h"
+#include "downloader/write_pipeline.h"
+
+#include "fake_transport.h"
+#include "test_support.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+namespace {
+
+using namespace downloader;
+
+bool wait_for_free_buffer(const WritePipeline& pipeline) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!pipeline.has_free_buffer()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Two streams each hold a partly filled buffer of a two-buffer pool, so the
+// next append that needs a fresh buffer must pause, hand its partial buffer
+// over, and be accepted unchanged once that buffer has been written.
+void pool_exhaustion_pauses_and_resumes() {
+    test::TempDir dir;
+    const std::string path = dir.file("out.bin");
+    WritePipeline pipeline(PipelineConfig{16 * 1024, 2, 1});
+    const std::size_t capacity = pipeline.buffer_size();
+    const std::string chunk = test::pattern_body(capacity, 7);
+    {
+        FileWriter file(path, FileWriter::Mode::ReadWriteTruncate);
+        WriteStream first(pipeline, file, 0);
+        WriteStream second(pipeline, file, 1 << 20);
+
+        CHECK(first.append("a", 1) == WriteStream::Status::Accepted);
+        CHECK(second.append("b", 1) == WriteStream::Status::Accepted);
+        CHECK(!pipeline.has_free_buffer());
+
+        CHECK(first.append(chunk.data(), chunk.size()) == WriteStream::Status::PoolExhausted);
+        CHECK(pipeline.stats().pauses == 1);
+
+        CHECK(wait_for_free_buffer(pipeline));
+        CHECK(first.append(chunk.data(), chunk.size()) == WriteStream::Status::Accepted);
+
+        std::string error;
+        CHECK(first.finish(error));
+        CHECK(second.finish(error));
+    }
+
+    const std::string written = test::read_file(path);
+    CHECK(written.size() == (1 << 20) + 1);
+    CHECK(written.substr(0, 1) == "a");
+    CHECK(written.substr(1, chunk.size()) == chunk);
+    CHECK(written.substr(1 << 20) == "b");
+    CHECK(pipeline.stats().buffers_in_use == 0);
+}
+
+// Whole and split downloads through a pool far smaller than the bodies: the
+// transfers are paused and resumed many times and must still land every byte
+// at its offset.
+void downloads_survive_backpressure() {
+    test::TempDir dir;
+    auto transport = std::make_shared<test::FakeTransport>();
+    const std::string body = test::pattern_body((3 << 20) + 12345);
+    transport->add("http://fake/body", body);
+
+    DownloadManager manager(2, PipelineConfig{16 * 1024, 2, 1}, transport);
+    manager.set_progress_enabled(false);
+    for (const std::size_t chunks : {1, 4}) {
+        DownloadRequest request;
+        request.url = "http://fake/body";
+        request.output_path = dir.file("chunks" + std::to_string(chunks));
+        request.preferred_chunks = chunks;
+        manager.add(request);
+    }
+    const auto results = manager.run_all();
+
+    for (const auto& result : results) {
+        CHECK(result.status == DownloadStatus::Completed);
+        CHECK(result.bytes == body.size());
+        CHECK(test::read_file(result.output_path) == body);
+    }
+    const PipelineStats stats = manager.pipeline_stats();
+    CHECK(stats.peak_buffers_in_use <= stats.buffer_count);
+    CHECK(stats.buffers_in_use == 0);
+    CHECK(stats.bytes_written == 2 * body.size());
+}
+
+}  // namespace
+
+int main() {
+    pool_exhaustion_pauses_and_resumes();
+    downloads_survive_backpressure();
+    return test::exit_code();
+}